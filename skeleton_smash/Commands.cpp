@@ -1,7 +1,11 @@
 #include "Commands.h"
+#include "signals.h"
+#include "textscan.h"
+#include "jobboard.h"
 #include "signal.h"
 #include <unistd.h>
 #include <sys/wait.h>
+#include <sys/syscall.h>
 #include <iostream>
 #include <sstream>
 #include <iomanip>
@@ -11,7 +15,26 @@
 #include <fcntl.h>
 #include <dirent.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <regex.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <arpa/inet.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#ifndef IFF_LOWER_UP
+#define IFF_LOWER_UP 0x10000 // <linux/if.h> clashes with <net/if.h>
+#endif
+#include <poll.h>
+#include <time.h>
 #include <algorithm>
+#include <cmath>
+#include <fstream>
 #include <regex>
 
 using namespace std;
@@ -28,54 +51,190 @@ std::string _trim(const std::string& str) {
 	size_t end = str.find_last_not_of(WHITESPACE);
 	return (start == std::string::npos) ? "" : str.substr(start, end - start + 1);
 }
-int _parseCommandLine(const std::string& cmd_line, char** args) {
-	if (cmd_line.empty()) {
-		args[0] = nullptr;
-		return 0;
+int _parseCommandLine(const std::string& cmd_line, ArgVector& args, ShellSession& session) {
+	return args.parse(cmd_line, &session.getGlobListings(), session.getCwdFd());
+}
+bool isDirectory(const std::string& path) {
+	struct stat statbuf;
+	if (stat(path.c_str(), &statbuf) != 0) {
+		return false;
+	}
+	return S_ISDIR(statbuf.st_mode);
+}
+// Lexically resolves target against base, folding "." and ".." components
+std::string _resolvePath(const std::string& base, const std::string& target) {
+	std::string joined = (!target.empty() && target[0] == '/') ? target : base + "/" + target;
+	std::vector<std::string> parts;
+	std::istringstream iss(joined);
+	for (std::string part; std::getline(iss, part, '/');) {
+		if (part.empty() || part == ".") continue;
+		if (part == "..") {
+			if (!parts.empty()) parts.pop_back();
+			continue;
+		}
+		parts.push_back(part);
 	}
 
-	int i = 0;
-	std::istringstream iss(_trim(cmd_line));
-	for (std::string token; iss >> token;) {
-		// If the token ends with '&', split it into two arguments
-		if (token.back() == '&' && token.length() > 1) {
-			token.pop_back();  // Remove the trailing '&'
-			args[i] = strdup(token.c_str());  // Add the token without '&'
-			if (!args[i]) {
-				perror("smash error: malloc failed");
-				exit(1);
-			}
-			i++;
+	std::string resolved;
+	for (const auto& part : parts) {
+		resolved += "/" + part;
+	}
+	return resolved.empty() ? "/" : resolved;
+}
+// Opens a directory, walking it component by component when the path is
+// longer than the kernel accepts in one call
+int _openDirectory(const std::string& path) {
+	int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd != -1 || errno != ENAMETOOLONG) {
+		return fd;
+	}
 
-			args[i] = strdup("&");  // Add '&' as a separate argument
-			if (!args[i]) {
-				perror("smash error: malloc failed");
-				exit(1);
-			}
-			i++;
+	fd = open(path[0] == '/' ? "/" : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	std::istringstream iss(path);
+	for (std::string part; fd != -1 && std::getline(iss, part, '/');) {
+		if (part.empty()) continue;
+		int next = openat(fd, part.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		int savedErrno = errno;
+		close(fd);
+		errno = savedErrno;
+		fd = next;
+	}
+	return fd;
+}
+// pidfds pin a process: unlike its pid, the fd never comes to name another
+// process once the original was reaped
+int _pidfdOpen(int pid) {
+#ifdef SYS_pidfd_open
+	return syscall(SYS_pidfd_open, pid, 0);
+#else
+	(void)pid;
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+int _pidfdSendSignal(int pidFd, int sig) {
+#ifdef SYS_pidfd_send_signal
+	return syscall(SYS_pidfd_send_signal, pidFd, sig, nullptr, 0);
+#else
+	(void)pidFd;
+	(void)sig;
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+#ifndef PIDFD_SIGNAL_PROCESS_GROUP
+#define PIDFD_SIGNAL_PROCESS_GROUP (1U << 2)
+#endif
+// Signals the process group the pidfd's process leads; kernels before 6.9
+// fail with EINVAL
+static int _pidfdSignalGroup(int pidFd, int sig) {
+#ifdef SYS_pidfd_send_signal
+	return syscall(SYS_pidfd_send_signal, pidFd, sig, nullptr, PIDFD_SIGNAL_PROCESS_GROUP);
+#else
+	(void)pidFd;
+	(void)sig;
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+// Reports a failure in a forked child of the shell. The shell has threads by
+// then, so the child may only make async-signal-safe calls: no stdio, no
+// strerror, no allocation.
+static void _childError(const char* what, int err) {
+	static const std::pair<int, const char*> REASONS[] = {
+		{ ENOENT, "No such file or directory" }, { EACCES, "Permission denied" },
+		{ ENOEXEC, "Exec format error" }, { ENOTDIR, "Not a directory" }, { EISDIR, "Is a directory" },
+		{ ENOMEM, "Cannot allocate memory" }, { E2BIG, "Argument list too long" },
+		{ ELOOP, "Too many levels of symbolic links" }, { ETXTBSY, "Text file busy" },
+		{ ENAMETOOLONG, "File name too long" }, { EBADF, "Bad file descriptor" }, { EMFILE, "Too many open files" }
+	};
+	char message[160] = "smash error: ";
+	size_t length = strlen(message);
+	auto append = [&](const char* text) {
+		for (; *text && length < sizeof(message) - 1; ++text) message[length++] = *text;
+	};
+	append(what);
+	append(" failed: ");
+	const char* reason = nullptr;
+	for (const auto& entry : REASONS) {
+		if (entry.first == err) reason = entry.second;
+	}
+	if (reason) {
+		append(reason);
+	}
+	else {
+		char digits[16];
+		int count = 0;
+		for (unsigned value = err; count == 0 || value; value /= 10) digits[count++] = '0' + value % 10;
+		append("error ");
+		while (count > 0 && length < sizeof(message) - 1) message[length++] = digits[--count];
+	}
+	message[length++] = '\n';
+	ssize_t ignored = write(STDERR_FILENO, message, length);
+	(void)ignored;
+}
+// Signal number from "9", "KILL" or "SIGKILL"; -1 if unknown
+int _parseSignal(const std::string& text) {
+	static const std::pair<const char*, int> NAMES[] = {
+		{ "HUP", SIGHUP }, { "INT", SIGINT }, { "QUIT", SIGQUIT }, { "ILL", SIGILL }, { "TRAP", SIGTRAP },
+		{ "ABRT", SIGABRT }, { "BUS", SIGBUS }, { "FPE", SIGFPE }, { "KILL", SIGKILL }, { "USR1", SIGUSR1 },
+		{ "SEGV", SIGSEGV }, { "USR2", SIGUSR2 }, { "PIPE", SIGPIPE }, { "ALRM", SIGALRM }, { "TERM", SIGTERM },
+		{ "CHLD", SIGCHLD }, { "CONT", SIGCONT }, { "STOP", SIGSTOP }, { "TSTP", SIGTSTP }, { "TTIN", SIGTTIN },
+		{ "TTOU", SIGTTOU }, { "URG", SIGURG }, { "XCPU", SIGXCPU }, { "XFSZ", SIGXFSZ }, { "VTALRM", SIGVTALRM },
+		{ "PROF", SIGPROF }, { "WINCH", SIGWINCH }, { "IO", SIGIO }, { "PWR", SIGPWR }, { "SYS", SIGSYS }
+	};
+	if (text.empty()) {
+		return -1;
+	}
+	// Numbers are passed on unchecked, for the kernel to judge
+	if (text.find_first_not_of("0123456789") == std::string::npos) {
+		return text.size() <= 9 ? atoi(text.c_str()) : -1;
+	}
+	std::string name = text.compare(0, 3, "SIG") == 0 ? text.substr(3) : text;
+	for (const auto& entry : NAMES) {
+		if (name == entry.first) return entry.second;
+	}
+	return -1;
+}
+// Substitutes $VAR, ${VAR} and $? outside single quotes
+std::string _expandVariables(const std::string& text, const Environment& env, int lastStatus) {
+	if (text.find('$') == std::string::npos) {
+		return text;
+	}
+
+	std::string result;
+	bool inQuote = false;
+	for (size_t i = 0; i < text.size(); ++i) {
+		char c = text[i];
+		if (c == '\'') inQuote = !inQuote;
+		if (inQuote || c != '$' || i + 1 == text.size()) {
+			result += c;
+			continue;
 		}
-		else {
-			// Normal token handling
-			args[i] = strdup(token.c_str());
-			if (!args[i]) {
-				perror("smash error: malloc failed");
-				exit(1);
-			}
+
+		if (text[i + 1] == '?') {
+			result += std::to_string(lastStatus);
 			i++;
+			continue;
 		}
 
-		if (i >= COMMAND_MAX_ARGS - 1) break;
-	}
+		size_t nameStart = i + 1;
+		bool braced = text[nameStart] == '{';
+		if (braced) nameStart++;
+		size_t nameEnd = nameStart;
+		while (nameEnd < text.size() && (isalnum((unsigned char)text[nameEnd]) || text[nameEnd] == '_')) {
+			nameEnd++;
+		}
+		if (nameEnd == nameStart || (braced && (nameEnd == text.size() || text[nameEnd] != '}'))) {
+			result += c; // Not a variable reference
+			continue;
+		}
 
-	args[i] = nullptr;  // Null-terminate the argument list
-	return i;
-}
-bool isDirectory(const std::string& path) {
-	struct stat statbuf;
-	if (stat(path.c_str(), &statbuf) != 0) {
-		return false;
+		const char* value = env.get(text.substr(nameStart, nameEnd - nameStart));
+		if (value) result += value;
+		i = braced ? nameEnd : nameEnd - 1;
 	}
-	return S_ISDIR(statbuf.st_mode);
+	return result;
 }
 void _trimAmp(std::string& cmd_line) {
 	cmd_line = _trim(cmd_line); // Remove leading/trailing spaces
@@ -84,724 +243,4186 @@ void _trimAmp(std::string& cmd_line) {
 		cmd_line = _trim(cmd_line); // Clean up trailing spaces again
 	}
 }
+bool _hasGlobChars(const std::string& word) {
+	return word.find_first_of("*?[") != std::string::npos;
+}
 
 
-// ctrlC Handler
-void ctrlCHandler(int sig_num) {
-	SmallShell& shell = SmallShell::getInstance();
-	int fgPid = shell.getForegroundPid();
+// Glob expansion
+struct GlobContext {
+	std::vector<std::string> segments;
+	std::vector<GlobPattern> patterns;
+	bool dirsOnly; // The word ended with '/'
+	int baseFd;    // Relative words are expanded against this directory
+	DirListingCache& listings;
+	StringPool& out;
+	std::vector<size_t>& matches;
+};
 
-	cout << "smash: got ctrl-C" << endl;
+static void _globEmit(GlobContext& ctx, const std::string& path) {
+	std::string full = ctx.dirsOnly ? path + "/" : path;
+	ctx.matches.push_back(ctx.out.add(full.data(), full.size()));
+}
 
-	if (fgPid > 0) {
-		if (kill(fgPid, SIGKILL) == -1) {
-			perror("smash error: kill failed");
+static void _globSegments(GlobContext& ctx, size_t index, const std::string& prefix);
+
+// "**" matches zero or more directories; as the last segment it matches every
+// entry below prefix. Symbolic links to directories are not followed.
+static void _globStar(GlobContext& ctx, size_t index, const std::string& prefix) {
+	bool last = index + 1 == ctx.segments.size();
+	if (!last) {
+		_globSegments(ctx, index + 1, prefix);
+	}
+
+	std::shared_ptr<const DirListingCache::Listing> listing = ctx.listings.list(ctx.baseFd, prefix.empty() ? "." : prefix);
+	if (!listing) return;
+	for (const auto& entry : listing->entries) {
+		const char* name = listing->names.get(entry.name);
+		if (name[0] == '.') continue;
+		if (last && (!ctx.dirsOnly || entry.isDir)) {
+			_globEmit(ctx, prefix + name);
 		}
-		else {
-			cout << "smash: process " << fgPid << " was killed" << endl;
+		if (entry.isDir && !entry.isLink) {
+			_globStar(ctx, index, prefix + name + "/");
 		}
-		shell.clearForegroundJob(); // Clear the foreground job
 	}
 }
 
+static void _globSegments(GlobContext& ctx, size_t index, const std::string& prefix) {
+	bool last = index + 1 == ctx.segments.size();
+	const std::string& segment = ctx.segments[index];
+	if (segment == "**") {
+		_globStar(ctx, index, prefix);
+		return;
+	}
 
-// Signal handler for SIGCHLD
-void sigchldHandler(int sig_num) {
-	(void)sig_num; // Suppress unused warning
-	int status;
-	pid_t pid;
-
-	// Reap terminated child processes
-	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
-		SmallShell& shell = SmallShell::getInstance();
-		JobsList& jobsList = shell.getJobsList();
-
-		// Remove the job from the jobs list
-		for (auto it = jobsList.getJobs().begin(); it != jobsList.getJobs().end(); ++it) {
-			if ((*it)->pid == pid) {
-				jobsList.removeJobById((*it)->m_job_id);
-				break;
-			}
+	// Literal components need no listing, only an existence check at the end
+	if (!_hasGlobChars(segment)) {
+		std::string path = prefix + segment;
+		if (!last) {
+			_globSegments(ctx, index + 1, path + "/");
+			return;
+		}
+		struct stat st;
+		int flags = ctx.dirsOnly ? 0 : AT_SYMLINK_NOFOLLOW;
+		if (fstatat(ctx.baseFd, path.c_str(), &st, flags) == 0 && (!ctx.dirsOnly || S_ISDIR(st.st_mode))) {
+			_globEmit(ctx, path);
 		}
+		return;
 	}
-}
 
-
-// Setup signal handling for SIGCHLD
-void setupSignals() {
-	struct sigaction sa;
-	sa.sa_handler = ctrlCHandler;
-	sa.sa_flags = SA_RESTART; // Restart system calls if interrupted
-	if (sigaction(SIGINT, &sa, nullptr) == -1) {
-		perror("smash error: sigaction failed");
+	std::shared_ptr<const DirListingCache::Listing> listing = ctx.listings.list(ctx.baseFd, prefix.empty() ? "." : prefix);
+	if (!listing) return;
+	GlobPattern& pattern = ctx.patterns[index];
+	for (const auto& entry : listing->entries) {
+		const char* name = listing->names.get(entry.name);
+		if (!pattern.matches(name)) continue;
+		if (last) {
+			if (!ctx.dirsOnly || entry.isDir) _globEmit(ctx, prefix + name);
+		}
+		else if (entry.isDir) {
+			_globSegments(ctx, index + 1, prefix + name + "/");
+		}
 	}
 }
 
-
-// Command Class
-Command::Command(const char* cmd_line)
-	: cmdSegments(), m_PID(-1), m_is_background(false), m_cmd_line(cmd_line) {
-}
-Command::~Command() {}
-int Command::getm_PID() const { return m_PID; }
-void Command::setm_PID(int pid) { m_PID = pid; }
-std::string Command::getAlias() const { return alias; }
-void Command::setAlias(const std::string& aliasCommand) { alias = aliasCommand; }
-std::string Command::getPath() const { return m_file_redirect; }
-void Command::setPath(const std::string& path) { m_file_redirect = path; }
-std::string Command::getCommandLine() const {
-	if (!m_cmd_line.empty()) {
-		return m_cmd_line; // Return the original command line if available
+// Expands one word into the sorted paths it matches; false if the word is not
+// a glob or nothing matched, in which case it is kept literally
+bool _expandGlob(const std::string& word, int baseFd, DirListingCache& listings, StringPool& out,
+	std::vector<size_t>& matches) {
+	matches.clear();
+	if (!_hasGlobChars(word) || word.find_first_of("'\"\\") != std::string::npos) {
+		return false; // Quoted words are never expanded
 	}
 
-	// Reconstruct the command line from segments
-	std::ostringstream oss;
-	for (size_t i = 0; i < cmdSegments.size(); ++i) {
-		oss << cmdSegments[i];
-		if (i < cmdSegments.size() - 1) {
-			oss << " ";
-		}
+	GlobContext ctx{ {}, {}, word.back() == '/', baseFd, listings, out, matches };
+	std::istringstream iss(word);
+	for (std::string segment; std::getline(iss, segment, '/');) {
+		if (segment.empty()) continue;
+		ctx.segments.push_back(segment);
+		ctx.patterns.emplace_back(segment);
 	}
-	if (m_is_background) {
-		oss << " &";
+	if (ctx.segments.empty()) {
+		return false;
 	}
-	return oss.str();
+
+	_globSegments(ctx, 0, word[0] == '/' ? "/" : "");
+	std::sort(matches.begin(), matches.end(), [&out](size_t a, size_t b) {
+		return strcmp(out.get(a), out.get(b)) < 0;
+	});
+	return !matches.empty();
 }
 
 
-// BuiltInCommand Class
-BuiltInCommand::BuiltInCommand(const char* cmd_line) : Command(cmd_line) {}
-BuiltInCommand::~BuiltInCommand() {}
+// StringPool Class
+size_t StringPool::add(const char* text, size_t length) {
+	size_t offset = data.size();
+	data.insert(data.end(), text, text + length);
+	data.push_back('\0');
+	return offset;
+}
 
 
-// ExternalCommand Class
-ExternalCommand::ExternalCommand(const char* cmd_line) : Command(cmd_line) {}
-ExternalCommand::~ExternalCommand() {
-	// Free dynamically allocated memory in cmdSegments
-	for (auto& segment : cmdSegments) {
-		free(const_cast<char*>(segment.c_str())); // Deallocate memory used for command arguments
+// SortedNames Class
+static const int NAMES_MEMORY = -1;
+static const int NAMES_NONE = -2;
+static const size_t NAMES_MIN_RUN_SHARE = 16;  // A list may always use this share of the budget before spilling
+static const size_t NAMES_WRITE_CHUNK = 1 << 16;
+static const size_t NAMES_MIN_BUFFER = 4096;   // Above NAME_MAX, so a buffer always holds a whole name
+static const size_t NAMES_MAX_BUFFER = 1 << 16;
+static const size_t NAMES_MAX_FANIN = 64;      // Runs merged at once
+
+static int _openTempFile(const std::string& dir) {
+	std::string path = dir.empty() ? "/tmp" : dir;
+	int fd = open(path.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+	if (fd != -1 || (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL)) {
+		return fd;
 	}
-	cmdSegments.clear();
+	std::string pattern = path + "/smash-XXXXXX";
+	std::vector<char> name(pattern.begin(), pattern.end());
+	name.push_back('\0');
+	fd = mkostemp(name.data(), O_CLOEXEC);
+	if (fd != -1) {
+		unlink(name.data());
+	}
+	return fd;
 }
-void ExternalCommand::execute() {
-	char* args[COMMAND_MAX_ARGS];
-	int argc = _parseCommandLine(m_cmd_line, args);
-
-	if (argc == 0) return;
 
-	// Check for background execution
-	bool m_is_background = false;
-	if (strcmp(args[argc - 1], "&") == 0) {
-		m_is_background = true;
-		free(args[argc - 1]);
-		args[argc - 1] = nullptr;
+SortedNames::Budget::~Budget() {
+	if (spillFd >= 0) {
+		close(spillFd);
 	}
-
-	pid_t pid = fork();
-	if (pid == 0) { // Child process
-		setpgrp(); // Create a new process group
-		execvp(args[0], args); // Execute command
-		perror("smash error: execvp failed");
-		exit(1);
+}
+SortedNames::SortedNames(Budget& budget, const std::string& tempDir)
+	: budget(budget), tempDir(tempDir), charged(0), memoryPos(0), lastSource(NAMES_NONE), failed(false) {}
+SortedNames::~SortedNames() {
+	for (const auto& run : runs) {
+		discard(run);
 	}
-	else if (pid > 0) { // Parent process
-		SmallShell& shell = SmallShell::getInstance();
-		if (m_is_background) {
-			shell.getJobsList().addJob(m_cmd_line, pid, false);
-		}
-		else {
-			shell.setForegroundJob(pid, m_cmd_line);
-			waitpid(pid, nullptr, WUNTRACED);
-			shell.clearForegroundJob();
-		}
+	budget.used -= charged;
+}
+void SortedNames::recharge() {
+	size_t bytes = pool.capacity() + offsets.capacity() * sizeof(size_t);
+	for (const auto& run : runs) {
+		bytes += run.buffer.capacity();
 	}
-	else { // Fork failed
-		perror("smash error: fork failed");
+	budget.used = budget.used - charged + bytes;
+	charged = bytes;
+}
+void SortedNames::add(const char* name, size_t length) {
+	// Spill before the pool or the offsets would double past the budget,
+	// unless this list is still small; the lists of the parent directories
+	// may be holding most of it
+	size_t growth = 0;
+	if (pool.bytes() + length + 1 > pool.capacity()) {
+		growth += std::max(pool.capacity(), length + 1);
 	}
-
-	// Free allocated arguments
-	for (int i = 0; i < argc; ++i) {
-		free(args[i]);
+	if (offsets.size() == offsets.capacity()) {
+		growth += std::max(offsets.capacity(), (size_t)1) * sizeof(size_t);
+	}
+	if (growth > 0 && !offsets.empty() && budget.used + growth > budget.limit
+		&& charged + growth > budget.limit / NAMES_MIN_RUN_SHARE) {
+		spill();
 	}
+	offsets.push_back(pool.add(name, length));
+	recharge();
 }
-
-
-// ChangePromptCommand Class
-ChangePromptCommand::ChangePromptCommand(const char* cmd_line, std::string& prompt)
-	: BuiltInCommand(cmd_line), prompt(prompt) {}
-ChangePromptCommand::~ChangePromptCommand() {}
-void ChangePromptCommand::execute() {
-	char* args[COMMAND_MAX_ARGS];
-	int argc = _parseCommandLine(m_cmd_line, args);
-
-	if (argc == 1) {
-		// No argument provided, reset to "smash"
-		prompt = "smash";
+// Writes what is in memory as one sorted run. Should the temporary file fail,
+// the names simply stay in memory.
+bool SortedNames::spill() {
+	if (budget.spillFd == NAMES_NONE) {
+		return false;
 	}
-	else {
-		// Update the prompt with the first argument
-		prompt = args[1];
+	if (budget.spillFd == -1) {
+		budget.spillFd = _openTempFile(tempDir);
+		if (budget.spillFd == -1) {
+			budget.spillFd = NAMES_NONE;
+			return false;
+		}
 	}
+	std::sort(offsets.begin(), offsets.end(), [this](size_t a, size_t b) {
+		return strcmp(pool.get(a), pool.get(b)) < 0;
+	});
 
-	// Free allocated memory
-	for (int i = 0; i < argc; ++i) {
-		free(args[i]);
+	Run run;
+	run.start = run.next = budget.spillSize;
+	std::vector<char> chunk;
+	chunk.reserve(NAMES_WRITE_CHUNK + NAME_MAX + 1);
+	for (size_t offset : offsets) {
+		const char* name = pool.get(offset);
+		chunk.insert(chunk.end(), name, name + strlen(name) + 1);
+		if (chunk.size() >= NAMES_WRITE_CHUNK && !append(chunk)) break;
+	}
+	if (!append(chunk)) {
+		return false;
 	}
+	run.end = budget.spillSize;
+	run.pos = run.filled = 0;
+	runs.push_back(std::move(run));
+	pool.clear();
+	offsets.clear();
+	return true;
 }
-
-
-// ChangeDirCommand Class
-ChangeDirCommand::ChangeDirCommand(const char* cmd_line)
-	: BuiltInCommand(cmd_line) {}
-ChangeDirCommand::~ChangeDirCommand() {}
-void ChangeDirCommand::execute() {
-	SmallShell& shell = SmallShell::getInstance();
-
-	// No arguments: Do nothing
-	if (cmdSegments.size() == 1) {
-		return;
+// Adds the chunk at the end of the temporary file and empties it. After a
+// failed write the file takes no more runs, but those in it stay readable.
+bool SortedNames::append(std::vector<char>& chunk) {
+	if (budget.spillFd < 0) {
+		return false;
 	}
-
-	// Too many arguments: Print error and return
-	if (cmdSegments.size() > 2) {
-		std::cerr << "smash error: cd: too many arguments" << std::endl;
-		return;
+	if (!chunk.empty() && pwrite(budget.spillFd, chunk.data(), chunk.size(), budget.spillSize) != (ssize_t)chunk.size()) {
+		close(budget.spillFd);
+		budget.spillFd = NAMES_NONE;
+		return false;
 	}
-
-	const std::string& targetDir = cmdSegments[1];
-	char* currentDir = getcwd(nullptr, 0); // Get the current working directory
-	if (!currentDir) {
-		perror("smash error: getcwd failed");
-		return;
+	budget.spillSize += chunk.size();
+	chunk.clear();
+	return true;
+}
+// Read buffers come out of what the lists still open have left of the budget
+size_t SortedNames::bufferSize(size_t runCount) const {
+	size_t left = budget.limit - std::min(budget.used - charged, budget.limit);
+	return std::min(std::max(left / (4 * runCount), NAMES_MIN_BUFFER), NAMES_MAX_BUFFER);
+}
+// Gives the disk space of a run that will not be read again back to the file
+void SortedNames::discard(const Run& run) {
+	if (budget.spillFd >= 0 && run.end > run.start) {
+		fallocate(budget.spillFd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, run.start, run.end - run.start);
+	}
+}
+// Merges the oldest runs into one at the end of the file, so that reading
+// never needs more than NAMES_MAX_FANIN buffers at once
+bool SortedNames::mergeRuns(size_t count) {
+	std::vector<int> sources;
+	for (size_t i = 0; i < count; ++i) {
+		runs[i].buffer.resize(bufferSize(count));
+		if (fill(runs[i])) {
+			sources.push_back(i);
+		}
 	}
+	auto later = [this](int a, int b) { return strcmp(head(a), head(b)) > 0; };
+	std::make_heap(sources.begin(), sources.end(), later);
 
-	// Handle "cd -": Change to the last working directory
-	if (targetDir == "-") {
-		if (shell.getLastDir().empty()) {
-			std::cerr << "smash error: cd: OLDPWD not set" << std::endl;
-			free(currentDir);
-			return;
+	Run merged;
+	merged.start = merged.next = budget.spillSize;
+	std::vector<char> chunk;
+	chunk.reserve(NAMES_WRITE_CHUNK + NAME_MAX + 1);
+	while (!sources.empty() && !failed) {
+		std::pop_heap(sources.begin(), sources.end(), later);
+		int source = sources.back();
+		const char* name = head(source);
+		chunk.insert(chunk.end(), name, name + strlen(name) + 1);
+		if (chunk.size() >= NAMES_WRITE_CHUNK && !append(chunk)) {
+			failed = true;
+			return false;
 		}
-		if (chdir(shell.getLastDir().c_str()) == -1) {
-			perror("smash error: chdir failed");
+		if (advance(source)) {
+			std::push_heap(sources.begin(), sources.end(), later);
 		}
 		else {
-			shell.setLastDir(currentDir); // Update lastWorkingDir with the previous directory
+			sources.pop_back();
 		}
-		free(currentDir);
-		return;
 	}
-
-	// Handle "cd ..": Move up one directory
-	if (targetDir == "..") {
-		if (chdir("..") == -1) {
-			perror("smash error: chdir failed");
+	if (failed || !append(chunk)) {
+		failed = true;
+		return false;
+	}
+	merged.end = budget.spillSize;
+	merged.pos = merged.filled = 0;
+	for (size_t i = 0; i < count; ++i) {
+		discard(runs[i]);
+	}
+	runs.erase(runs.begin(), runs.begin() + count);
+	runs.push_back(std::move(merged));
+	return true;
+}
+void SortedNames::finish() {
+	if (!runs.empty() || budget.used > budget.limit / 2) {
+		// The rest joins the runs too, so this list holds no names while the
+		// subdirectories before it are listed. So does a list that would leave
+		// them less than half of the budget.
+		if (!offsets.empty()) {
+			spill();
 		}
-		else {
-			shell.setLastDir(currentDir); // Update lastWorkingDir
+		if (offsets.empty()) {
+			pool.release();
+			std::vector<size_t>().swap(offsets);
+		}
+		while (runs.size() > NAMES_MAX_FANIN && mergeRuns(NAMES_MAX_FANIN)) {}
+		for (auto& run : runs) {
+			run.buffer.resize(bufferSize(runs.size()));
+			run.buffer.shrink_to_fit();
 		}
-		free(currentDir);
-		return;
 	}
+	std::sort(offsets.begin(), offsets.end(), [this](size_t a, size_t b) {
+		return strcmp(pool.get(a), pool.get(b)) < 0;
+	});
+	recharge();
 
-	// Handle regular path: Change directory
-	if (chdir(targetDir.c_str()) == -1) {
-		perror("smash error: chdir failed");
+	for (int i = 0; i < (int)runs.size(); ++i) {
+		if (fill(runs[i])) {
+			heap.push_back(i);
+		}
 	}
-	else {
-		shell.setLastDir(currentDir); // Update lastWorkingDir
+	if (!offsets.empty()) {
+		heap.push_back(NAMES_MEMORY);
 	}
-	free(currentDir);
+	std::make_heap(heap.begin(), heap.end(), [this](int a, int b) { return strcmp(head(a), head(b)) > 0; });
 }
-
-
-// ShowPidCommand Class
-ShowPidCommand::ShowPidCommand(const char* cmd_line) : BuiltInCommand(cmd_line) {}
-ShowPidCommand::~ShowPidCommand() {}
-void ShowPidCommand::execute() {
-	std::cout << "smash pid is " << getpid() << std::endl;
+const char* SortedNames::head(int source) const {
+	if (source == NAMES_MEMORY) {
+		return pool.get(offsets[memoryPos]);
+	}
+	return runs[source].buffer.data() + runs[source].pos;
 }
-
-
-// GetCurrDirCommand Class
-GetCurrDirCommand::GetCurrDirCommand(const char* cmd_line) : BuiltInCommand(cmd_line) {}
-GetCurrDirCommand::~GetCurrDirCommand() {}
-void GetCurrDirCommand::execute() {
-	char cwd[COMMAND_MAX_LENGTH];
-	if (getcwd(cwd, sizeof(cwd)) == nullptr) {
-		perror("smash error: getcwd failed");
+// Makes sure the run's buffer starts with a whole name; false once the run is
+// used up
+bool SortedNames::fill(Run& run) {
+	const char* start = run.buffer.data() + run.pos;
+	if (memchr(start, '\0', run.filled - run.pos) != nullptr) {
+		return true;
 	}
-	else {
-		std::cout << cwd << std::endl;
+	size_t kept = run.filled - run.pos;
+	memmove(run.buffer.data(), start, kept);
+	run.pos = 0;
+	run.filled = kept;
+	size_t wanted = std::min((off_t)(run.buffer.size() - kept), run.end - run.next);
+	while (wanted > 0) {
+		ssize_t len = pread(budget.spillFd, run.buffer.data() + run.filled, wanted, run.next);
+		if (len == -1 && errno == EINTR) continue;
+		if (len <= 0) {
+			failed = true;
+			return false;
+		}
+		run.filled += len;
+		run.next += len;
+		wanted -= len;
 	}
+	return run.filled > 0;
 }
-
-
-// JobsList Class
-JobsList::JobsList() : lastm_job_id(0) {}
-JobsList::~JobsList() {
-	for (auto job : jobs) {
-		delete job;
+bool SortedNames::advance(int source) {
+	if (source == NAMES_MEMORY) {
+		return ++memoryPos < offsets.size();
 	}
+	Run& run = runs[source];
+	run.pos += strlen(run.buffer.data() + run.pos) + 1;
+	return fill(run);
 }
-int JobsList::size() const {
-	return jobs.size();
-}
-const std::list<JobsList::JobEntry*>& JobsList::getJobs() const {
-	return jobs;
-}
-void JobsList::addJob(const std::string& command, int pid, bool m_is_stopped) {
-	removeFinishedJobs(); // Clean up finished jobs
-	int m_job_id = ++lastm_job_id;
-	jobs.push_back(new JobEntry(m_job_id, pid, command, m_is_stopped));
-}
-void JobsList::printJobs() const {
-	for (const auto& job : jobs) {
-		std::cout << "[" << job->m_job_id << "] " << job->command
-			<< (job->m_is_stopped ? " (stopped)" : "") << std::endl;
+const char* SortedNames::next() {
+	auto later = [this](int a, int b) { return strcmp(head(a), head(b)) > 0; };
+	if (lastSource != NAMES_NONE && advance(lastSource)) {
+		heap.push_back(lastSource);
+		std::push_heap(heap.begin(), heap.end(), later);
 	}
+	lastSource = NAMES_NONE;
+	if (heap.empty()) {
+		return nullptr;
+	}
+	std::pop_heap(heap.begin(), heap.end(), later);
+	lastSource = heap.back();
+	heap.pop_back();
+	return head(lastSource);
+}
+bool SortedNames::hasFailed() const {
+	return failed;
 }
-void JobsList::removeFinishedJobs() {
-	for (auto it = jobs.begin(); it != jobs.end();) {
-		int status;
-		pid_t result = waitpid((*it)->pid, &status, WNOHANG);
 
-		if (result > 0) { // Job finished
-			delete* it;
-			it = jobs.erase(it);
+
+// GlobPattern Class
+GlobPattern::GlobPattern(const std::string& pattern) : tokens(), current(), next() {
+	for (size_t i = 0; i < pattern.size(); ++i) {
+		Token token;
+		token.kind = LITERAL;
+		token.ch = pattern[i];
+		if (pattern[i] == '*') {
+			if (!tokens.empty() && tokens.back().kind == STAR) continue; // "**" inside a name is "*"
+			token.kind = STAR;
 		}
-		else if (result == 0) { // Job still running
-			++it;
+		else if (pattern[i] == '?') {
+			token.kind = ANY;
 		}
-		else { // Error in waitpid
-			perror("smash error: waitpid failed");
-			++it;
+		else if (pattern[i] == '[') {
+			// Bracket expression; without a closing ']' the '[' is literal
+			size_t j = i + 1;
+			bool negate = j < pattern.size() && (pattern[j] == '!' || pattern[j] == '^');
+			if (negate) j++;
+			size_t first = j;
+			std::bitset<256> set;
+			while (j < pattern.size() && (pattern[j] != ']' || j == first)) {
+				int low = (unsigned char)pattern[j];
+				if (j + 2 < pattern.size() && pattern[j + 1] == '-' && pattern[j + 2] != ']') {
+					int high = (unsigned char)pattern[j + 2];
+					for (int c = low; c <= high; ++c) set.set(c);
+					j += 3;
+				}
+				else {
+					set.set(low);
+					j++;
+				}
+			}
+			if (j < pattern.size()) {
+				token.kind = CLASS;
+				token.set = negate ? ~set : set;
+				i = j;
+			}
 		}
+		tokens.push_back(token);
 	}
+	current.resize(tokens.size() + 1);
+	next.resize(tokens.size() + 1);
 }
-JobsList::JobEntry* JobsList::getJobById(int m_job_id) {
-	for (auto& job : jobs) {
-		if (job->m_job_id == m_job_id) {
-			return job;
-		}
+void GlobPattern::closeOverStars(std::vector<char>& states) const {
+	// A star may also match nothing
+	for (size_t s = 0; s < tokens.size(); ++s) {
+		if (states[s] && tokens[s].kind == STAR) states[s + 1] = 1;
 	}
-	return nullptr; // Job not found
 }
-void JobsList::removeJobById(int m_job_id) {
-	for (auto it = jobs.begin(); it != jobs.end(); ++it) {
-		if ((*it)->m_job_id == m_job_id) {
-			delete* it;
-			jobs.erase(it);
-			return;
-		}
+bool GlobPattern::matches(const char* name) {
+	// Hidden entries only match a pattern that starts with a literal dot
+	if (name[0] == '.' && (tokens.empty() || tokens[0].kind != LITERAL || tokens[0].ch != '.')) {
+		return false;
 	}
-}
-void JobsList::killAllJobs() {
-	for (auto& job : jobs) {
-		if (kill(job->pid, SIGKILL) == -1) {
-			perror("smash error: kill failed");
-		}
-		else {
-			std::cout << job->pid << ": " << job->command << std::endl;
+
+	size_t n = tokens.size();
+	std::fill(current.begin(), current.end(), 0);
+	current[0] = 1;
+	closeOverStars(current);
+	for (const char* p = name; *p; ++p) {
+		unsigned char c = *p;
+		std::fill(next.begin(), next.end(), 0);
+		bool alive = false;
+		for (size_t s = 0; s < n; ++s) {
+			if (!current[s]) continue;
+			const Token& token = tokens[s];
+			if (token.kind == STAR) {
+				next[s] = 1;
+				alive = true;
+			}
+			else if (token.kind == ANY || (token.kind == LITERAL && token.ch == c) || (token.kind == CLASS && token.set[c])) {
+				next[s + 1] = 1;
+				alive = true;
+			}
 		}
-		delete job;
+		if (!alive) return false;
+		closeOverStars(next);
+		current.swap(next);
 	}
-	jobs.clear();
+	return current[n];
 }
 
 
-// JobsCommand Class
-JobsCommand::JobsCommand(const char* cmd_line, JobsList* jobsList) : BuiltInCommand(cmd_line), m_jobsList(jobsList) {}
-JobsCommand::~JobsCommand() {}
-void JobsCommand::execute() {
-	if (!m_jobsList) {
-		std::cerr << "smash error: jobs list is null" << std::endl;
-		return;
+// DirListingCache Class
+std::shared_ptr<const DirListingCache::Listing> DirListingCache::list(int baseFd, const std::string& path) {
+	int fd = path[0] == '/' ? _openDirectory(path) : openat(baseFd, path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1) {
+		return nullptr;
 	}
+	struct stat st;
+	if (fstat(fd, &st) == -1) {
+		close(fd);
+		return nullptr;
+	}
+
+	std::shared_ptr<Listing>& cached = listings[std::make_pair(st.st_dev, st.st_ino)];
+	if (cached && cached->mtime.tv_sec == st.st_mtim.tv_sec && cached->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+		close(fd);
+		return cached;
+	}
+
+	DIR* dir = fdopendir(fd);
+	if (!dir) {
+		close(fd);
+		return nullptr;
+	}
+
+	// A fresh listing, so expansions still walking the old one are unaffected
+	std::shared_ptr<Listing> listing = std::make_shared<Listing>();
+	listing->mtime = st.st_mtim;
+	for (struct dirent* ent = readdir(dir); ent; ent = readdir(dir)) {
+		if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) continue;
+
+		Listing::Entry entry;
+		entry.isDir = ent->d_type == DT_DIR;
+		entry.isLink = ent->d_type == DT_LNK;
+		if (ent->d_type == DT_UNKNOWN || ent->d_type == DT_LNK) {
+			// Only these need a stat; directories of plain files never do
+			struct stat entSt;
+			if (ent->d_type == DT_UNKNOWN && fstatat(dirfd(dir), ent->d_name, &entSt, AT_SYMLINK_NOFOLLOW) == 0) {
+				entry.isLink = S_ISLNK(entSt.st_mode);
+				entry.isDir = S_ISDIR(entSt.st_mode);
+			}
+			if (entry.isLink && fstatat(dirfd(dir), ent->d_name, &entSt, 0) == 0) {
+				entry.isDir = S_ISDIR(entSt.st_mode);
+			}
+		}
+		entry.name = listing->names.add(ent->d_name, strlen(ent->d_name));
+		listing->entries.push_back(entry);
+	}
+	closedir(dir);
+	cached = listing;
+	return listing;
+}
+void DirListingCache::clear() {
+	listings.clear();
+}
+
+
+// ArgVector Class
+ArgVector::ArgVector() : m_text(), m_args(m_inline), m_size(0), m_capacity(INLINE_CAPACITY) {
+	m_inline[0] = nullptr;
+}
+ArgVector::~ArgVector() {
+	if (m_args != m_inline) {
+		free(m_args);
+	}
+}
+void ArgVector::push(char* arg) {
+	if (m_size == m_capacity) {
+		// Past the inline storage, the pointers move into one growing heap block
+		int newCapacity = m_capacity * 2;
+		char** grown = static_cast<char**>(malloc((newCapacity + 1) * sizeof(char*)));
+		if (!grown) {
+			perror("smash error: malloc failed");
+			exit(1);
+		}
+		memcpy(grown, m_args, m_size * sizeof(char*));
+		if (m_args != m_inline) {
+			free(m_args);
+		}
+		m_args = grown;
+		m_capacity = newCapacity;
+	}
+	m_args[m_size++] = arg;
+	m_args[m_size] = nullptr;
+}
+void ArgVector::pushText(const char* text, size_t length) {
+	// Stores the offset; parse() rebases it once the block stops growing
+	push(reinterpret_cast<char*>(m_text.size()));
+	m_text.insert(m_text.end(), text, text + length);
+	m_text.push_back('\0');
+}
+int ArgVector::parse(const std::string& cmd_line, DirListingCache* globListings, int globBaseFd) {
+	clear();
+
+	// Splitting "x&" into "x" and "&" adds two bytes, so without globs twice
+	// the line length always suffices and the block is never reallocated
+	m_text.reserve(cmd_line.size() * 2 + 1);
+	StringPool globOut;
+	std::vector<size_t> globMatches;
+	size_t pos = 0;
+	while (true) {
+		size_t start = cmd_line.find_first_not_of(" \n\r\t\f\v", pos);
+		if (start == std::string::npos) break;
+		size_t end = cmd_line.find_first_of(" \n\r\t\f\v", start);
+		if (end == std::string::npos) end = cmd_line.size();
+		pos = end;
+
+		// If the token ends with '&', split it into two arguments
+		bool splitAmp = cmd_line[end - 1] == '&' && end - start > 1;
+		if (splitAmp) end--;
+
+		// Words with wildcards are replaced by the paths they match
+		const char* word = cmd_line.data() + start;
+		size_t length = end - start;
+		if (globListings && std::find_first_of(word, word + length, "*?[", "*?[" + 3) != word + length &&
+			_expandGlob(std::string(word, length), globBaseFd, *globListings, globOut, globMatches)) {
+			for (size_t match : globMatches) {
+				pushText(globOut.get(match), strlen(globOut.get(match)));
+			}
+		}
+		else {
+			pushText(word, length);
+		}
+		if (splitAmp) {
+			pushText("&", 1);
+		}
+	}
+
+	for (int i = 0; i < m_size; ++i) {
+		m_args[i] = m_text.data() + reinterpret_cast<size_t>(m_args[i]);
+	}
+	return m_size;
+}
+void ArgVector::pop_back() {
+	if (m_size > 0) {
+		m_args[--m_size] = nullptr;
+	}
+}
+void ArgVector::clear() {
+	m_text.clear();
+	m_size = 0;
+	m_args[0] = nullptr;
+}
+
+
+// FdStreamBuf Class
+FdStreamBuf::FdStreamBuf(int fd) : fd(fd) {
+	setp(buffer, buffer + sizeof(buffer));
+}
+FdStreamBuf::~FdStreamBuf() {
+	flushBuffer();
+}
+int FdStreamBuf::getFd() const {
+	return fd;
+}
+bool FdStreamBuf::flushBuffer() {
+	const char* data = pbase();
+	size_t remaining = pptr() - pbase();
+	setp(buffer, buffer + sizeof(buffer));
+	while (remaining > 0) {
+		ssize_t written = write(fd, data, remaining);
+		if (written == -1 && errno == EINTR) continue;
+		if (written <= 0) return false; // Output that cannot be written is dropped
+		data += written;
+		remaining -= written;
+	}
+	return true;
+}
+FdStreamBuf::int_type FdStreamBuf::overflow(int_type ch) {
+	if (!flushBuffer()) {
+		return traits_type::eof();
+	}
+	if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+		*pptr() = traits_type::to_char_type(ch);
+		pbump(1);
+	}
+	return traits_type::not_eof(ch);
+}
+int FdStreamBuf::sync() {
+	return flushBuffer() ? 0 : -1;
+}
+
+
+// Command Class
+Command::Command(const char* cmd_line, ShellSession& session)
+	: m_session(session), cmdSegments(), m_PID(-1), m_is_background(false), m_cmd_line(cmd_line), m_status(0),
+	m_out(nullptr), m_err(nullptr), m_cancelled(nullptr), m_watcher(nullptr) {
+}
+Command::~Command() {}
+std::ostream& Command::out() { return m_out ? *m_out : m_session.out(); }
+std::ostream& Command::err() { return m_err ? *m_err : m_session.err(); }
+void Command::reportError(const char* message) {
+	if (!m_err) {
+		m_session.reportError(message);
+		return;
+	}
+	*m_err << message << ": " << strerror(errno) << std::endl;
+}
+bool Command::isCancelled() const { return m_cancelled && m_cancelled->load(); }
+bool Command::isReadOnly() const { return false; }
+bool Command::canRunInBackground() const { return false; }
+bool Command::isBackground() const { return m_is_background; }
+void Command::bindTask(std::ostream* out, std::ostream* err, const std::atomic<bool>* cancelled) {
+	m_out = out;
+	m_err = err;
+	m_cancelled = cancelled;
+}
+void Command::setWatcher(CommandCache* watcher) { m_watcher = watcher; }
+int Command::getStatus() const { return m_status; }
+int Command::getm_PID() const { return m_PID; }
+void Command::setm_PID(int pid) { m_PID = pid; }
+std::string Command::getAlias() const { return alias; }
+void Command::setAlias(const std::string& aliasCommand) { alias = aliasCommand; }
+std::string Command::getPath() const { return m_file_redirect; }
+void Command::setPath(const std::string& path) { m_file_redirect = path; }
+std::string Command::getCommandLine() const {
+	if (!m_cmd_line.empty()) {
+		return m_cmd_line; // Return the original command line if available
+	}
+
+	// Reconstruct the command line from segments
+	std::ostringstream oss;
+	for (int i = 0; i < cmdSegments.size(); ++i) {
+		oss << cmdSegments[i];
+		if (i < cmdSegments.size() - 1) {
+			oss << " ";
+		}
+	}
+	if (m_is_background) {
+		oss << " &";
+	}
+	return oss.str();
+}
+
+
+// BuiltInCommand Class
+BuiltInCommand::BuiltInCommand(const char* cmd_line, ShellSession& session) : Command(cmd_line, session) {
+	// The background sign is not an argument; only builtins that can run on
+	// the worker pool act on it
+	std::string line = _trim(cmd_line);
+	m_is_background = !line.empty() && line.back() == '&';
+	_trimAmp(line);
+	_parseCommandLine(line, cmdSegments, m_session);
+}
+BuiltInCommand::~BuiltInCommand() {}
+
+
+// BuiltinPool Class
+static const unsigned BUILTIN_POOL_MAX_WORKERS = 4;
+
+BuiltinPool::BuiltinPool() : stopping(false) {}
+BuiltinPool::~BuiltinPool() {
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stopping = true;
+	}
+	wake.notify_all();
+	for (auto& worker : workers) {
+		worker.join();
+	}
+}
+void BuiltinPool::submit(const std::function<void()>& work) {
+	std::lock_guard<std::mutex> guard(lock);
+	queue.push_back(work);
+
+	// At least two workers, so a short job never waits behind a long one
+	unsigned cpus = std::thread::hardware_concurrency();
+	unsigned limit = std::max(2u, std::min(BUILTIN_POOL_MAX_WORKERS, cpus));
+	if (workers.size() < limit) {
+		// Signals stay with the main thread
+		sigset_t all, previous;
+		sigfillset(&all);
+		pthread_sigmask(SIG_SETMASK, &all, &previous);
+		workers.emplace_back(&BuiltinPool::run, this);
+		pthread_sigmask(SIG_SETMASK, &previous, nullptr);
+	}
+	wake.notify_one();
+}
+void BuiltinPool::run() {
+	std::unique_lock<std::mutex> guard(lock);
+	while (true) {
+		wake.wait(guard, [this] { return stopping || !queue.empty(); });
+		if (queue.empty()) {
+			return; // Stopping with nothing left to run
+		}
+		std::function<void()> work = std::move(queue.front());
+		queue.pop_front();
+		guard.unlock();
+		work();
+		work = nullptr; // The job's command goes before the lock is taken again
+		guard.lock();
+	}
+}
+
+
+// ResourceLimits
+static const char* CGROUP_ROOT = "/sys/fs/cgroup";
+static const long CGROUP_CPU_PERIOD = 100000; // cpu.max period in microseconds
+
+bool ResourceLimits::empty() const {
+	return cpuSeconds < 0 && memBytes < 0 && openFiles < 0 && cpuPercent <= 0;
+}
+bool ResourceLimits::needsCgroup() const {
+	return memBytes >= 0 || cpuPercent > 0;
+}
+std::string ResourceLimits::toString() const {
+	std::ostringstream oss;
+	if (cpuSeconds >= 0) oss << " cpu=" << cpuSeconds << "s";
+	if (cpuPercent > 0) oss << " cpus=" << cpuPercent << "%";
+	if (memBytes >= 0) oss << " mem=" << memBytes;
+	if (openFiles >= 0) oss << " nofile=" << openFiles;
+	std::string result = oss.str();
+	return result.empty() ? result : result.substr(1);
+}
+
+// Parses sizes such as 4096, 512K, 64M or 1G; returns -1 on malformed input
+static long long _parseSize(const std::string& str) {
+	if (str.empty() || !isdigit(str[0])) return -1;
+	char* end = nullptr;
+	long long value = strtoll(str.c_str(), &end, 10);
+	std::string suffix(end);
+	if (suffix.empty()) return value;
+	if (suffix.size() != 1) return -1;
+	switch (toupper(suffix[0])) {
+	case 'K': return value << 10;
+	case 'M': return value << 20;
+	case 'G': return value << 30;
+	default: return -1;
+	}
+}
+
+// Parses the --cpus percentage: a plain decimal from 1 to 100 per possible
+// CPU; returns -1 otherwise
+static long long _parseCpuPercent(const std::string& str) {
+	if (str.empty() || str.size() > 7 || str.find_first_not_of("0123456789") != std::string::npos) return -1;
+	long long value = atoll(str.c_str());
+	return value > 0 && value <= 100LL * CPU_SETSIZE ? value : -1;
+}
+
+static bool _writeFile(const std::string& path, const std::string& content) {
+	int fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+	if (fd == -1) return false;
+	bool ok = write(fd, content.c_str(), content.size()) == (ssize_t)content.size();
+	close(fd);
+	return ok;
+}
+
+// The shell's own cgroup v2 directory, from the "0::" line of /proc/self/cgroup;
+// empty if it is not on the unified hierarchy
+static std::string _ownCgroup() {
+	std::ifstream file("/proc/self/cgroup");
+	for (std::string line; std::getline(file, line);) {
+		if (line.compare(0, 3, "0::") == 0) {
+			std::string relative = line.substr(3);
+			return std::string(CGROUP_ROOT) + (relative == "/" ? "" : relative);
+		}
+	}
+	return "";
+}
+
+// Creates a per-job cgroup v2 directory under the shell's own cgroup,
+// configured with the given limits. Working below its own cgroup is what a
+// user without root, or a delegated systemd scope, may do. Returns an open fd
+// of its cgroup.procs (for the child to join) or -1 if cgroup v2 is
+// unavailable or not writable, in which case only setrlimit applies.
+static int _prepareJobCgroup(const ResourceLimits& limits, std::string& path) {
+	static std::atomic<int> cgroupCounter(0); // Sessions may launch concurrently
+	std::string parent = _ownCgroup();
+	if (parent.empty() || access((parent + "/cgroup.controllers").c_str(), F_OK) != 0
+		|| access(parent.c_str(), W_OK) != 0) {
+		return -1;
+	}
+	// Limits are only honoured for controllers the parent hands down. Enabling
+	// them fails while the parent has processes of its own, outside the root.
+	std::ifstream enabled(parent + "/cgroup.subtree_control");
+	std::string controllers((std::istreambuf_iterator<char>(enabled)), std::istreambuf_iterator<char>());
+	std::string wanted;
+	if (limits.memBytes >= 0 && controllers.find("memory") == std::string::npos) wanted += " +memory";
+	if (limits.cpuPercent > 0 && controllers.find("cpu") == std::string::npos) wanted += " +cpu";
+	if (!wanted.empty() && !_writeFile(parent + "/cgroup.subtree_control", wanted.substr(1))) {
+		return -1;
+	}
+
+	path = parent + "/smash-" + std::to_string(getpid()) + "-" + std::to_string(++cgroupCounter);
+	if (mkdir(path.c_str(), 0755) == -1) {
+		path.clear();
+		return -1;
+	}
+
+	bool ok = true;
+	if (limits.memBytes >= 0) {
+		ok = _writeFile(path + "/memory.max", std::to_string(limits.memBytes));
+	}
+	if (ok && limits.cpuPercent > 0) {
+		long quota = CGROUP_CPU_PERIOD * limits.cpuPercent / 100;
+		ok = _writeFile(path + "/cpu.max", std::to_string(quota) + " " + std::to_string(CGROUP_CPU_PERIOD));
+	}
+	int procsFd = ok ? open((path + "/cgroup.procs").c_str(), O_WRONLY | O_CLOEXEC) : -1;
+	if (procsFd == -1) {
+		rmdir(path.c_str());
+		path.clear();
+	}
+	return procsFd;
+}
+
+
+// Parses a CPU list such as "0-3,6"; returns false on malformed input
+static bool _parseCpuList(const std::string& list, cpu_set_t& cpus) {
+	CPU_ZERO(&cpus);
+	std::istringstream iss(list);
+	std::string range;
+	while (std::getline(iss, range, ',')) {
+		char* end = nullptr;
+		long first = strtol(range.c_str(), &end, 10);
+		long last = first;
+		if (end == range.c_str()) return false;
+		if (*end == '-') {
+			const char* lastStart = end + 1;
+			last = strtol(lastStart, &end, 10);
+			if (end == lastStart) return false;
+		}
+		if (*end != '\0' || first < 0 || last < first || last >= CPU_SETSIZE) return false;
+		for (long cpu = first; cpu <= last; ++cpu) {
+			CPU_SET(cpu, &cpus);
+		}
+	}
+	return CPU_COUNT(&cpus) > 0;
+}
+
+// Formats a CPU set back into the compact "0-3,6" form
+static std::string _formatCpuList(const cpu_set_t& cpus) {
+	std::ostringstream oss;
+	for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+		if (!CPU_ISSET(cpu, &cpus)) continue;
+		int last = cpu;
+		while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, &cpus)) last++;
+		if (oss.tellp() > 0) oss << ",";
+		oss << cpu;
+		if (last > cpu) oss << "-" << last;
+		cpu = last;
+	}
+	return oss.str();
+}
+
+// Joins args[from..argc) back into a command line
+static std::string _joinArgs(const ArgVector& args, int from, int argc) {
+	std::string line;
+	for (int i = from; i < argc; ++i) {
+		if (i > from) line += " ";
+		line += args[i];
+	}
+	return line;
+}
+
+
+// CpuPlacer Class
+static const char* NUMA_NODES_ROOT = "/sys/devices/system/node";
+
+CpuPlacer::CpuPlacer() : policy(NONE), domains(), nextDomain(0) {}
+bool CpuPlacer::setPolicy(const std::string& name) {
+	cpu_set_t allowed;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+		perror("smash error: sched_getaffinity failed");
+		return false;
+	}
+
+	std::vector<cpu_set_t> newDomains;
+	Policy newPolicy;
+	if (name == "none") {
+		newPolicy = NONE;
+	}
+	else if (name == "cores") {
+		newPolicy = CORES;
+		for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+			if (!CPU_ISSET(cpu, &allowed)) continue;
+			cpu_set_t core;
+			CPU_ZERO(&core);
+			CPU_SET(cpu, &core);
+			newDomains.push_back(core);
+		}
+	}
+	else if (name == "nodes") {
+		newPolicy = NODES;
+		// Node ids may have gaps, so they come from the online list, which
+		// uses the CPU list syntax
+		std::ifstream online(std::string(NUMA_NODES_ROOT) + "/online");
+		std::string nodeList;
+		cpu_set_t nodes;
+		if (!online || !std::getline(online, nodeList) || !_parseCpuList(_trim(nodeList), nodes)) {
+			CPU_ZERO(&nodes);
+		}
+		for (int node = 0; node < CPU_SETSIZE; ++node) {
+			if (!CPU_ISSET(node, &nodes)) continue;
+			std::ifstream cpulist(std::string(NUMA_NODES_ROOT) + "/node" + std::to_string(node) + "/cpulist");
+			std::string list;
+			if (!cpulist || !std::getline(cpulist, list)) continue;
+
+			cpu_set_t nodeCpus;
+			if (!_parseCpuList(_trim(list), nodeCpus)) continue; // Memory-only node
+			CPU_AND(&nodeCpus, &nodeCpus, &allowed);
+			if (CPU_COUNT(&nodeCpus) > 0) {
+				newDomains.push_back(nodeCpus);
+			}
+		}
+		if (newDomains.empty()) {
+			newDomains.push_back(allowed); // No NUMA information: a single node
+		}
+	}
+	else {
+		return false;
+	}
+
+	policy = newPolicy;
+	domains.swap(newDomains);
+	nextDomain = 0;
+	return true;
+}
+std::string CpuPlacer::getPolicyName() const {
+	switch (policy) {
+	case CORES: return "cores";
+	case NODES: return "nodes";
+	default: return "none";
+	}
+}
+bool CpuPlacer::nextPlacement(cpu_set_t& cpus) {
+	if (policy == NONE || domains.empty()) {
+		return false;
+	}
+	cpus = domains[nextDomain];
+	nextDomain = (nextDomain + 1) % domains.size();
+	return true;
+}
+
+
+// DeadlineQueue Class
+static const double TIMEOUT_DEFAULT_GRACE = 3.0;
+static const double TIMEOUT_MAX_SECONDS = 1e7; // About 115 days
+
+static uint64_t _monotonicNs() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+// Durations are clamped so that converting them can never overflow
+static uint64_t _durationNs(double seconds) {
+	if (!(seconds > 0)) return 0;
+	return (uint64_t)(std::min(seconds, TIMEOUT_MAX_SECONDS) * 1e9);
+}
+
+DeadlineQueue::DeadlineQueue() : nextGeneration(0), timerFd(-1), wakeFd(-1) {}
+DeadlineQueue::~DeadlineQueue() {
+	if (worker.joinable()) {
+		uint64_t one = 1;
+		if (write(wakeFd, &one, sizeof(one)) == -1) {
+			perror("smash error: write failed");
+		}
+		worker.join();
+	}
+	if (timerFd != -1) close(timerFd);
+	if (wakeFd != -1) close(wakeFd);
+	for (auto& entry : tracked) {
+		if (entry.second.pidFd != -1) close(entry.second.pidFd);
+	}
+}
+void DeadlineQueue::start() {
+	timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (timerFd == -1 || wakeFd == -1) {
+		perror("smash error: timerfd_create failed");
+		return;
+	}
+
+	// Signals stay with the main thread
+	sigset_t all, previous;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &previous);
+	worker = std::thread(&DeadlineQueue::run, this);
+	pthread_sigmask(SIG_SETMASK, &previous, nullptr);
+}
+void DeadlineQueue::run() {
+	struct pollfd fds[2] = { { timerFd, POLLIN, 0 }, { wakeFd, POLLIN, 0 } };
+	while (true) {
+		if (poll(fds, 2, -1) == -1) {
+			if (errno == EINTR) continue;
+			perror("smash error: poll failed");
+			return;
+		}
+		if (fds[1].revents & POLLIN) {
+			return; // Shutting down
+		}
+		uint64_t expirations;
+		if (read(timerFd, &expirations, sizeof(expirations)) > 0) {
+			fireExpired();
+		}
+	}
+}
+void DeadlineQueue::fireExpired() {
+	std::lock_guard<std::mutex> guard(lock);
+	uint64_t now = _monotonicNs();
+	while (!heap.empty() && heap.top().when <= now) {
+		Deadline deadline = heap.top();
+		heap.pop();
+
+		auto it = tracked.find(deadline.pid);
+		if (it == tracked.end() || it->second.generation != deadline.generation) {
+			continue; // Job finished or was cancelled before its deadline
+		}
+
+		// Children lead their own process group, so signal the whole group.
+		// Through the pidfd a job reaped in the meantime fails with ESRCH
+		// instead of the signal reaching whoever got its pid next.
+		int sig = deadline.isKill ? SIGKILL : SIGTERM;
+		int pidFd = it->second.pidFd;
+		int result = -1;
+		if (pidFd != -1) {
+			result = _pidfdSignalGroup(pidFd, sig);
+			if (result == -1 && errno == EINVAL && (result = _pidfdSendSignal(pidFd, sig)) == 0) {
+				kill(-deadline.pid, sig); // The leader was unreaped just now, so its group id still holds
+			}
+		}
+		else {
+			// Without pidfds, only signal a child of ours that has not been reaped yet
+			siginfo_t info;
+			info.si_pid = 0;
+			if (waitid(P_PID, deadline.pid, &info, WEXITED | WNOHANG | WNOWAIT) == 0 && info.si_pid == 0) {
+				result = kill(-deadline.pid, sig) == 0 ? 0 : kill(deadline.pid, sig);
+			}
+			else {
+				errno = ESRCH;
+			}
+		}
+		if (result == -1 && errno == ESRCH) {
+			if (pidFd != -1) close(pidFd);
+			tracked.erase(it);
+			continue;
+		}
+		if (result == -1) {
+			perror("smash error: kill failed");
+		}
+		if (!deadline.isKill) {
+			std::string message = "smash: " + it->second.command + " timed out!\n";
+			if (write(it->second.outFd, message.c_str(), message.size()) == -1) {
+				perror("smash error: write failed");
+			}
+			it->second.expired = true;
+			Deadline escalation = { now + it->second.graceNs, deadline.pid, deadline.generation, true };
+			heap.push(escalation);
+		}
+	}
+	rearm();
+}
+void DeadlineQueue::rearm() {
+	struct itimerspec spec = {};
+	if (!heap.empty()) {
+		uint64_t when = heap.top().when;
+		spec.it_value.tv_sec = when / 1000000000ull;
+		spec.it_value.tv_nsec = when % 1000000000ull;
+		if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0) {
+			spec.it_value.tv_nsec = 1; // A zero value would disarm the timer
+		}
+	}
+	if (timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &spec, nullptr) == -1) {
+		perror("smash error: timerfd_settime failed");
+	}
+}
+void DeadlineQueue::add(int pid, const std::string& command, double seconds, double graceSeconds, int outFd) {
+	if (!worker.joinable()) {
+		start();
+	}
+
+	// Opened while the child is certainly unreaped, so the fd names it
+	int pidFd = _pidfdOpen(pid);
+	std::lock_guard<std::mutex> guard(lock);
+	Tracked entry = { ++nextGeneration, _durationNs(graceSeconds), false, command, outFd, pidFd };
+	auto previous = tracked.find(pid);
+	if (previous != tracked.end() && previous->second.pidFd != -1) {
+		close(previous->second.pidFd);
+	}
+	tracked[pid] = entry;
+	Deadline deadline = { _monotonicNs() + _durationNs(seconds), pid, entry.generation, false };
+	bool isEarliest = heap.empty() || deadline.when < heap.top().when;
+	heap.push(deadline);
+	if (isEarliest && timerFd != -1) {
+		rearm();
+	}
+}
+void DeadlineQueue::cancel(int pid) {
+	if (!worker.joinable()) {
+		return;
+	}
+	std::lock_guard<std::mutex> guard(lock);
+	auto it = tracked.find(pid);
+	if (it == tracked.end()) {
+		return;
+	}
+	if (it->second.pidFd != -1) {
+		close(it->second.pidFd);
+	}
+	tracked.erase(it); // Its heap entries become stale and are skipped when they fire
+}
+bool DeadlineQueue::hasExpired(int pid) const {
+	std::lock_guard<std::mutex> guard(lock);
+	auto it = tracked.find(pid);
+	return it != tracked.end() && it->second.expired;
+}
+
+
+// JobLog Class
+static const uint32_t JOBLOG_WAKE = UINT32_MAX; // epoll data of the shutdown eventfd
+
+JobLog::JobLog() : totalBytes(0), nextOrder(0), enabled(false), epollFd(-1), wakeFd(-1) {}
+JobLog::~JobLog() {
+	if (worker.joinable()) {
+		uint64_t one = 1;
+		if (write(wakeFd, &one, sizeof(one)) == -1) {
+			perror("smash error: write failed");
+		}
+		worker.join();
+	}
+	for (auto& entry : rings) {
+		closePipe(entry.second);
+		close(entry.second.memFd);
+	}
+	if (epollFd != -1) close(epollFd);
+	if (wakeFd != -1) close(wakeFd);
+}
+void JobLog::start() {
+	epollFd = epoll_create1(EPOLL_CLOEXEC);
+	wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	struct epoll_event event;
+	event.events = EPOLLIN;
+	event.data.u32 = JOBLOG_WAKE;
+	if (epollFd == -1 || wakeFd == -1 || epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &event) == -1) {
+		perror("smash error: epoll_create1 failed");
+		return;
+	}
+
+	// Signals stay with the main thread
+	sigset_t all, previous;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &previous);
+	worker = std::thread(&JobLog::run, this);
+	pthread_sigmask(SIG_SETMASK, &previous, nullptr);
+}
+void JobLog::run() {
+	struct epoll_event events[64];
+	while (true) {
+		int count = epoll_wait(epollFd, events, 64, -1);
+		if (count == -1) {
+			if (errno == EINTR) continue;
+			perror("smash error: epoll_wait failed");
+			return;
+		}
+		for (int i = 0; i < count; ++i) {
+			if (events[i].data.u32 == JOBLOG_WAKE) {
+				return; // Shutting down
+			}
+			drain((int)events[i].data.u32);
+		}
+	}
+}
+void JobLog::drain(int jobId) {
+	std::lock_guard<std::mutex> guard(lock);
+	auto it = rings.find(jobId);
+	if (it == rings.end() || it->second.pipeFd == -1) {
+		return;
+	}
+	Ring& ring = it->second;
+
+	// Output lands at the ring's write offset; a chunk never crosses the end,
+	// the next one wraps around and overwrites the oldest bytes
+	char buffer[4096];
+	while (true) {
+		loff_t offset = ring.written % RING_SIZE;
+		size_t room = RING_SIZE - offset;
+		ssize_t moved = splice(ring.pipeFd, nullptr, ring.memFd, &offset, room, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (moved == -1 && errno == EINVAL) {
+			// No splice between these files: copy through user space
+			moved = ::read(ring.pipeFd, buffer, std::min(room, sizeof(buffer)));
+			if (moved > 0 && pwrite(ring.memFd, buffer, moved, offset) != moved) {
+				moved = -1;
+			}
+		}
+		if (moved > 0) {
+			ring.written += moved;
+			continue;
+		}
+		if (moved == -1 && (errno == EAGAIN || errno == EINTR)) {
+			break;
+		}
+		closePipe(ring); // End of output, or a ring that cannot be written
+		break;
+	}
+	changed.notify_all();
+}
+void JobLog::closePipe(Ring& ring) {
+	if (ring.pipeFd == -1) {
+		return;
+	}
+	if (epollFd != -1) {
+		epoll_ctl(epollFd, EPOLL_CTL_DEL, ring.pipeFd, nullptr);
+	}
+	close(ring.pipeFd);
+	ring.pipeFd = -1;
+}
+// Evicts the oldest finished log; false if every ring still has a writer
+bool JobLog::makeRoom() {
+	auto oldest = rings.end();
+	for (auto it = rings.begin(); it != rings.end(); ++it) {
+		if (it->second.pipeFd == -1 && (oldest == rings.end() || it->second.order < oldest->second.order)) {
+			oldest = it;
+		}
+	}
+	if (oldest == rings.end()) {
+		return false;
+	}
+	close(oldest->second.memFd);
+	rings.erase(oldest);
+	totalBytes -= RING_SIZE;
+	return true;
+}
+bool JobLog::isEnabled() const {
+	return enabled;
+}
+void JobLog::setEnabled(bool enable) {
+	enabled = enable;
+}
+size_t JobLog::size() const {
+	std::lock_guard<std::mutex> guard(lock);
+	return rings.size();
+}
+size_t JobLog::memoryUsed() const {
+	std::lock_guard<std::mutex> guard(lock);
+	return totalBytes;
+}
+int JobLog::attach(int jobId) {
+	if (!enabled) {
+		return -1;
+	}
+	if (!worker.joinable()) {
+		start();
+		if (!worker.joinable()) {
+			return -1;
+		}
+	}
+
+	std::lock_guard<std::mutex> guard(lock);
+	if (rings.count(jobId)) {
+		return -1;
+	}
+	while (totalBytes + RING_SIZE > MEMORY_LIMIT) {
+		if (!makeRoom()) {
+			return -1; // Over the cap with live jobs only; this one keeps the terminal
+		}
+	}
+
+	// The memfd is sized once; pages are only allocated as output arrives
+	int memFd = memfd_create("smash-joblog", MFD_CLOEXEC);
+	int fds[2] = { -1, -1 };
+	if (memFd == -1 || ftruncate(memFd, RING_SIZE) == -1 || pipe2(fds, O_CLOEXEC) == -1) {
+		if (memFd != -1) close(memFd);
+		return -1;
+	}
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+
+	struct epoll_event event;
+	event.events = EPOLLIN;
+	event.data.u32 = jobId;
+	if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fds[0], &event) == -1) {
+		close(memFd);
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+	Ring ring = { memFd, fds[0], 0, nextOrder++ };
+	rings[jobId] = ring;
+	totalBytes += RING_SIZE;
+	return fds[1];
+}
+void JobLog::detach(int jobId) {
+	std::lock_guard<std::mutex> guard(lock);
+	auto it = rings.find(jobId);
+	if (it == rings.end()) {
+		return;
+	}
+	closePipe(it->second);
+	close(it->second.memFd);
+	rings.erase(it);
+	totalBytes -= RING_SIZE;
+}
+bool JobLog::read(int jobId, uint64_t& pos, std::string& data) const {
+	std::lock_guard<std::mutex> guard(lock);
+	auto it = rings.find(jobId);
+	if (it == rings.end()) {
+		return false;
+	}
+	const Ring& ring = it->second;
+
+	// Bytes older than the ring's capacity were overwritten
+	uint64_t oldest = ring.written > RING_SIZE ? ring.written - RING_SIZE : 0;
+	uint64_t from = std::max(pos, oldest);
+	while (from < ring.written) {
+		size_t offset = from % RING_SIZE;
+		size_t length = std::min<uint64_t>(RING_SIZE - offset, ring.written - from);
+		size_t start = data.size();
+		data.resize(start + length);
+		ssize_t got = pread(ring.memFd, &data[start], length, offset);
+		if (got <= 0) {
+			data.resize(start);
+			break;
+		}
+		data.resize(start + got);
+		from += got;
+	}
+	pos = from;
+	return true;
+}
+bool JobLog::waitForOutput(int jobId, uint64_t pos, int timeoutMs) {
+	std::unique_lock<std::mutex> guard(lock);
+	auto ready = [this, jobId, pos] {
+		auto it = rings.find(jobId);
+		return it == rings.end() || it->second.written > pos || it->second.pipeFd == -1;
+	};
+	changed.wait_for(guard, std::chrono::milliseconds(timeoutMs), ready);
+	auto it = rings.find(jobId);
+	return it != rings.end() && (it->second.written > pos || it->second.pipeFd != -1);
+}
+
+
+// Converts a waitpid status into the shell's $? convention
+static int _exitStatus(int waitStatus) {
+	if (WIFEXITED(waitStatus)) return WEXITSTATUS(waitStatus);
+	if (WIFSIGNALED(waitStatus)) return 128 + WTERMSIG(waitStatus);
+	if (WIFSTOPPED(waitStatus)) return 128 + WSTOPSIG(waitStatus);
+	return 1;
+}
+
+
+// ExternalCommand Class
+ExternalCommand::ExternalCommand(const char* cmd_line, ShellSession& session)
+	: Command(cmd_line, session), m_hasAffinity(false), m_timeout(0), m_timeoutGrace(TIMEOUT_DEFAULT_GRACE) {
+	CPU_ZERO(&m_cpus);
+}
+ExternalCommand::~ExternalCommand() {}
+void ExternalCommand::setLimits(const ResourceLimits& limits) {
+	m_limits = limits;
+}
+void ExternalCommand::setAffinity(const cpu_set_t& cpus) {
+	m_cpus = cpus;
+	m_hasAffinity = true;
+}
+void ExternalCommand::setTimeout(double seconds, double graceSeconds) {
+	m_timeout = seconds;
+	m_timeoutGrace = graceSeconds;
+}
+void ExternalCommand::execute() {
+	ArgVector args;
+	int argc = _parseCommandLine(m_cmd_line, args, m_session);
+
+	if (argc == 0) return;
+
+	// Check for background execution
+	bool m_is_background = false;
+	if (strcmp(args[argc - 1], "&") == 0) {
+		m_is_background = true;
+		args.pop_back();
+	}
+
+	// Everything the child needs is prepared here, so that between fork and
+	// exec it only issues async-signal-safe system calls
+	struct rlimit rlimits[3];
+	int resources[3];
+	int rlimitCount = 0;
+	if (m_limits.cpuSeconds >= 0) {
+		resources[rlimitCount] = RLIMIT_CPU;
+		rlimits[rlimitCount].rlim_cur = rlimits[rlimitCount].rlim_max = m_limits.cpuSeconds;
+		rlimitCount++;
+	}
+	if (m_limits.memBytes >= 0) {
+		resources[rlimitCount] = RLIMIT_AS;
+		rlimits[rlimitCount].rlim_cur = rlimits[rlimitCount].rlim_max = m_limits.memBytes;
+		rlimitCount++;
+	}
+	if (m_limits.openFiles >= 0) {
+		resources[rlimitCount] = RLIMIT_NOFILE;
+		rlimits[rlimitCount].rlim_cur = rlimits[rlimitCount].rlim_max = m_limits.openFiles;
+		rlimitCount++;
+	}
+	std::string cgroupPath;
+	int cgroupFd = m_limits.needsCgroup() ? _prepareJobCgroup(m_limits, cgroupPath) : -1;
+
+	// Background jobs without an explicit CPU set follow the shell-wide policy
+	ShellSession& shell = m_session;
+	Environment& env = shell.getEnvironment();
+	std::string path = shell.getPathCache().resolve(args[0], env.get("PATH"), shell.getCwdFd());
+	char* const* envp = env.getEnvp();
+
+	// Like execvp, a file without a recognised format is run by the shell
+	static char shellPath[] = "/bin/sh";
+	std::vector<char*> shellArgv;
+	if (!path.empty()) {
+		shellArgv.push_back(shellPath);
+		shellArgv.push_back(&path[0]);
+		shellArgv.insert(shellArgv.end(), args.argv() + 1, args.argv() + args.size());
+		shellArgv.push_back(nullptr);
+	}
+	if (!m_hasAffinity && m_is_background) {
+		m_hasAffinity = shell.getCpuPlacer().nextPlacement(m_cpus);
+	}
+
+	// The child inherits the session's directory and output, not the process's
+	int cwdFd = shell.getCwdFd();
+	int outFd = shell.getOutFd();
+	int errFd = shell.getErrFd();
+	shell.out().flush();
+	shell.err().flush();
+
+	// A background job that would print on the terminal may be captured instead
+	JobsList& jobs = shell.getJobsList();
+	int captureFd = -1;
+	if (m_is_background && outFd == shell.getTerminalFd()) {
+		captureFd = shell.getJobLog().attach(jobs.nextJobId());
+		if (captureFd != -1) {
+			outFd = errFd = captureFd;
+		}
+	}
+
+	pid_t pid = fork();
+	if (pid == 0) { // Child process
+		setpgrp(); // Create a new process group
+		if ((outFd != STDOUT_FILENO && dup2(outFd, STDOUT_FILENO) == -1) ||
+			(errFd != STDERR_FILENO && dup2(errFd, STDERR_FILENO) == -1)) {
+			_childError("dup2", errno);
+			_exit(126);
+		}
+		if (fchdir(cwdFd) == -1) {
+			_childError("chdir", errno);
+			_exit(126);
+		}
+		if (cgroupFd != -1 && write(cgroupFd, "0", 1) == -1) {
+			// Could not join the job cgroup; the rlimits below still apply
+		}
+		for (int i = 0; i < rlimitCount; ++i) {
+			setrlimit(resources[i], &rlimits[i]);
+		}
+		if (m_hasAffinity) {
+			sched_setaffinity(0, sizeof(m_cpus), &m_cpus);
+		}
+		if (path.empty()) { // Not on PATH; never fall back to the working directory
+			_childError("execvp", ENOENT);
+			_exit(127);
+		}
+		execve(path.c_str(), args.argv(), envp); // Execute command
+		if (errno == ENOEXEC) {
+			execve(shellPath, shellArgv.data(), envp);
+			errno = ENOEXEC;
+		}
+		int execErrno = errno;
+		_childError("execvp", execErrno);
+		_exit(execErrno == ENOENT ? 127 : 126);
+	}
+	if (cgroupFd != -1) {
+		close(cgroupFd);
+	}
+	if (captureFd != -1) {
+		close(captureFd); // The log sees end of output once the job's copies are gone
+		if (pid < 0) {
+			shell.getJobLog().detach(jobs.nextJobId());
+		}
+	}
+
+	if (pid > 0) { // Parent process
+		DeadlineQueue& deadlines = shell.getDeadlines();
+		if (m_timeout > 0) {
+			deadlines.add(pid, m_cmd_line, m_timeout, m_timeoutGrace, shell.getTerminalFd());
+		}
+		else {
+			deadlines.cancel(pid); // Forget a reaped job that had the same pid
+		}
+
+		if (m_is_background) {
+			JobsList::JobEntry* job = jobs.addJob(m_cmd_line, pid, false);
+			job->limits = m_limits.toString();
+			job->cgroupPath = cgroupPath;
+			if (m_hasAffinity) {
+				job->cpus = _formatCpuList(m_cpus);
+			}
+			job->routeSlot = SignalRouter::trackChild(pid, &shell);
+		}
+		else {
+			shell.beginForeground(pid, m_cmd_line, args[0], cgroupPath);
+			if (shell.isSuspended()) {
+				return; // The host waits for the child and resumes the session
+			}
+			int status = 0;
+			bool waited = waitpid(pid, &status, WUNTRACED) != -1;
+			if (!waited) {
+				m_session.reportError("smash error: waitpid failed");
+			}
+			m_status = shell.endForeground(status);
+			if (!waited) {
+				m_status = 1;
+			}
+		}
+	}
+	else { // Fork failed
+		m_session.reportError("smash error: fork failed");
+		m_status = 1;
+		if (!cgroupPath.empty()) {
+			rmdir(cgroupPath.c_str());
+		}
+	}
+}
+
+
+// PromptTemplate Class
+PromptTemplate::PromptTemplate(const std::string& text) : source(text), dynamic(false) {
+	std::string literal;
+	for (size_t i = 0; i < text.size(); ++i) {
+		Kind kind = LITERAL;
+		if (text[i] == '\\' && i + 1 < text.size()) {
+			switch (text[i + 1]) {
+			case 'w': kind = CWD; break;
+			case 'j': kind = JOBS; break;
+			case '?': kind = STATUS; break;
+			case 'h': kind = HOST; break;
+			case 't': kind = TIME; break;
+			case '\\': literal += '\\'; ++i; continue;
+			default: break;
+			}
+		}
+		if (kind == LITERAL) {
+			literal += text[i];
+			continue;
+		}
+		if (!literal.empty()) {
+			segments.push_back({ LITERAL, literal, 0 });
+			literal.clear();
+		}
+		segments.push_back({ kind, "", -1 });
+		++i;
+		dynamic = true;
+	}
+	if (!literal.empty()) {
+		segments.push_back({ LITERAL, literal, 0 });
+	}
+
+	// The host name is only looked up here, once per chprompt
+	for (auto& segment : segments) {
+		if (segment.kind == HOST) {
+			char host[256] = "";
+			gethostname(host, sizeof(host) - 1);
+			segment.text = std::string(host).substr(0, std::string(host).find('.'));
+			segment.key = 0;
+		}
+	}
+	if (!dynamic) {
+		for (const auto& segment : segments) {
+			rendered += segment.text;
+		}
+	}
+}
+const std::string& PromptTemplate::getSource() const {
+	return source;
+}
+int64_t PromptTemplate::keyOf(const Segment& segment, const Sources& sources) const {
+	switch (segment.kind) {
+	case CWD: return sources.cwdVersion;
+	case JOBS: return sources.jobs;
+	case STATUS: return sources.status;
+	case TIME: {
+		struct timespec now;
+		clock_gettime(CLOCK_REALTIME_COARSE, &now); // Served by the vDSO
+		return now.tv_sec;
+	}
+	default: return segment.key;
+	}
+}
+void PromptTemplate::refresh(Segment& segment, const Sources& sources) const {
+	switch (segment.kind) {
+	case CWD: {
+		const char* home = sources.env->get("HOME");
+		size_t homeLength = home ? strlen(home) : 0;
+		const std::string& cwd = *sources.cwd;
+		if (cwd.empty()) {
+			segment.text = "?";
+		}
+		else if (homeLength > 1 && cwd.compare(0, homeLength, home) == 0
+			&& (cwd.size() == homeLength || cwd[homeLength] == '/')) {
+			segment.text = "~" + cwd.substr(homeLength);
+		}
+		else {
+			segment.text = cwd;
+		}
+		break;
+	}
+	case JOBS: segment.text = std::to_string(sources.jobs); break;
+	case STATUS: segment.text = std::to_string(sources.status); break;
+	case TIME: {
+		time_t seconds = segment.key;
+		struct tm local;
+		char text[16];
+		localtime_r(&seconds, &local);
+		strftime(text, sizeof(text), "%H:%M:%S", &local);
+		segment.text = text;
+		break;
+	}
+	default: break;
+	}
+}
+const std::string& PromptTemplate::render(const Sources& sources) {
+	if (!dynamic) {
+		return rendered;
+	}
+	bool changed = false;
+	for (auto& segment : segments) {
+		int64_t key = keyOf(segment, sources);
+		if (key != segment.key) {
+			segment.key = key;
+			refresh(segment, sources);
+			changed = true;
+		}
+	}
+	if (changed) {
+		rendered.clear();
+		for (const auto& segment : segments) {
+			rendered += segment.text;
+		}
+	}
+	return rendered;
+}
+
+
+// ChangePromptCommand Class
+ChangePromptCommand::ChangePromptCommand(const char* cmd_line, ShellSession& session)
+	: BuiltInCommand(cmd_line, session) {}
+ChangePromptCommand::~ChangePromptCommand() {}
+void ChangePromptCommand::execute() {
+	ArgVector args;
+	int argc = _parseCommandLine(m_cmd_line, args, m_session);
+
+	if (argc == 1) {
+		// No argument provided, reset to "smash"
+		m_session.setPrompt("smash");
+	}
+	else {
+		// Update the prompt with the first argument, compiled once here
+		m_session.setPrompt(args[1]);
+	}
+}
+
+
+// ChangeDirCommand Class
+ChangeDirCommand::ChangeDirCommand(const char* cmd_line, ShellSession& session)
+	: BuiltInCommand(cmd_line, session) {}
+ChangeDirCommand::~ChangeDirCommand() {}
+void ChangeDirCommand::execute() {
+	ShellSession& shell = m_session;
+
+	// No arguments: Do nothing
+	if (cmdSegments.size() == 1) {
+		return;
+	}
+
+	// Too many arguments: Print error and return
+	if (cmdSegments.size() > 2) {
+		m_session.err() << "smash error: cd: too many arguments" << std::endl;
+		m_status = 1;
+		return;
+	}
+
+	// Handle "cd -": Change to the last working directory
+	std::string targetDir = cmdSegments[1];
+	if (targetDir == "-") {
+		if (shell.getLastDir().empty()) {
+			m_session.err() << "smash error: cd: OLDPWD not set" << std::endl;
+			m_status = 1;
+			return;
+		}
+		targetDir = shell.getLastDir();
+	}
+
+	// The new directory is computed from the tracked one rather than asked
+	// back from the kernel with getcwd
+	std::string newDir = _resolvePath(shell.getPwd(), targetDir);
+	int dirFd = _openDirectory(newDir);
+	if (dirFd == -1) {
+		m_session.reportError("smash error: chdir failed");
+		m_status = 1;
+		return;
+	}
+
+	shell.setCwd(newDir, dirFd); // The previous directory becomes OLDPWD
+	shell.getCommandCache().invalidate();
+}
+
+
+// ShowPidCommand Class
+ShowPidCommand::ShowPidCommand(const char* cmd_line, ShellSession& session) : BuiltInCommand(cmd_line, session) {}
+ShowPidCommand::~ShowPidCommand() {}
+void ShowPidCommand::execute() {
+	m_session.out() << "smash pid is " << getpid() << std::endl;
+}
+
+
+// GetCurrDirCommand Class
+GetCurrDirCommand::GetCurrDirCommand(const char* cmd_line, ShellSession& session) : BuiltInCommand(cmd_line, session) {}
+GetCurrDirCommand::~GetCurrDirCommand() {}
+void GetCurrDirCommand::execute() {
+	std::string cwd = m_session.getPwd();
+	if (cwd.empty()) {
+		m_status = 1;
+	}
+	else {
+		m_session.out() << cwd << std::endl;
+	}
+}
+bool GetCurrDirCommand::isReadOnly() const { return true; }
+
+
+// JobsList Class
+JobsList::JobEntry::~JobEntry() {
+	if (routeSlot != -1) {
+		int status;
+		SignalRouter::release(routeSlot, status);
+	}
+	if (pidFd != -1) {
+		close(pidFd);
+	}
+	if (!cgroupPath.empty()) {
+		rmdir(cgroupPath.c_str()); // Succeeds once every process in it has exited
+	}
+}
+int JobsList::JobEntry::signal(int sig) const {
+	if (task) {
+		// Builtins can only be asked to stop, by the signals that end a process
+		if (sig == SIGKILL || sig == SIGTERM || sig == SIGINT || sig == SIGHUP || sig == SIGQUIT) {
+			task->cancelled = true;
+			return 0;
+		}
+		errno = EINVAL;
+		return sig == 0 ? 0 : -1;
+	}
+
+	// Through the pidfd a job that was already reaped fails with ESRCH,
+	// instead of the signal reaching whoever got its pid next
+	if (pidFd != -1) {
+		return _pidfdSendSignal(pidFd, sig);
+	}
+	return kill(pid, sig);
+}
+// Jobs lead their own process group, which keeps its id while the job is
+// unreaped, so the group can be signalled as safely as the job itself
+int JobsList::JobEntry::signalGroup(int sig) const {
+	if (!task && kill(-pid, sig) == 0) {
+		return 0;
+	}
+	return signal(sig);
+}
+// Non-blocking: true once the job was reaped, with its wait status
+bool JobsList::JobEntry::collect(int& status) {
+	if (task) {
+		std::lock_guard<std::mutex> guard(task->lock);
+		status = task->waitStatus;
+		return task->finished;
+	}
+	if (routeSlot != -1) {
+		if (!SignalRouter::collect(routeSlot, status)) {
+			return false;
+		}
+		routeSlot = -1;
+		return true;
+	}
+	pid_t result = waitpid(pid, &status, WNOHANG);
+	if (result == -1 && errno == ECHILD) {
+		status = 0;
+		return true; // Nothing left to wait for
+	}
+	return result > 0;
+}
+JobsList::JobsList(ShellSession& session) : session(session), lastm_job_id(0), board(nullptr) {}
+JobsList::~JobsList() {
+	for (auto job : jobs) {
+		delete job;
+	}
+	for (auto job : timedOutJobs) {
+		delete job;
+	}
+}
+int JobsList::size() const {
+	return jobs.size();
+}
+const std::list<JobsList::JobEntry*>& JobsList::getJobs() const {
+	return jobs;
+}
+JobsList::JobEntry* JobsList::addJob(const std::string& command, int pid, bool m_is_stopped) {
+	removeFinishedJobs(); // Clean up finished jobs
+	int m_job_id = ++lastm_job_id;
+	JobEntry* job = new JobEntry(m_job_id, pid, command, m_is_stopped);
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	job->startedNs = (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+	if (pid != getpid()) {
+		job->pidFd = _pidfdOpen(pid); // Safe while the child is unreaped, so before it is routed
+	}
+	jobs.push_back(job);
+	publish();
+	return job;
+}
+JobsList::JobEntry* JobsList::addBuiltinJob(const std::string& command, const std::shared_ptr<BuiltinTask>& task) {
+	JobEntry* job = addJob(command, getpid(), false);
+	job->task = task;
+	publish(); // Now as a builtin
+	return job;
+}
+void JobsList::printJobs() {
+	// Jobs their timeout killed are listed once more, in job-id order
+	std::vector<JobEntry*> listed(jobs.begin(), jobs.end());
+	listed.insert(listed.end(), timedOutJobs.begin(), timedOutJobs.end());
+	std::sort(listed.begin(), listed.end(), [](const JobEntry* a, const JobEntry* b) {
+		return a->m_job_id < b->m_job_id;
+	});
+	DeadlineQueue& deadlines = session.getDeadlines();
+	std::ostream& out = session.out();
+	for (const auto& job : listed) {
+		out << "[" << job->m_job_id << "] " << job->command
+			<< (job->m_is_stopped ? " (stopped)" : "")
+			<< (job->timedOut || deadlines.hasExpired(job->pid) ? " (timed out)" : "");
+		if (!job->limits.empty()) {
+			out << " [" << job->limits << "]";
+		}
+		if (!job->cpus.empty()) {
+			out << " [affinity=" << job->cpus << "]";
+		}
+		out << std::endl;
+	}
+	for (auto job : timedOutJobs) {
+		delete job;
+	}
+	timedOutJobs.clear();
+}
+void JobsList::removeFinishedJobs() {
+	// One poll over all pidfds finds the jobs that exited; running jobs are
+	// then skipped without a syscall each
+	std::vector<struct pollfd> exits;
+	for (auto job : jobs) {
+		if (job->pidFd != -1) {
+			exits.push_back({ job->pidFd, POLLIN, 0 });
+		}
+	}
+	if (!exits.empty() && poll(exits.data(), exits.size(), 0) == -1) {
+		for (auto& entry : exits) {
+			entry.revents = POLLIN; // Check every job the slow way
+		}
+	}
+
+	size_t exitIndex = 0;
+	size_t before = jobs.size();
+	for (auto it = jobs.begin(); it != jobs.end();) {
+		if ((*it)->pidFd != -1 && !(exits[exitIndex++].revents & POLLIN)) {
+			++it;
+			continue;
+		}
+
+		// Routed jobs were reaped by the SIGCHLD handler, only the rest are polled
+		int status;
+		pid_t result;
+		if ((*it)->task) {
+			result = (*it)->collect(status) ? (*it)->pid : 0;
+			if (result > 0) {
+				session.out() << (*it)->task->output << std::flush; // Held back until now
+			}
+		}
+		else if ((*it)->routeSlot != -1) {
+			result = SignalRouter::collect((*it)->routeSlot, status) ? (*it)->pid : 0;
+			if (result > 0) (*it)->routeSlot = -1;
+		}
+		else {
+			result = waitpid((*it)->pid, &status, WNOHANG);
+		}
+
+		if (result > 0) { // Job finished
+			// The deadline is only forgotten once the job carries its outcome
+			DeadlineQueue& deadlines = session.getDeadlines();
+			(*it)->timedOut = deadlines.hasExpired((*it)->pid);
+			deadlines.cancel((*it)->pid);
+			if ((*it)->timedOut) {
+				(*it)->m_is_stopped = false;
+				timedOutJobs.push_back(*it);
+			}
+			else {
+				delete* it;
+			}
+			it = jobs.erase(it);
+		}
+		else if (result == 0) { // Job still running
+			++it;
+		}
+		else { // Error in waitpid
+			session.reportError("smash error: waitpid failed");
+			++it;
+		}
+	}
+	if (jobs.size() != before) {
+		publish();
+	}
+}
+int JobsList::nextJobId() const {
+	return lastm_job_id + 1;
+}
+JobsList::JobEntry* JobsList::getJobById(int m_job_id) {
+	for (auto& job : jobs) {
+		if (job->m_job_id == m_job_id) {
+			return job;
+		}
+	}
+	return nullptr; // Job not found
+}
+void JobsList::removeJobById(int m_job_id) {
+	for (auto it = jobs.begin(); it != jobs.end(); ++it) {
+		if ((*it)->m_job_id == m_job_id) {
+			delete* it;
+			jobs.erase(it);
+			publish();
+			return;
+		}
+	}
+}
+static const double SHUTDOWN_KILL_WAIT = 1.0; // Seconds SIGKILLed jobs get to disappear
+
+// Waits for all pending jobs at once until they exited or the deadline
+// passed. Reaped jobs move from pending to statuses; pidfds make every exit
+// an event, jobs without one are rechecked every few milliseconds.
+static void _awaitJobs(std::vector<JobsList::JobEntry*>& pending, std::map<JobsList::JobEntry*, int>& statuses,
+	uint64_t deadlineNs) {
+	std::vector<struct pollfd> exits;
+	while (!pending.empty()) {
+		exits.clear();
+		bool polled = false;
+		for (auto job : pending) {
+			exits.push_back({ job->pidFd, POLLIN, 0 }); // Negative fds are skipped
+			polled = polled || job->pidFd == -1;
+		}
+
+		uint64_t now = _monotonicNs();
+		int timeoutMs = now >= deadlineNs ? 0 : (int)((deadlineNs - now + 999999) / 1000000);
+		if (polled) {
+			timeoutMs = std::min(timeoutMs, 10);
+		}
+		if (poll(exits.data(), exits.size(), timeoutMs) == -1 && errno != EINTR) {
+			for (auto& entry : exits) {
+				entry.revents = POLLIN; // Check every job the slow way
+			}
+		}
+
+		size_t kept = 0;
+		for (size_t i = 0; i < pending.size(); ++i) {
+			JobsList::JobEntry* job = pending[i];
+			int status;
+			bool ready = job->pidFd == -1 || (exits[i].revents & (POLLIN | POLLHUP | POLLERR));
+			if (ready && job->collect(status)) {
+				statuses[job] = status;
+			}
+			else {
+				pending[kept++] = job;
+			}
+		}
+		pending.resize(kept);
+		if (_monotonicNs() >= deadlineNs) {
+			break;
+		}
+	}
+}
+
+void JobsList::killAllJobs() {
+	std::vector<JobEntry*> pending;
+	for (auto& job : jobs) {
+		if (job->signalGroup(SIGKILL) == -1) {
+			session.reportError("smash error: kill failed");
+		}
+		else {
+			session.out() << job->pid << ": " << job->command << std::endl;
+			pending.push_back(job);
+		}
+	}
+
+	// Reap the jobs rather than leave zombies, but never hang on one stuck
+	// in an uninterruptible sleep
+	std::map<JobEntry*, int> statuses;
+	_awaitJobs(pending, statuses, _monotonicNs() + (uint64_t)(SHUTDOWN_KILL_WAIT * 1e9));
+
+	for (auto job : jobs) {
+		delete job;
+	}
+	jobs.clear();
+	publish();
+}
+// Graceful shutdown: every job gets SIGTERM at once and the whole list shares
+// one deadline, after which the stragglers are killed. Ends with a summary.
+void JobsList::terminateAllJobs(double grace) {
+	std::ostream& out = session.out();
+	out << "smash: sending SIGTERM signal to " << jobs.size() << " jobs:" << std::endl;
+
+	std::vector<JobEntry*> pending;
+	for (auto job : jobs) {
+		job->signalGroup(SIGTERM);
+		job->signalGroup(SIGCONT); // Stopped jobs only see SIGTERM once resumed
+		pending.push_back(job);
+	}
+	std::map<JobEntry*, int> statuses;
+	_awaitJobs(pending, statuses, _monotonicNs() + _durationNs(grace));
+
+	std::set<JobEntry*> escalated(pending.begin(), pending.end());
+	for (auto job : pending) {
+		job->signalGroup(SIGKILL);
+	}
+	_awaitJobs(pending, statuses, _monotonicNs() + (uint64_t)(SHUTDOWN_KILL_WAIT * 1e9));
+
+	for (auto job : jobs) {
+		out << job->pid << ": " << job->command << ": ";
+		auto found = statuses.find(job);
+		if (found == statuses.end()) {
+			out << "still running after SIGKILL";
+		}
+		else if (escalated.count(job)) {
+			out << "killed after " << grace << "s";
+		}
+		else if (WIFSIGNALED(found->second)) {
+			out << "terminated by signal " << WTERMSIG(found->second);
+		}
+		else {
+			out << "exited with status " << WEXITSTATUS(found->second);
+		}
+		out << std::endl;
+		delete job;
+	}
+	jobs.clear();
+	publish();
+}
+void JobsList::setStatusBoard(JobBoardWriter* statusBoard) {
+	board = statusBoard;
+	publish();
+}
+// Jobs are sampled from /proc on every publish, so the board also carries
+// their state and CPU time as of the last change
+void JobsList::publish() const {
+	if (!board) {
+		return;
+	}
+	std::vector<JobBoardSlot> slots;
+	slots.reserve(std::min(jobs.size(), (size_t)JOB_BOARD_SLOTS));
+	for (auto job : jobs) {
+		if (slots.size() == JOB_BOARD_SLOTS) break;
+		JobBoardSlot slot;
+		memset(&slot, 0, sizeof(slot));
+		slot.jobId = job->m_job_id;
+		slot.pid = job->pid;
+		slot.startedNs = job->startedNs;
+		strncpy(slot.command, job->command.c_str(), JOB_BOARD_COMMAND - 1);
+		if (job->task) {
+			slot.state = JOB_BUILTIN; // Its /proc entry is the shell's
+		}
+		else {
+			_jobBoardSample(slot);
+			if (job->m_is_stopped && slot.state == JOB_RUNNING) {
+				slot.state = JOB_STOPPED; // Signalled, but not stopped yet
+			}
+		}
+		slots.push_back(slot);
+	}
+	board->publish(slots, jobs.size());
+}
+
+
+// JobsCommand Class
+JobsCommand::JobsCommand(const char* cmd_line, ShellSession& session, JobsList* jobsList) : BuiltInCommand(cmd_line, session), m_jobsList(jobsList) {}
+JobsCommand::~JobsCommand() {}
+void JobsCommand::execute() {
+	if (!m_jobsList) {
+		m_session.err() << "smash error: jobs list is null" << std::endl;
+		m_status = 1;
+		return;
+	}
+
+	m_jobsList->removeFinishedJobs();
+	m_jobsList->printJobs();
+}
+
+
+// KillCommand Class
+KillCommand::KillCommand(const char* cmd_line, ShellSession& session, JobsList* jobs) : BuiltInCommand(cmd_line, session), jobsList(jobs) {}
+KillCommand::~KillCommand() {}
+void KillCommand::execute() {
+	ArgVector args;
+	int argc = _parseCommandLine(m_cmd_line, args, m_session);
+
+	// kill -<signal> target..., where a target is %<job-id> or a pid. The
+	// original form, a signal number and a single bare number, still names a
+	// job id; a lone pid is signalled with a signal name, as in kill -KILL 42.
+	int signum = argc >= 3 && args[1][0] == '-' ? _parseSignal(args[1] + 1) : -1;
+	bool valid = signum != -1;
+	for (int i = 2; valid && i < argc; ++i) {
+		const char* digits = args[i][0] == '%' ? args[i] + 1 : args[i];
+		size_t length = strlen(digits);
+		valid = length > 0 && length <= 9 && strspn(digits, "0123456789") == length && atoi(digits) > 0;
+	}
+	if (!valid) {
+		m_session.err() << "smash error: kill: invalid arguments" << std::endl;
+		m_status = 1;
+		return;
+	}
+	bool legacyForm = argc == 3 && isdigit(args[1][1]) && args[2][0] != '%';
+
+	for (int i = 2; i < argc; ++i) {
+		bool isJob = legacyForm || args[i][0] == '%';
+		int id = atoi(args[i][0] == '%' ? args[i] + 1 : args[i]);
+		if (!isJob) {
+			// The pidfd keeps the signal from reaching a process that took over the pid
+			int pidFd = _pidfdOpen(id);
+			int result = pidFd != -1 ? _pidfdSendSignal(pidFd, signum) : errno == ENOSYS ? kill(id, signum) : -1;
+			if (pidFd != -1) close(pidFd);
+			if (result == -1 && errno == ESRCH) {
+				m_session.err() << "smash error: kill: pid " << id << " does not exist" << std::endl;
+				m_status = 1;
+			}
+			else if (result == -1) {
+				m_session.reportError("smash error: kill failed");
+				m_status = 1;
+			}
+			else {
+				m_session.out() << "signal number " << signum << " was sent to pid " << id << std::endl;
+			}
+			continue;
+		}
+
+		// Validate job ID
+		JobsList::JobEntry* job = jobsList->getJobById(id);
+		if (!job) {
+			m_session.err() << "smash error: kill: job-id " << id << " does not exist" << std::endl;
+			m_status = 1;
+			continue;
+		}
+
+		// Send signal to process
+		if (job->signal(signum) == -1) {
+			m_session.reportError("smash error: kill failed");
+			m_status = 1;
+		}
+		else {
+			m_session.out() << "signal number " << signum << " was sent to pid " << job->pid << std::endl;
+			if (!job->task && (signum == SIGSTOP || signum == SIGTSTP || signum == SIGTTIN || signum == SIGTTOU)) {
+				job->m_is_stopped = true;
+			}
+			else if (signum == SIGCONT) {
+				job->m_is_stopped = false;
+			}
+			jobsList->publish();
+		}
+	}
+}
+
+
+// QuitCommand Class
+QuitCommand::QuitCommand(const char* cmd_line, ShellSession& session, JobsList* jobs)
+	: BuiltInCommand(cmd_line, session), jobsList(jobs) {}
+QuitCommand::~QuitCommand() {}
+void QuitCommand::execute() {
+	JobsList& jobsList = m_session.getJobsList();
+	ArgVector args;
+	int argc = _parseCommandLine(m_cmd_line, args, m_session);
+	std::string mode = argc > 1 ? args[1] : "";
+
+	if (mode == "kill") {
+		m_session.out() << "smash: sending SIGKILL signal to " << jobsList.getJobs().size() << " jobs:" << std::endl;
+		jobsList.killAllJobs();
+	}
+	else if (mode == "term") {
+		// quit term [grace seconds]
+		double grace = TIMEOUT_DEFAULT_GRACE;
+		char* end = nullptr;
+		if (argc == 3) {
+			grace = strtod(args[2], &end);
+		}
+		if (argc > 3 || (end && (*end != '\0' || !std::isfinite(grace) || grace < 0))) {
+			m_session.err() << "smash error: quit: invalid arguments" << std::endl;
+			m_status = 1;
+			return;
+		}
+		if (m_session.isAsyncForeground()) {
+			// Waiting out a grace period here would hold up every other
+			// client of the server, so stragglers are killed at once
+			grace = 0;
+		}
+		jobsList.terminateAllJobs(grace);
+	}
+	m_session.requestQuit(); // Ends this session only; the host decides about the process
+}
+
+
+// ForegroundCommand Class
+ForegroundCommand::ForegroundCommand(const char* cmd_line, ShellSession& session, JobsList* jobs) : BuiltInCommand(cmd_line, session), jobsList(jobs) {}
+ForegroundCommand::~ForegroundCommand() {}
+void ForegroundCommand::execute() {
+	ArgVector args;
+	int argc = _parseCommandLine(m_cmd_line, args, m_session);
+
+	JobsList::JobEntry* job = nullptr;
+
+	// Case 1: No arguments provided
+	if (argc == 1) {
+		// Get the job with the highest job ID
+		job = jobsList->getJobById(jobsList->size());
+		if (!job) {
+			m_session.err() << "smash error: fg: jobs list is empty" << std::endl;
+			m_status = 1;
+			return;
+		}
+	}
+	// Case 2: One argument provided
+	else if (argc == 2) {
+		int m_job_id = atoi(args[1]);
+		if (m_job_id <= 0) {
+			m_session.err() << "smash error: fg: invalid arguments" << std::endl;
+			m_status = 1;
+			return;
+		}
+
+		// Try to find the job with the given job ID
+		job = jobsList->getJobById(m_job_id);
+		if (!job) {
+			m_session.err() << "smash error: fg: job-id " << m_job_id << " does not exist" << std::endl;
+			m_status = 1;
+			return;
+		}
+	}
+	// Case 3: Invalid number of arguments
+	else {
+		m_session.err() << "smash error: fg: invalid arguments" << std::endl;
+		m_status = 1;
+		return;
+	}
+
+	// Print the job's command and PID
+	m_session.out() << job->command << " " << job->pid << std::endl;
+
+	// A builtin job is waited for in place; its output follows once it is done
+	if (job->task) {
+		std::shared_ptr<BuiltinTask> task = job->task;
+		std::unique_lock<std::mutex> guard(task->lock);
+		task->done.wait(guard, [&task] { return task->finished; });
+		m_session.out() << task->output << std::flush;
+		m_status = _exitStatus(task->waitStatus);
+		guard.unlock();
+		jobsList->removeJobById(job->m_job_id);
+		return;
+	}
+
+	// The exit status belongs to fg, so the SIGCHLD handler stops reaping
+	// the job; it may already have done so
+	int status = 0;
+	bool reaped = false;
+	if (job->routeSlot != -1) {
+		reaped = SignalRouter::release(job->routeSlot, status);
+		job->routeSlot = -1;
+	}
+	if (reaped) {
+		m_status = _exitStatus(status);
+		jobsList->removeJobById(job->m_job_id);
+		return;
+	}
+
+	// Send SIGCONT to the job to resume it if stopped
+	if (job->signal(SIGCONT) == -1) {
+		m_session.reportError("smash error: fg failed");
+		m_status = 1;
+		return;
+	}
+
+	// The job leaves the list and becomes the shell's foreground child
+	ShellSession& shell = m_session;
+	int pid = job->pid;
+	shell.beginForeground(pid, job->command, "", job->cgroupPath);
+	job->cgroupPath.clear();
+	jobsList->removeJobById(job->m_job_id);
+	if (shell.isSuspended()) {
+		return; // The host waits for the child and resumes the session
+	}
+
+	// Wait for the job to finish
+	bool waited = waitpid(pid, &status, WUNTRACED) != -1;
+	if (!waited) {
+		m_session.reportError("smash error: waitpid failed");
+	}
+	m_status = shell.endForeground(status);
+	if (!waited) {
+		m_status = 1;
+	}
+}
+
+
+// AliasCommand Class
+AliasCommand::AliasCommand(const char* cmd_line, ShellSession& session, std::map<std::string, std::string>& aliasMap)
+	: BuiltInCommand(cmd_line, session), aliasMap(aliasMap) {}
+AliasCommand::~AliasCommand() {}
+void AliasCommand::execute() {
+	// Trim the command line to handle any spaces
+	std::string commandLine = _trim(m_cmd_line);
+
+	// Case 1: If the command is exactly "alias" with no arguments
+	if (commandLine == "alias") {
+		// Print all aliases in the map
+		for (const auto& alias : aliasMap) {
+			m_session.out() << alias.first << "='" << alias.second << "'" << std::endl;
+		}
+		return; // Exit after printing
+	}
+
+	// Case 2: Handle alias creation (alias <name>='<command>')
+	size_t equalPos = commandLine.find('=');
+	if (equalPos == std::string::npos || equalPos < 6) { // Missing '=' or alias name
+		m_session.err() << "smash error: alias: invalid alias format" << std::endl;
+		m_status = 1;
+		return;
+	}
+
+	// Extract the alias name and command
+	std::string aliasName = _trim(commandLine.substr(6, equalPos - 6));
+	std::string aliasCommand = _trim(commandLine.substr(equalPos + 1));
+
+	// Validate alias name format
+	if (!std::regex_match(aliasName, std::regex("^[a-zA-Z0-9_]+$"))) {
+		m_session.err() << "smash error: alias: invalid alias format" << std::endl;
+		m_status = 1;
+		return;
+	}
+
+	// Check for proper quotes around the alias command
+	if (aliasCommand.length() < 2 || aliasCommand.front() != '\'' || aliasCommand.back() != '\'') {
+		m_session.err() << "smash error: alias: invalid alias format" << std::endl;
+		m_status = 1;
+		return;
+	}
+
+	// Remove surrounding quotes from the command
+	aliasCommand = aliasCommand.substr(1, aliasCommand.length() - 2);
+
+	// Check for reserved keywords
+	static const std::set<std::string> reservedKeywords = {
+		"quit", "fg", "bg", "jobs", "kill", "cd", "listdir", "chprompt", "alias", "unalias", "pwd", "showpid",
+		"limit", "taskset", "placement", "timeout", "cache", "whoami", "export", "unset", "joblog", "netinfo", "pgrep", "pkill"
+	};
+
+	if (reservedKeywords.count(aliasName) || aliasMap.count(aliasName)) {
+		m_session.err() << "smash error: alias: " << aliasName << " already exists or is a reserved command" << std::endl;
+		m_status = 1;
+		return;
+	}
+
+	// Add the alias to the map
+	aliasMap[aliasName] = aliasCommand;
+}
+
+// UnaliasCommand Class
+UnaliasCommand::UnaliasCommand(const char* cmd_line, ShellSession& session, std::map<std::string, std::string>& aliasMap)
+	: BuiltInCommand(cmd_line, session), aliasMap(aliasMap) {}
+UnaliasCommand::~UnaliasCommand() {}
+void UnaliasCommand::execute() {
+	ArgVector args;
+	int argc = _parseCommandLine(m_cmd_line, args, m_session);
+
+	if (argc != 2) {
+		m_session.err() << "smash error: unalias: invalid arguments" << std::endl;
+		m_status = 1;
+		return;
+	}
+
+	std::string aliasName = args[1];
+
+	if (aliasMap.erase(aliasName) == 0) {
+		m_session.err() << "smash error: unalias: alias \"" << aliasName << "\" does not exist" << std::endl;
+		m_status = 1;
+	}
+	else {
+		m_session.out() << "Alias \"" << aliasName << "\" removed" << std::endl;
+	}
+}
+
+
+// RedirectionCommand Class
+RedirectionCommand::RedirectionCommand(const char* cmd_line, ShellSession& session)
+	: BuiltInCommand(cmd_line, session), m_isAppend(false) {
+	// Parse the command line for redirection
+	size_t redirectionPos = m_cmd_line.find('>');
+	if (redirectionPos != std::string::npos) {
+		m_isAppend = (m_cmd_line[redirectionPos + 1] == '>'); // Check if it's >>
+		size_t fileStart = m_isAppend ? redirectionPos + 2 : redirectionPos + 1;
+
+		// Trim and extract the file path
+		m_file_redirect = m_cmd_line.substr(fileStart);
+		_trimAmp(m_file_redirect);
+
+		// Remove redirection and file path from the command
+		m_cmd_line = _trim(m_cmd_line.substr(0, redirectionPos));
+
+		// Update `cmdSegments` after removing redirection parts
+		_parseCommandLine(m_cmd_line, cmdSegments, m_session);
+	}
+	else {
+		m_session.err() << "smash error: invalid redirection syntax" << std::endl;
+		m_file_redirect.clear();
+	}
+}
+RedirectionCommand::~RedirectionCommand() {}
+void RedirectionCommand::execute() {
+	if (m_file_redirect.empty()) {
+		m_session.err() << "smash error: no file specified for redirection" << std::endl;
+		m_status = 1;
+		return;
+	}
+
+	// Only this session's output moves to the file; the process's stdout
+	// stays where it is, so other sessions are unaffected
+	int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (m_isAppend ? O_APPEND : O_TRUNC);
+	int fd = openat(m_session.getCwdFd(), m_file_redirect.c_str(), flags, 0644);
+	if (fd == -1) {
+		m_session.reportError("smash error: open failed");
+		m_status = 1;
+		return;
+	}
+
+	FdStreamBuf fileBuf(fd);
+	std::ostream fileStream(&fileBuf);
+	ShellSession::OutputTarget previous = m_session.getOutput();
+	ShellSession::OutputTarget target = { &fileStream, fd };
+	m_session.setOutput(target);
+
+	Command* cmd = m_session.generateCommand(m_cmd_line.c_str());
+	if (cmd && m_is_background && cmd->canRunInBackground()) {
+		// The job writes the file from the worker pool through its own descriptor
+		m_session.setOutput(previous);
+		m_session.runInBackground(cmd, fd);
+		return;
+	}
+	if (cmd) {
+		cmd->execute();
+		m_status = cmd->getStatus();
+		delete cmd;
+	}
+	else {
+		m_session.err() << "smash error: failed to create command" << std::endl;
+		m_status = 1;
+	}
+
+	// Restore the previous output
+	fileStream.flush();
+	m_session.setOutput(previous);
+	close(fd);
+}
+
+
+// ListDirCommand Class
+static const size_t LISTDIR_DEFAULT_BUDGET = 64 << 20;  // Bytes of names held in memory, K/M/G suffixes allowed
+static const size_t LISTDIR_OPEN_LEVELS = 64;            // Levels that keep their fd while deeper ones are listed,
+static const size_t LISTDIR_ANCHOR_LEVELS = 16;          // and below them one in this many
+
+static bool _isAnchorLevel(size_t depth) {
+	return depth < LISTDIR_OPEN_LEVELS || depth % LISTDIR_ANCHOR_LEVELS == 0;
+}
+
+
+ListDirCommand::ListDirCommand(const char* cmd_line, ShellSession& session) : BuiltInCommand(cmd_line, session) {
+	// Read from the session, as export and unset change only its environment
+	const Environment& env = m_session.getEnvironment();
+	const char* budget = env.get("SMASH_LISTDIR_BUDGET");
+	const char* tempDir = env.get("TMPDIR");
+	m_tempDir = tempDir ? tempDir : "";
+	long long limit = budget ? _parseSize(budget) : -1;
+	m_budget.limit = limit > 0 ? limit : LISTDIR_DEFAULT_BUDGET;
+	m_budget.used = 0;
+
+	// Without an argument list the working directory the shell tracks
+	if (cmdSegments.size() <= 2) {
+		m_directoryPath = (cmdSegments.size() == 1)
+			? m_session.getPwd()
+			: _resolvePath(m_session.getPwd(), cmdSegments[1]);
+	}
+}
+ListDirCommand::~ListDirCommand() {}
+bool ListDirCommand::isReadOnly() const { return true; }
+bool ListDirCommand::canRunInBackground() const { return true; }
+// The current directory's fd, opened again from the nearest anchor above it
+// one name at a time, so that depth is not limited by the maximal path length
+int ListDirCommand::levelFd() {
+	size_t depth = m_levels.size() - 1;
+	if (m_levels[depth].fd != -1) {
+		return m_levels[depth].fd;
+	}
+	size_t anchor = depth;
+	while (m_levels[anchor].fd == -1) --anchor; // Anchors always hold theirs
+	int fd = m_levels[anchor].fd;
+	for (size_t i = anchor + 1; i <= depth && fd != -1; ++i) {
+		int next = openat(fd, m_levels[i].name.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (fd != m_levels[anchor].fd) {
+			close(fd);
+		}
+		fd = next;
+	}
+	m_levels[depth].fd = fd;
+	return fd;
+}
+// A stream over the current directory from its first entry. An anchor lends
+// the stream a duplicate; other levels hand over their fd.
+DIR* ListDirCommand::openStream() {
+	int fd = levelFd();
+	if (fd != -1 && _isAnchorLevel(m_levels.size() - 1)) {
+		fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	}
+	else {
+		m_levels.back().fd = -1;
+	}
+	DIR* dir = fd == -1 ? nullptr : fdopendir(fd);
+	if (!dir) {
+		if (fd != -1) close(fd);
+		return nullptr;
+	}
+	rewinddir(dir); // A duplicate shares the offset of an earlier stream
+	return dir;
+}
+// Sorts the entries into the lists, skipping either kind when its list is
+// null; returns how many subdirectories there are
+size_t ListDirCommand::readEntries(DIR* dir, SortedNames* directories, SortedNames* files) {
+	size_t subdirectories = 0;
+	struct dirent* entry;
+	while ((entry = readdir(dir)) != nullptr && !isCancelled()) {
+		// Skip current and parent directory symbols
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+			continue;
+		}
+
+		// d_type settles most entries; links are followed as before
+		bool isDir = entry->d_type == DT_DIR;
+		if (entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK) {
+			struct stat statbuf;
+			isDir = fstatat(dirfd(dir), entry->d_name, &statbuf, 0) == 0 && S_ISDIR(statbuf.st_mode);
+		}
+		subdirectories += isDir;
+		SortedNames* names = isDir ? directories : files;
+		if (names) {
+			names->add(entry->d_name, strlen(entry->d_name));
+		}
+	}
+	return subdirectories;
+}
+void ListDirCommand::listDirectoryRecursively(const std::string& path, const std::string& indent) {
+	DIR* dir = openStream();
+	if (!dir) {
+		reportError("smash error: opendir failed");
+		m_status = 1;
+		return;
+	}
+	if (m_watcher) {
+		m_watcher->watch(path); // Before the first readdir
+	}
+
+	// Names are kept compactly and sorted within the budget; huge
+	// directories spill to temporary files instead of growing the heap
+	SortedNames directories(m_budget, m_tempDir);
+	std::unique_ptr<SortedNames> files(new SortedNames(m_budget, m_tempDir));
+	bool hasSubdirectories = readEntries(dir, &directories, files.get()) > 0;
+	closedir(dir);
+	directories.finish();
 
-	m_jobsList->removeFinishedJobs();
-	m_jobsList->printJobs();
+	// The files of a directory with subdirectories are read again after them,
+	// so that no level holds its files while deeper ones are listed
+	bool failed = directories.hasFailed();
+	if (hasSubdirectories) {
+		failed = failed || files->hasFailed();
+		files.reset();
+	}
+
+	// Print directories
+	const char* dirName;
+	while ((dirName = directories.next()) != nullptr) {
+		if (isCancelled()) break;
+		out() << indent << dirName << "/" << std::endl;
+		int parentFd = levelFd();
+		int childFd = parentFd == -1 ? -1 : openat(parentFd, dirName, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (childFd == -1) {
+			reportError("smash error: opendir failed");
+			m_status = 1;
+			continue;
+		}
+		if (!_isAnchorLevel(m_levels.size() - 1)) {
+			close(parentFd);
+			m_levels.back().fd = -1;
+		}
+		m_levels.push_back({ dirName, childFd });
+		listDirectoryRecursively(path + "/" + dirName, indent + "\t");
+		if (m_levels.back().fd != -1) {
+			close(m_levels.back().fd);
+		}
+		m_levels.pop_back();
+	}
+	failed = failed || directories.hasFailed();
+
+	if (hasSubdirectories && !isCancelled()) {
+		files.reset(new SortedNames(m_budget, m_tempDir));
+		dir = openStream();
+		if (!dir) {
+			reportError("smash error: opendir failed");
+			m_status = 1;
+			return;
+		}
+		readEntries(dir, nullptr, files.get());
+		closedir(dir);
+	}
+	if (files) {
+		files->finish();
+	}
+
+	// Print files
+	const char* fileName;
+	while (files && (fileName = files->next()) != nullptr) {
+		if (isCancelled()) break;
+		out() << indent << fileName << std::endl;
+	}
+
+	if (failed || (files && files->hasFailed())) {
+		err() << "smash error: listdir: reading back a temporary file failed" << std::endl;
+		m_status = 1;
+	}
 }
+void ListDirCommand::execute() {
+	if (cmdSegments.size() > 2) {
+		err() << "smash error: listdir: too many arguments" << std::endl;
+		m_status = 1;
+		return;
+	}
 
+	int dirFd = _openDirectory(m_directoryPath);
+	if (dirFd == -1) {
+		reportError("smash error: listdir");
+		m_status = 1;
+		return;
+	}
 
-// KillCommand Class
-KillCommand::KillCommand(const char* cmd_line, JobsList* jobs) : BuiltInCommand(cmd_line), jobsList(jobs) {}
-KillCommand::~KillCommand() {}
-void KillCommand::execute() {
-	char* args[COMMAND_MAX_ARGS];
-	int argc = _parseCommandLine(m_cmd_line, args);
+	m_levels.push_back({ "", dirFd });
+	listDirectoryRecursively(m_directoryPath);
+	if (m_levels.back().fd != -1) {
+		close(m_levels.back().fd);
+	}
+	m_levels.clear();
+}
+
+
+// LimitCommand Class
+LimitCommand::LimitCommand(const char* cmd_line, ShellSession& session) : BuiltInCommand(cmd_line, session) {}
+LimitCommand::~LimitCommand() {}
+void LimitCommand::execute() {
+	ArgVector args;
+	int argc = _parseCommandLine(m_cmd_line, args, m_session);
+
+	// Consume "--option value" pairs; the rest of the line is the command to run
+	ResourceLimits limits;
+	bool valid = true;
+	int i = 1;
+	for (; i + 1 < argc && strncmp(args[i], "--", 2) == 0; i += 2) {
+		std::string option = args[i];
+		long long value = option == "--cpus" ? _parseCpuPercent(args[i + 1]) : _parseSize(args[i + 1]);
+		if (value < 0) {
+			valid = false;
+			break;
+		}
+		if (option == "--cpu") limits.cpuSeconds = value;
+		else if (option == "--cpus") limits.cpuPercent = value;
+		else if (option == "--mem") limits.memBytes = value;
+		else if (option == "--nofile") limits.openFiles = value;
+		else {
+			valid = false;
+			break;
+		}
+	}
+
+	if (!valid || i >= argc || strcmp(args[i], "&") == 0 || limits.empty()) {
+		m_session.err() << "smash error: limit: invalid arguments" << std::endl;
+		m_status = 1;
+	}
+	else {
+		ExternalCommand cmd(_joinArgs(args, i, argc).c_str(), m_session);
+		cmd.setLimits(limits);
+		cmd.execute();
+		m_status = cmd.getStatus();
+	}
+}
+
+
+// TasksetCommand Class
+TasksetCommand::TasksetCommand(const char* cmd_line, ShellSession& session) : BuiltInCommand(cmd_line, session) {}
+TasksetCommand::~TasksetCommand() {}
+void TasksetCommand::execute() {
+	ArgVector args;
+	int argc = _parseCommandLine(m_cmd_line, args, m_session);
+
+	cpu_set_t cpus;
+	if (argc < 3 || strcmp(args[2], "&") == 0 || !_parseCpuList(args[1], cpus)) {
+		m_session.err() << "smash error: taskset: invalid arguments" << std::endl;
+		m_status = 1;
+	}
+	else {
+		ExternalCommand cmd(_joinArgs(args, 2, argc).c_str(), m_session);
+		cmd.setAffinity(cpus);
+		cmd.execute();
+		m_status = cmd.getStatus();
+	}
+}
+
+
+// PlacementCommand Class
+PlacementCommand::PlacementCommand(const char* cmd_line, ShellSession& session, CpuPlacer& placer)
+	: BuiltInCommand(cmd_line, session), placer(placer) {}
+PlacementCommand::~PlacementCommand() {}
+void PlacementCommand::execute() {
+	ArgVector args;
+	int argc = _parseCommandLine(m_cmd_line, args, m_session);
+
+	if (argc == 1) {
+		m_session.out() << "placement: " << placer.getPolicyName() << std::endl;
+	}
+	else if (argc != 2 || !placer.setPolicy(args[1])) {
+		m_session.err() << "smash error: placement: invalid arguments" << std::endl;
+		m_status = 1;
+	}
+}
+
+
+// TimeoutCommand Class
+TimeoutCommand::TimeoutCommand(const char* cmd_line, ShellSession& session) : BuiltInCommand(cmd_line, session) {}
+TimeoutCommand::~TimeoutCommand() {}
+void TimeoutCommand::execute() {
+	ArgVector args;
+	int argc = _parseCommandLine(m_cmd_line, args, m_session);
+
+	// timeout [-k <grace>] <seconds> <command>
+	int i = 1;
+	double grace = TIMEOUT_DEFAULT_GRACE;
+	char* end = nullptr;
+	bool valid = true;
+	if (argc > 2 && strcmp(args[1], "-k") == 0) {
+		grace = strtod(args[2], &end);
+		valid = *end == '\0' && std::isfinite(grace) && grace >= 0;
+		i = 3;
+	}
+	double seconds = 0;
+	if (valid && i < argc) {
+		seconds = strtod(args[i], &end);
+		valid = *end == '\0' && std::isfinite(seconds) && seconds > 0;
+		i++;
+	}
+
+	if (!valid || i >= argc || strcmp(args[i], "&") == 0) {
+		m_session.err() << "smash error: timeout: invalid arguments" << std::endl;
+		m_status = 1;
+	}
+	else {
+		ExternalCommand cmd(_joinArgs(args, i, argc).c_str(), m_session);
+		cmd.setTimeout(seconds, grace);
+		cmd.execute();
+		m_status = cmd.getStatus();
+	}
+}
+
+
+// WhoamiCommand Class
+WhoamiCommand::WhoamiCommand(const char* cmd_line, ShellSession& session) : BuiltInCommand(cmd_line, session) {}
+void WhoamiCommand::execute() {
+	Environment& env = m_session.getEnvironment();
+	const char* username = env.get("USER"); // Retrieve the USER environment variable
+	const char* homeDir = env.get("HOME");  // Retrieve the HOME environment variable
+
+	if (username && homeDir) {
+		m_session.out() << username << " " << homeDir << std::endl;
+	}
+	else {
+		m_session.err() << "smash error: whoami: failed to retrieve user information" << std::endl;
+		m_status = 1;
+	}
+}
+bool WhoamiCommand::isReadOnly() const { return true; }
+
+
+// ExportCommand Class
+static bool _isValidName(const std::string& name) {
+	if (name.empty() || isdigit((unsigned char)name[0])) return false;
+	for (char c : name) {
+		if (!isalnum((unsigned char)c) && c != '_') return false;
+	}
+	return true;
+}
 
-	// Validate input: must have exactly 3 arguments and first starts with '-'
-	if (argc != 3 || args[1][0] != '-' || !isdigit(args[1][1]) || !isdigit(args[2][0])) {
-		std::cerr << "smash error: kill: invalid arguments" << std::endl;
-		for (int i = 0; i < argc; ++i) free(args[i]);
+ExportCommand::ExportCommand(const char* cmd_line, ShellSession& session) : BuiltInCommand(cmd_line, session) {}
+ExportCommand::~ExportCommand() {}
+void ExportCommand::execute() {
+	Environment& env = m_session.getEnvironment();
+
+	// Without arguments print the environment sorted by name
+	if (cmdSegments.size() == 1) {
+		std::vector<std::string> entries;
+		for (char* const* entry = env.getEnvp(); *entry; ++entry) {
+			entries.push_back(*entry);
+		}
+		std::sort(entries.begin(), entries.end());
+		for (const auto& entry : entries) {
+			m_session.out() << entry << std::endl;
+		}
 		return;
 	}
 
-	int signum = atoi(args[1] + 1);  // Skip '-' and parse the signal number
-	int m_job_id = atoi(args[2]);       // Parse job ID
+	for (int i = 1; i < cmdSegments.size(); ++i) {
+		std::string assignment = cmdSegments[i];
+		size_t equalPos = assignment.find('=');
+		std::string name = assignment.substr(0, equalPos);
+		if (!_isValidName(name)) {
+			m_session.err() << "smash error: export: `" << assignment << "': not a valid identifier" << std::endl;
+			m_status = 1;
+			continue;
+		}
+		if (equalPos == std::string::npos) {
+			continue; // Everything the shell holds is exported already
+		}
+
+		std::string value = assignment.substr(equalPos + 1);
+		if (value.size() >= 2 && (value[0] == '\'' || value[0] == '"') && value.back() == value[0]) {
+			value = value.substr(1, value.size() - 2);
+		}
+		env.set(name, value);
+	}
+}
+
+
+// UnsetCommand Class
+UnsetCommand::UnsetCommand(const char* cmd_line, ShellSession& session) : BuiltInCommand(cmd_line, session) {}
+UnsetCommand::~UnsetCommand() {}
+void UnsetCommand::execute() {
+	Environment& env = m_session.getEnvironment();
+	for (int i = 1; i < cmdSegments.size(); ++i) {
+		if (!_isValidName(cmdSegments[i])) {
+			m_session.err() << "smash error: unset: `" << cmdSegments[i] << "': not a valid identifier" << std::endl;
+			m_status = 1;
+			continue;
+		}
+		env.unset(cmdSegments[i]);
+	}
+}
+
 
-	// Validate job ID
-	JobsList::JobEntry* job = jobsList->getJobById(m_job_id);
-	if (!job) {
-		std::cerr << "smash error: kill: job-id " << m_job_id << " does not exist" << std::endl;
-		for (int i = 0; i < argc; ++i) free(args[i]);
+// Environment Class
+extern char** environ;
+
+Environment::Environment() : index(), envp(), onChange() {
+	for (char** entry = environ; entry && *entry; ++entry) {
+		const char* equal = strchr(*entry, '=');
+		if (!equal) continue;
+		std::string name(*entry, equal - *entry);
+		if (index.count(name)) continue;
+		index[name] = envp.size();
+		envp.push_back(strdup(*entry));
+	}
+	envp.push_back(nullptr);
+}
+Environment::~Environment() {
+	for (char* entry : envp) {
+		free(entry);
+	}
+}
+const char* Environment::get(const std::string& name) const {
+	auto it = index.find(name);
+	if (it == index.end()) return nullptr;
+	return envp[it->second] + name.size() + 1;
+}
+void Environment::set(const std::string& name, const std::string& value) {
+	char* entry = strdup((name + "=" + value).c_str());
+	if (!entry) {
+		perror("smash error: malloc failed");
 		return;
 	}
 
-	// Send signal to process
-	if (kill(job->pid, signum) == -1) {
-		perror("smash error: kill failed");
+	auto it = index.find(name);
+	if (it != index.end()) {
+		free(envp[it->second]);
+		envp[it->second] = entry;
 	}
 	else {
-		std::cout << "signal number " << signum << " was sent to pid " << job->pid << std::endl;
+		index[name] = envp.size() - 1;
+		envp.back() = entry; // Takes the terminator's slot
+		envp.push_back(nullptr);
 	}
+	if (onChange) onChange(name);
+}
+bool Environment::unset(const std::string& name) {
+	auto it = index.find(name);
+	if (it == index.end()) return false;
 
-	for (int i = 0; i < argc; ++i) free(args[i]);
+	// Move the last entry into the freed slot
+	size_t slot = it->second;
+	size_t last = envp.size() - 2;
+	free(envp[slot]);
+	if (slot != last) {
+		envp[slot] = envp[last];
+		const char* equal = strchr(envp[slot], '=');
+		index[std::string(envp[slot], equal - envp[slot])] = slot;
+	}
+	envp[last] = nullptr;
+	envp.pop_back();
+	index.erase(name);
+	if (onChange) onChange(name);
+	return true;
+}
+char* const* Environment::getEnvp() const {
+	return envp.data();
+}
+void Environment::setChangeListener(const std::function<void(const std::string&)>& listener) {
+	onChange = listener;
 }
 
 
-// QuitCommand Class
-QuitCommand::QuitCommand(const char* cmd_line, JobsList* jobs)
-	: BuiltInCommand(cmd_line), jobsList(jobs) {}
-QuitCommand::~QuitCommand() {}
-void QuitCommand::execute() {
-	JobsList& jobsList = SmallShell::getInstance().getJobsList();
+// CommandPathCache Class
+std::string CommandPathCache::resolve(const std::string& name, const char* pathValue, int baseFd) {
+	if (name.find('/') != std::string::npos) {
+		return name;
+	}
+	auto it = paths.find(name);
+	if (it != paths.end()) {
+		return it->second;
+	}
 
-	if (strstr(m_cmd_line.c_str(), "kill")) {
-		std::cout << "smash: sending SIGKILL signal to " << jobsList.getJobs().size() << " jobs:" << std::endl;
-		jobsList.killAllJobs();
+	// Relative entries ("", ".", "bin") depend on the working directory, so
+	// a result is only remembered when no such entry was searched
+	bool dependsOnCwd = false;
+	std::istringstream dirs(pathValue ? pathValue : "");
+	for (std::string dir; std::getline(dirs, dir, ':');) {
+		dependsOnCwd = dependsOnCwd || dir.empty() || dir[0] != '/';
+		std::string candidate = (dir.empty() ? "." : dir) + "/" + name;
+		struct stat st;
+		if (faccessat(baseFd, candidate.c_str(), X_OK, 0) == 0 && fstatat(baseFd, candidate.c_str(), &st, 0) == 0 &&
+			!S_ISDIR(st.st_mode)) {
+			if (!dependsOnCwd) paths[name] = candidate;
+			return candidate;
+		}
 	}
-	exit(0);
+	return ""; // Not found
+}
+void CommandPathCache::forget(const std::string& name) {
+	paths.erase(name);
+}
+void CommandPathCache::seed(const std::string& name, const std::string& path) {
+	paths[name] = path;
+}
+void CommandPathCache::clear() {
+	paths.clear();
 }
 
 
-// ForegroundCommand Class
-ForegroundCommand::ForegroundCommand(const char* cmd_line, JobsList* jobs) : BuiltInCommand(cmd_line), jobsList(jobs) {}
-ForegroundCommand::~ForegroundCommand() {}
-void ForegroundCommand::execute() {
-	char* args[COMMAND_MAX_ARGS];
-	int argc = _parseCommandLine(m_cmd_line, args);
+// CacheCommand Class
+CacheCommand::CacheCommand(const char* cmd_line, ShellSession& session) : BuiltInCommand(cmd_line, session) {}
+CacheCommand::~CacheCommand() {}
+void CacheCommand::execute() {
+	CommandCache& cache = m_session.getCommandCache();
 
-	JobsList::JobEntry* job = nullptr;
+	if (cmdSegments.size() == 1) {
+		m_session.out() << "cache: " << (cache.isEnabled() ? "on" : "off")
+			<< " (" << cache.size() << " entries)" << std::endl;
+	}
+	else if (cmdSegments.size() == 2 && strcmp(cmdSegments[1], "on") == 0) {
+		cache.setEnabled(true);
+	}
+	else if (cmdSegments.size() == 2 && strcmp(cmdSegments[1], "off") == 0) {
+		cache.setEnabled(false);
+	}
+	else if (cmdSegments.size() == 2 && strcmp(cmdSegments[1], "clear") == 0) {
+		cache.invalidate();
+	}
+	else {
+		m_session.err() << "smash error: cache: invalid arguments" << std::endl;
+		m_status = 1;
+	}
+}
 
-	// Case 1: No arguments provided
-	if (argc == 1) {
-		// Get the job with the highest job ID
-		job = jobsList->getJobById(jobsList->size());
-		if (!job) {
-			std::cerr << "smash error: fg: jobs list is empty" << std::endl;
-			return;
+
+// Text builtins
+static const size_t TEXT_BLOCK_SIZE = 1 << 20;  // Read size for inputs that cannot be mapped
+static const size_t TEXT_OUTPUT_FLUSH = 1 << 16;
+
+// Feeds a file to consume in chunks of whole lines (the last may lack its
+// newline). Regular files are mapped and passed as one chunk; pipes and
+// other files are read in large aligned blocks. consume returns false to
+// stop early. Returns false with errno set on a read error.
+static bool _scanLines(int fd, const std::function<bool(const char*, size_t)>& consume) {
+	struct stat st;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		void* mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+		if (mapped != MAP_FAILED) {
+			madvise(mapped, st.st_size, MADV_SEQUENTIAL);
+			consume((const char*)mapped, st.st_size);
+			munmap(mapped, st.st_size);
+			return true;
 		}
 	}
-	// Case 2: One argument provided
-	else if (argc == 2) {
-		int m_job_id = atoi(args[1]);
-		if (m_job_id <= 0) {
-			std::cerr << "smash error: fg: invalid arguments" << std::endl;
-			return;
+
+	size_t capacity = TEXT_BLOCK_SIZE;
+	char* buffer = nullptr;
+	if (posix_memalign((void**)&buffer, 64, capacity) != 0) {
+		errno = ENOMEM;
+		return false;
+	}
+	size_t filled = 0;
+	bool ok = true;
+	while (true) {
+		if (filled == capacity) {
+			// A line longer than the buffer: grow it rather than split the line
+			char* grown = (char*)realloc(buffer, capacity * 2);
+			if (!grown) {
+				errno = ENOMEM;
+				ok = false;
+				break;
+			}
+			buffer = grown;
+			capacity *= 2;
+		}
+		ssize_t got = read(fd, buffer + filled, capacity - filled);
+		if (got == -1 && errno == EINTR) continue;
+		if (got == -1) {
+			ok = false;
+			break;
 		}
+		if (got == 0) {
+			if (filled > 0) consume(buffer, filled);
+			break;
+		}
+		filled += got;
 
-		// Try to find the job with the given job ID
-		job = jobsList->getJobById(m_job_id);
-		if (!job) {
-			std::cerr << "smash error: fg: job-id " << m_job_id << " does not exist" << std::endl;
-			return;
+		const char* lastNewline = (const char*)memrchr(buffer, '\n', filled);
+		if (!lastNewline) continue;
+		size_t complete = lastNewline - buffer + 1;
+		if (!consume(buffer, complete)) break;
+		memmove(buffer, buffer + complete, filled - complete);
+		filled -= complete;
+	}
+	int savedErrno = errno;
+	free(buffer);
+	errno = savedErrno;
+	return ok;
+}
+
+// Runs the line as the external program of the same name
+static int _runExternal(const std::string& cmd_line, ShellSession& session) {
+	ExternalCommand cmd(cmd_line.c_str(), session);
+	cmd.execute();
+	return cmd.getStatus();
+}
+
+
+// GrepCommand Class
+GrepCommand::GrepCommand(const char* cmd_line, ShellSession& session) : BuiltInCommand(cmd_line, session) {}
+GrepCommand::~GrepCommand() {}
+void GrepCommand::execute() {
+	// grep [-cvnilqHhFE] pattern file...
+	bool count = false, invert = false, lineNumbers = false, ignoreCase = false, listFiles = false;
+	bool quiet = false, fixed = false, extended = false, supported = !m_is_background;
+	int withNames = -1; // -H / -h; by default only with several files
+	int argc = cmdSegments.size();
+	int i = 1;
+	for (; supported && i < argc && cmdSegments[i][0] == '-' && cmdSegments[i][1] != '\0'; ++i) {
+		if (strcmp(cmdSegments[i], "--") == 0) {
+			++i;
+			break;
+		}
+		for (const char* flag = cmdSegments[i] + 1; *flag; ++flag) {
+			switch (*flag) {
+			case 'c': count = true; break;
+			case 'v': invert = true; break;
+			case 'n': lineNumbers = true; break;
+			case 'i': ignoreCase = true; break;
+			case 'l': listFiles = true; break;
+			case 'q': quiet = true; break;
+			case 'H': withNames = 1; break;
+			case 'h': withNames = 0; break;
+			case 'F': fixed = true; break;
+			case 'E': extended = true; break;
+			default: supported = false;
+			}
 		}
 	}
-	// Case 3: Invalid number of arguments
-	else {
-		std::cerr << "smash error: fg: invalid arguments" << std::endl;
+	// Reading the terminal is left to the real grep, like every option above
+	if (!supported || argc - i < 2) {
+		m_status = _runExternal(m_cmd_line, m_session);
 		return;
 	}
+	std::string pattern = cmdSegments[i++];
+	int fileCount = argc - i;
+	bool showNames = withNames == -1 ? fileCount > 1 : withNames == 1;
 
-	// Print the job's command and PID
-	std::cout << job->command << " " << job->pid << std::endl;
+	// Patterns without regex syntax, and -F without -i, skip the regex engine
+	const char* special = extended ? "\\.[]*^$+?(){}|" : "\\.[]*^$";
+	if (!fixed && pattern.find_first_of(special) == std::string::npos) {
+		fixed = true;
+	}
+	regex_t regex;
+	bool useRegex = !fixed || ignoreCase;
+	if (useRegex) {
+		std::string source = pattern;
+		if (fixed) {
+			source.clear();
+			for (char c : pattern) {
+				if (strchr("\\.[]*^$", c)) source += '\\';
+				source += c;
+			}
+		}
+		int flags = REG_NOSUB | (extended && !fixed ? REG_EXTENDED : 0) | (ignoreCase ? REG_ICASE : 0);
+		if (regcomp(&regex, source.c_str(), flags) != 0) {
+			m_session.err() << "smash error: grep: invalid pattern" << std::endl;
+			m_status = 2;
+			return;
+		}
+	}
 
-	// Send SIGCONT to the job to resume it if stopped
-	if (kill(job->pid, SIGCONT) == -1) {
-		perror("smash error: fg failed");
+	// Start of the first line at or after p that contains the pattern
+	auto nextMatch = [&](const char* p, const char* end) -> const char* {
+		if (!useRegex) {
+			const char* found = _findBytes(p, end - p, pattern.data(), pattern.size());
+			if (!found) return end;
+			const char* lineStart = (const char*)memrchr(p, '\n', found - p);
+			return lineStart ? lineStart + 1 : p;
+		}
+		while (p < end) {
+			const char* newline = (const char*)memchr(p, '\n', end - p);
+			regmatch_t range;
+			range.rm_so = 0;
+			range.rm_eo = (newline ? newline : end) - p;
+			if (regexec(&regex, p, 1, &range, REG_STARTEND) == 0) return p;
+			p = newline ? newline + 1 : end;
+		}
+		return end;
+	};
+
+	std::ostream& out = m_session.out();
+	std::string pending;
+	bool anySelected = false, failed = false;
+	for (; i < argc && !(quiet && anySelected); ++i) {
+		std::string name = cmdSegments[i];
+		int fd = openat(m_session.getCwdFd(), name.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd == -1) {
+			m_session.err() << "smash error: grep: " << name << ": " << strerror(errno) << std::endl;
+			failed = true;
+			continue;
+		}
+
+		size_t selected = 0;
+		size_t lineNumber = 1; // Of the line starting at the scan position
+		auto select = [&](const char* line, const char* lineEnd) -> bool {
+			++selected;
+			if (quiet || listFiles) return false; // One line settles this file
+			if (count) return true;
+			if (showNames) pending.append(name).push_back(':');
+			if (lineNumbers) pending.append(std::to_string(lineNumber)).push_back(':');
+			pending.append(line, lineEnd - line).push_back('\n');
+			if (pending.size() >= TEXT_OUTPUT_FLUSH) {
+				out.write(pending.data(), pending.size());
+				pending.clear();
+			}
+			return true;
+		};
+		bool ok = _scanLines(fd, [&](const char* data, size_t length) -> bool {
+			const char* p = data;
+			const char* end = data + length;
+			while (p < end) {
+				const char* match = nextMatch(p, end);
+				if (invert) {
+					// Every line before the match is selected
+					while (p < match) {
+						const char* newline = (const char*)memchr(p, '\n', match - p);
+						const char* lineEnd = newline ? newline : match;
+						if (!select(p, lineEnd)) return false;
+						p = lineEnd + 1;
+						++lineNumber;
+					}
+				}
+				else if (lineNumbers) {
+					lineNumber += _countByte(p, match - p, '\n');
+				}
+				if (match == end) break;
+
+				const char* newline = (const char*)memchr(match, '\n', end - match);
+				const char* lineEnd = newline ? newline : end;
+				if (!invert && !select(match, lineEnd)) return false;
+				p = newline ? newline + 1 : end;
+				++lineNumber;
+			}
+			return true;
+		});
+		if (!ok) {
+			m_session.err() << "smash error: grep: " << name << ": " << strerror(errno) << std::endl;
+			failed = true;
+		}
+		close(fd);
+
+		anySelected = anySelected || selected > 0;
+		if (count && !quiet) {
+			if (showNames) pending.append(name).push_back(':');
+			pending.append(std::to_string(selected)).push_back('\n');
+		}
+		else if (listFiles && !quiet && selected > 0) {
+			pending.append(name).push_back('\n');
+		}
+	}
+	out.write(pending.data(), pending.size());
+	out.flush();
+	if (useRegex) {
+		regfree(&regex);
+	}
+
+	// Like grep: 0 if a line was selected, 1 if none, 2 on errors
+	m_status = (failed && !(quiet && anySelected)) ? 2 : (anySelected ? 0 : 1);
+}
+
+
+// WordCountCommand Class
+WordCountCommand::WordCountCommand(const char* cmd_line, ShellSession& session) : BuiltInCommand(cmd_line, session) {}
+WordCountCommand::~WordCountCommand() {}
+void WordCountCommand::execute() {
+	// wc [-lwc] file...
+	bool lines = false, words = false, bytes = false, supported = !m_is_background;
+	int argc = cmdSegments.size();
+	int i = 1;
+	for (; supported && i < argc && cmdSegments[i][0] == '-' && cmdSegments[i][1] != '\0'; ++i) {
+		if (strcmp(cmdSegments[i], "--") == 0) {
+			++i;
+			break;
+		}
+		for (const char* flag = cmdSegments[i] + 1; *flag; ++flag) {
+			switch (*flag) {
+			case 'l': lines = true; break;
+			case 'w': words = true; break;
+			case 'c': bytes = true; break;
+			default: supported = false;
+			}
+		}
+	}
+	if (!supported || i >= argc) {
+		m_status = _runExternal(m_cmd_line, m_session);
 		return;
 	}
+	if (!lines && !words && !bytes) {
+		lines = words = bytes = true;
+	}
 
-	// Set the job as the foreground job in the shell
-	SmallShell& shell = SmallShell::getInstance();
-	shell.setForegroundJob(job->pid, job->command);
+	// Columns are as wide as the total size of the regular files needs, like
+	// GNU wc; a single count of a single file needs no alignment
+	int fileCount = argc - i;
+	int width = 1;
+	if (fileCount > 1 || lines + words + bytes > 1) {
+		uint64_t regularTotal = 0;
+		int minimumWidth = 1;
+		struct stat st;
+		for (int f = i; f < argc; ++f) {
+			if (fstatat(m_session.getCwdFd(), cmdSegments[f], &st, 0) != 0) continue;
+			if (S_ISREG(st.st_mode)) regularTotal += st.st_size;
+			else minimumWidth = 7;
+		}
+		for (; regularTotal >= 10; regularTotal /= 10) width++;
+		width = std::max(width, minimumWidth);
+	}
 
-	// Wait for the job to finish
-	if (waitpid(job->pid, nullptr, WUNTRACED) == -1) {
-		perror("smash error: waitpid failed");
+	std::ostream& out = m_session.out();
+	uint64_t totals[3] = { 0, 0, 0 };
+	auto print = [&](const uint64_t* counts, const std::string& name) {
+		bool first = true;
+		const bool shown[3] = { lines, words, bytes };
+		for (int c = 0; c < 3; ++c) {
+			if (!shown[c]) continue;
+			if (!first) out << ' ';
+			out << std::setw(width) << counts[c];
+			first = false;
+		}
+		out << ' ' << name << '\n';
+	};
+	for (; i < argc; ++i) {
+		std::string name = cmdSegments[i];
+		int fd = openat(m_session.getCwdFd(), name.c_str(), O_RDONLY | O_CLOEXEC);
+		uint64_t counts[3] = { 0, 0, 0 };
+		bool ok = fd != -1 && _scanLines(fd, [&](const char* data, size_t length) -> bool {
+			counts[0] += _countByte(data, length, '\n');
+			counts[2] += length;
+			if (words) {
+				// Chunks end on a newline, so a word never spans two of them
+				bool inWord = false;
+				for (size_t k = 0; k < length; ++k) {
+					bool space = data[k] == ' ' || (data[k] >= '\t' && data[k] <= '\r');
+					counts[1] += !space && !inWord;
+					inWord = !space;
+				}
+			}
+			return true;
+		});
+		if (fd != -1) {
+			int savedErrno = errno;
+			close(fd);
+			errno = savedErrno;
+		}
+		if (!ok) {
+			out.flush();
+			m_session.err() << "smash error: wc: " << name << ": " << strerror(errno) << std::endl;
+			m_status = 1;
+			continue;
+		}
+		print(counts, name);
+		for (int c = 0; c < 3; ++c) totals[c] += counts[c];
 	}
+	if (fileCount > 1) {
+		print(totals, "total");
+	}
+	out.flush();
+}
 
-	// Clear the foreground job in the shell
-	shell.clearForegroundJob();
 
-	// Remove the job from the jobs list after bringing it to the foreground
-	jobsList->removeJobById(job->m_job_id);
+// JobLogCommand Class
+JobLogCommand::JobLogCommand(const char* cmd_line, ShellSession& session) : BuiltInCommand(cmd_line, session) {}
+JobLogCommand::~JobLogCommand() {}
+void JobLogCommand::execute() {
+	JobLog& log = m_session.getJobLog();
+	int argc = cmdSegments.size();
+
+	// joblog [on|off] | joblog <job-id> [-f]
+	if (argc == 1) {
+		m_session.out() << "joblog: " << (log.isEnabled() ? "on" : "off") << " (" << log.size() << " logs, "
+			<< log.memoryUsed() / 1024 << "K of " << JobLog::MEMORY_LIMIT / 1024 << "K)" << std::endl;
+		return;
+	}
+	if (argc == 2 && strcmp(cmdSegments[1], "on") == 0) {
+		log.setEnabled(true);
+		return;
+	}
+	if (argc == 2 && strcmp(cmdSegments[1], "off") == 0) {
+		log.setEnabled(false); // Logs captured so far stay readable
+		return;
+	}
+
+	bool follow = argc == 3 && strcmp(cmdSegments[2], "-f") == 0;
+	if ((argc != 2 && !follow) || !isdigit(cmdSegments[1][0])) {
+		m_session.err() << "smash error: joblog: invalid arguments" << std::endl;
+		m_status = 1;
+		return;
+	}
+	if (follow && m_session.isAsyncForeground()) {
+		// Following blocks until the job ends, which a server session cannot
+		// afford: its thread serves every client and it has no ctrl-C
+		m_session.err() << "smash error: joblog: -f is not supported in server sessions" << std::endl;
+		m_status = 1;
+		return;
+	}
+	int jobId = atoi(cmdSegments[1]);
+
+	uint64_t pos = 0;
+	std::string data;
+	if (!log.read(jobId, pos, data)) {
+		m_session.err() << "smash error: joblog: job-id " << jobId << " has no log" << std::endl;
+		m_status = 1;
+		return;
+	}
+	m_session.out() << data << std::flush;
 
-	// Free allocated memory
-	for (int i = 0; i < argc; ++i) {
-		free(args[i]);
+	// Follow until the job closes its output or ctrl-C
+	m_session.takeInterrupt();
+	while (follow && !m_session.takeInterrupt()) {
+		if (!log.waitForOutput(jobId, pos, 100)) {
+			break;
+		}
+		data.clear();
+		if (!log.read(jobId, pos, data)) {
+			break;
+		}
+		m_session.out() << data << std::flush;
 	}
 }
 
 
-// AliasCommand Class
-AliasCommand::AliasCommand(const char* cmd_line, std::map<std::string, std::string>& aliasMap)
-	: BuiltInCommand(cmd_line), aliasMap(aliasMap) {}
-AliasCommand::~AliasCommand() {}
-void AliasCommand::execute() {
-	// Trim the command line to handle any spaces
-	std::string commandLine = _trim(m_cmd_line);
+// NetworkInfo Class
+static const size_t NETLINK_BUFFER = 32768;
+
+NetworkInfo::NetworkInfo() : sock(-1), sequence(0), resolvMtime(), resolvInode(0), resolvSize(-1) {}
+NetworkInfo::~NetworkInfo() {
+	if (sock != -1) close(sock);
+}
+// One dump request and its reply, message by message. Replies to an earlier
+// request that was cut short are recognized by their sequence and skipped.
+bool NetworkInfo::dump(int type, const std::function<void(const struct nlmsghdr*)>& handle) {
+	if (sock == -1) {
+		sock = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+		if (sock == -1) return false;
+		buffer.resize(NETLINK_BUFFER);
+	}
+
+	// Zeroed family headers ask for every family
+	struct {
+		struct nlmsghdr header;
+		union {
+			struct ifinfomsg link;
+			struct ifaddrmsg address;
+			struct rtmsg route;
+		} body;
+	} request;
+	memset(&request, 0, sizeof(request));
+	size_t bodySize = type == RTM_GETLINK ? sizeof(struct ifinfomsg)
+		: type == RTM_GETADDR ? sizeof(struct ifaddrmsg) : sizeof(struct rtmsg);
+	request.header.nlmsg_len = NLMSG_LENGTH(bodySize);
+	request.header.nlmsg_type = type;
+	request.header.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	request.header.nlmsg_seq = ++sequence;
+	struct sockaddr_nl kernel;
+	memset(&kernel, 0, sizeof(kernel));
+	kernel.nl_family = AF_NETLINK;
+	if (sendto(sock, &request, request.header.nlmsg_len, 0, (struct sockaddr*)&kernel, sizeof(kernel)) == -1) {
+		return false;
+	}
+
+	while (true) {
+		ssize_t len = recv(sock, buffer.data(), buffer.size(), 0);
+		if (len == -1 && errno == EINTR) continue;
+		if (len <= 0) return false;
+		for (const struct nlmsghdr* message = (const struct nlmsghdr*)buffer.data(); NLMSG_OK(message, (size_t)len);
+			message = NLMSG_NEXT(message, len)) {
+			if (message->nlmsg_seq != sequence) continue;
+			if (message->nlmsg_type == NLMSG_DONE) return true;
+			if (message->nlmsg_type == NLMSG_ERROR) {
+				const struct nlmsgerr* error = (const struct nlmsgerr*)NLMSG_DATA(message);
+				errno = error->error ? -error->error : EIO;
+				return false;
+			}
+			handle(message);
+		}
+	}
+}
+static std::string _formatAddress(int family, const void* data) {
+	char text[INET6_ADDRSTRLEN] = "";
+	inet_ntop(family, data, text, sizeof(text));
+	return text;
+}
+bool NetworkInfo::query(std::vector<Interface>& interfaces, std::vector<Route>& routes) {
+	static const char* OPER_STATES[] = { "UNKNOWN", "NOTPRESENT", "DOWN", "LOWERLAYERDOWN", "TESTING", "DORMANT", "UP" };
+	bool ok = dump(RTM_GETLINK, [&interfaces](const struct nlmsghdr* message) {
+		if (message->nlmsg_type != RTM_NEWLINK) return;
+		const struct ifinfomsg* link = (const struct ifinfomsg*)NLMSG_DATA(message);
+		Interface interface;
+		interface.index = link->ifi_index;
+		interface.flags = link->ifi_flags;
+		interface.mtu = 0;
+		interface.state = OPER_STATES[0];
+		int length = IFLA_PAYLOAD(message);
+		for (const struct rtattr* attr = IFLA_RTA(link); RTA_OK(attr, length); attr = RTA_NEXT(attr, length)) {
+			const unsigned char* data = (const unsigned char*)RTA_DATA(attr);
+			if (attr->rta_type == IFLA_IFNAME) {
+				interface.name = (const char*)data;
+			}
+			else if (attr->rta_type == IFLA_MTU) {
+				memcpy(&interface.mtu, data, sizeof(interface.mtu));
+			}
+			else if (attr->rta_type == IFLA_OPERSTATE && data[0] < sizeof(OPER_STATES) / sizeof(OPER_STATES[0])) {
+				interface.state = OPER_STATES[data[0]];
+			}
+			else if (attr->rta_type == IFLA_ADDRESS && link->ifi_type == ARPHRD_ETHER && RTA_PAYLOAD(attr) == 6) {
+				char mac[18];
+				snprintf(mac, sizeof(mac), "%02x:%02x:%02x:%02x:%02x:%02x",
+					data[0], data[1], data[2], data[3], data[4], data[5]);
+				interface.mac = mac;
+			}
+		}
+		interfaces.push_back(interface);
+	});
+
+	ok = ok && dump(RTM_GETADDR, [&interfaces](const struct nlmsghdr* message) {
+		if (message->nlmsg_type != RTM_NEWADDR) return;
+		const struct ifaddrmsg* address = (const struct ifaddrmsg*)NLMSG_DATA(message);
+		const void* local = nullptr;
+		const void* peer = nullptr;
+		int length = IFA_PAYLOAD(message);
+		for (const struct rtattr* attr = IFA_RTA(address); RTA_OK(attr, length); attr = RTA_NEXT(attr, length)) {
+			if (attr->rta_type == IFA_LOCAL) local = RTA_DATA(attr);
+			else if (attr->rta_type == IFA_ADDRESS) peer = RTA_DATA(attr);
+		}
+		const void* shown = local ? local : peer; // On point-to-point links IFA_ADDRESS is the far end
+		if (!shown || (address->ifa_family != AF_INET && address->ifa_family != AF_INET6)) return;
+		for (auto& interface : interfaces) {
+			if (interface.index == (int)address->ifa_index) {
+				interface.addresses.push_back(std::string(address->ifa_family == AF_INET ? "inet " : "inet6 ")
+					+ _formatAddress(address->ifa_family, shown) + "/" + std::to_string(address->ifa_prefixlen));
+			}
+		}
+	});
 
-	// Case 1: If the command is exactly "alias" with no arguments
-	if (commandLine == "alias") {
-		// Print all aliases in the map
-		for (const auto& alias : aliasMap) {
-			std::cout << alias.first << "='" << alias.second << "'" << std::endl;
+	ok = ok && dump(RTM_GETROUTE, [&routes](const struct nlmsghdr* message) {
+		if (message->nlmsg_type != RTM_NEWROUTE) return;
+		const struct rtmsg* route = (const struct rtmsg*)NLMSG_DATA(message);
+		if (route->rtm_dst_len != 0 || route->rtm_type != RTN_UNICAST) return;
+		Route entry;
+		entry.family = route->rtm_family;
+		entry.interfaceIndex = 0;
+		unsigned table = route->rtm_table;
+		int length = RTM_PAYLOAD(message);
+		for (const struct rtattr* attr = RTM_RTA(route); RTA_OK(attr, length); attr = RTA_NEXT(attr, length)) {
+			if (attr->rta_type == RTA_GATEWAY) entry.gateway = _formatAddress(route->rtm_family, RTA_DATA(attr));
+			else if (attr->rta_type == RTA_OIF) memcpy(&entry.interfaceIndex, RTA_DATA(attr), sizeof(int));
+			else if (attr->rta_type == RTA_TABLE) memcpy(&table, RTA_DATA(attr), sizeof(table));
 		}
-		return; // Exit after printing
+		if (table == RT_TABLE_MAIN) {
+			routes.push_back(entry);
+		}
+	});
+	return ok;
+}
+const std::vector<std::string>& NetworkInfo::getNameservers() {
+	struct stat st;
+	if (stat("/etc/resolv.conf", &st) == -1) {
+		nameservers.clear();
+		resolvSize = -1;
+		return nameservers;
 	}
+	if (st.st_size == resolvSize && st.st_ino == resolvInode && st.st_mtim.tv_sec == resolvMtime.tv_sec
+		&& st.st_mtim.tv_nsec == resolvMtime.tv_nsec) {
+		return nameservers; // Unchanged since last parsed
+	}
+	resolvMtime = st.st_mtim;
+	resolvInode = st.st_ino;
+	resolvSize = st.st_size;
 
-	// Case 2: Handle alias creation (alias <name>='<command>')
-	size_t equalPos = commandLine.find('=');
-	if (equalPos == std::string::npos || equalPos < 6) { // Missing '=' or alias name
-		std::cerr << "smash error: alias: invalid alias format" << std::endl;
-		return;
+	nameservers.clear();
+	std::ifstream file("/etc/resolv.conf");
+	for (std::string line; std::getline(file, line);) {
+		std::istringstream words(line);
+		std::string keyword, address;
+		if (words >> keyword >> address && keyword == "nameserver") {
+			nameservers.push_back(address);
+		}
 	}
+	return nameservers;
+}
 
-	// Extract the alias name and command
-	std::string aliasName = _trim(commandLine.substr(6, equalPos - 6));
-	std::string aliasCommand = _trim(commandLine.substr(equalPos + 1));
 
-	// Validate alias name format
-	if (!std::regex_match(aliasName, std::regex("^[a-zA-Z0-9_]+$"))) {
-		std::cerr << "smash error: alias: invalid alias format" << std::endl;
+// NetInfoCommand Class
+NetInfoCommand::NetInfoCommand(const char* cmd_line, ShellSession& session) : BuiltInCommand(cmd_line, session) {}
+NetInfoCommand::~NetInfoCommand() {}
+void NetInfoCommand::execute() {
+	// netinfo [iface]
+	if (cmdSegments.size() > 2) {
+		m_session.err() << "smash error: netinfo: invalid arguments" << std::endl;
+		m_status = 1;
 		return;
 	}
+	std::string wanted = cmdSegments.size() == 2 ? cmdSegments[1] : "";
 
-	// Check for proper quotes around the alias command
-	if (aliasCommand.length() < 2 || aliasCommand.front() != '\'' || aliasCommand.back() != '\'') {
-		std::cerr << "smash error: alias: invalid alias format" << std::endl;
+	NetworkInfo& network = m_session.getNetworkInfo();
+	std::vector<NetworkInfo::Interface> interfaces;
+	std::vector<NetworkInfo::Route> routes;
+	if (!network.query(interfaces, routes)) {
+		m_session.reportError("smash error: netinfo: netlink failed");
+		m_status = 1;
 		return;
 	}
 
-	// Remove surrounding quotes from the command
-	aliasCommand = aliasCommand.substr(1, aliasCommand.length() - 2);
-
-	// Check for reserved keywords
-	static const std::set<std::string> reservedKeywords = {
-		"quit", "fg", "bg", "jobs", "kill", "cd", "listdir", "chprompt", "alias", "unalias", "pwd", "showpid"
+	static const std::pair<unsigned, const char*> FLAG_NAMES[] = {
+		{ IFF_LOOPBACK, "LOOPBACK" }, { IFF_BROADCAST, "BROADCAST" }, { IFF_POINTOPOINT, "POINTOPOINT" },
+		{ IFF_MULTICAST, "MULTICAST" }, { IFF_NOARP, "NOARP" }, { IFF_UP, "UP" }, { IFF_LOWER_UP, "LOWER_UP" }
 	};
+	std::map<int, std::string> names;
+	bool found = wanted.empty();
+	std::ostream& out = m_session.out();
+	for (const auto& interface : interfaces) {
+		names[interface.index] = interface.name;
+		if (!wanted.empty() && interface.name != wanted) continue;
+		found = true;
 
-	if (reservedKeywords.count(aliasName) || aliasMap.count(aliasName)) {
-		std::cerr << "smash error: alias: " << aliasName << " already exists or is a reserved command" << std::endl;
+		std::string flags;
+		for (const auto& flag : FLAG_NAMES) {
+			if (interface.flags & flag.first) flags += (flags.empty() ? "" : ",") + std::string(flag.second);
+		}
+		out << interface.index << ": " << interface.name << " <" << flags << "> mtu " << interface.mtu
+			<< " state " << interface.state;
+		if (!interface.mac.empty()) {
+			out << " ether " << interface.mac;
+		}
+		out << std::endl;
+		for (const auto& address : interface.addresses) {
+			out << "\t" << address << std::endl;
+		}
+	}
+	if (!found) {
+		m_session.err() << "smash error: netinfo: " << wanted << ": no such interface" << std::endl;
+		m_status = 1;
 		return;
 	}
 
-	// Add the alias to the map
-	aliasMap[aliasName] = aliasCommand;
+	for (const auto& route : routes) {
+		const std::string& device = names[route.interfaceIndex];
+		if (!wanted.empty() && device != wanted) continue;
+		out << "default";
+		if (!route.gateway.empty()) out << " via " << route.gateway;
+		if (!device.empty()) out << " dev " << device;
+		out << std::endl;
+	}
+	for (const auto& server : network.getNameservers()) {
+		out << "nameserver " << server << std::endl;
+	}
 }
 
-// UnaliasCommand Class
-UnaliasCommand::UnaliasCommand(const char* cmd_line, std::map<std::string, std::string>& aliasMap)
-	: BuiltInCommand(cmd_line), aliasMap(aliasMap) {}
-UnaliasCommand::~UnaliasCommand() {}
-void UnaliasCommand::execute() {
-	char* args[COMMAND_MAX_ARGS];
-	int argc = _parseCommandLine(m_cmd_line, args);
 
-	if (argc != 2) {
-		std::cerr << "smash error: unalias: invalid arguments" << std::endl;
-		return;
+// ProcessPattern Class
+ProcessPattern::ProcessPattern() : fullCommand(false), exact(false), fixed(true), compiled(false) {}
+ProcessPattern::~ProcessPattern() {
+	if (compiled) regfree(&regex);
+}
+bool ProcessPattern::compile(const std::string& pattern, bool fullCommand, bool exact, bool ignoreCase) {
+	if (compiled) {
+		regfree(&regex);
+		compiled = false;
 	}
-
-	std::string aliasName = args[1];
-
-	if (aliasMap.erase(aliasName) == 0) {
-		std::cerr << "smash error: unalias: alias \"" << aliasName << "\" does not exist" << std::endl;
+	text = pattern;
+	this->fullCommand = fullCommand;
+	this->exact = exact;
+	fixed = !ignoreCase && pattern.find_first_of("\\.[]*^$+?(){}|") == std::string::npos;
+	if (fixed) {
+		return true;
 	}
-	else {
-		std::cout << "Alias \"" << aliasName << "\" removed" << std::endl;
+	std::string source = exact ? "^(" + pattern + ")$" : pattern;
+	compiled = regcomp(&regex, source.c_str(), REG_EXTENDED | REG_NOSUB | (ignoreCase ? REG_ICASE : 0)) == 0;
+	return compiled;
+}
+bool ProcessPattern::usesCommandLine() const {
+	return fullCommand;
+}
+bool ProcessPattern::matches(const char* subject, size_t length) const {
+	if (fixed) {
+		if (exact) return length == text.size() && memcmp(subject, text.data(), length) == 0;
+		return _findBytes(subject, length, text.data(), text.size()) != nullptr;
 	}
+	regmatch_t range;
+	range.rm_so = 0;
+	range.rm_eo = length;
+	return regexec(&regex, subject, 1, &range, REG_STARTEND) == 0;
+}
+
 
-	for (int i = 0; i < argc; ++i) {
-		free(args[i]);
+// ProcessScanner Class
+static const size_t PROC_ENTRIES_BUFFER = 65536;
+static const size_t PROC_COMMAND_LINE = 4096;  // Initial size, grown for longer command lines
+
+// Record layout of getdents64, which glibc does not declare
+struct _ProcDirent {
+	uint64_t inode;
+	int64_t offset;
+	unsigned short length;
+	unsigned char type;
+	char name[];
+};
+
+ProcessScanner::ProcessScanner() : procFd(-1) {}
+ProcessScanner::~ProcessScanner() {
+	if (procFd != -1) close(procFd);
+}
+// The arguments joined by spaces, as pgrep -f matches them
+bool ProcessScanner::readCommandLine(int pid, size_t& length) {
+	char path[32];
+	snprintf(path, sizeof(path), "%d/cmdline", pid);
+	int fd = openat(procFd, path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		return false;
+	}
+	length = 0;
+	ssize_t len;
+	while ((len = read(fd, commandLine.data() + length, commandLine.size() - length)) > 0) {
+		length += len;
+		if (length == commandLine.size()) commandLine.resize(commandLine.size() * 2);
 	}
+	close(fd);
+	while (length > 0 && commandLine[length - 1] == '\0') --length;
+	std::replace(commandLine.begin(), commandLine.begin() + length, '\0', ' ');
+	return len == 0;
 }
+bool ProcessScanner::scan(const ProcessPattern& pattern, const std::function<void(int, const char*, size_t)>& found) {
+	if (procFd == -1) {
+		procFd = open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (procFd == -1) return false;
+		entries.resize(PROC_ENTRIES_BUFFER);
+		commandLine.resize(PROC_COMMAND_LINE);
+	}
+	else if (lseek(procFd, 0, SEEK_SET) == -1) {
+		return false;
+	}
 
+	int self = getpid();
+	char path[32];
+	char name[64]; // comm holds at most 15 characters and a newline
+	while (true) {
+		long len = syscall(SYS_getdents64, procFd, entries.data(), entries.size());
+		if (len == -1 && errno == EINTR) continue;
+		if (len == -1) return false;
+		if (len == 0) return true;
 
-// RedirectionCommand Class
-RedirectionCommand::RedirectionCommand(const char* cmd_line)
-	: BuiltInCommand(cmd_line), m_isAppend(false) {
-	// Parse the command line for redirection
-	size_t redirectionPos = m_cmd_line.find('>');
-	if (redirectionPos != std::string::npos) {
-		m_isAppend = (m_cmd_line[redirectionPos + 1] == '>'); // Check if it's >>
-		size_t fileStart = m_isAppend ? redirectionPos + 2 : redirectionPos + 1;
-
-		// Trim and extract the file path
-		m_file_redirect = _trim(m_cmd_line.substr(fileStart));
+		for (long offset = 0; offset < len;) {
+			const _ProcDirent* entry = (const _ProcDirent*)(entries.data() + offset);
+			offset += entry->length;
+			int pid = 0;
+			const char* c = entry->name;
+			for (; *c >= '0' && *c <= '9'; ++c) pid = pid * 10 + (*c - '0');
+			if (*c || pid <= 0 || pid == self) {
+				continue; // Not a process, or this shell
+			}
 
-		// Remove redirection and file path from the command
-		m_cmd_line = _trim(m_cmd_line.substr(0, redirectionPos));
+			// Kernel threads have no command line, so their name stands in
+			size_t length;
+			if (pattern.usesCommandLine() && readCommandLine(pid, length) && length > 0) {
+				if (pattern.matches(commandLine.data(), length)) found(pid, commandLine.data(), length);
+				continue;
+			}
+			snprintf(path, sizeof(path), "%d/comm", pid);
+			int fd = openat(procFd, path, O_RDONLY | O_CLOEXEC);
+			if (fd == -1) {
+				continue; // Exited since the directory was read
+			}
+			ssize_t nameLength = read(fd, name, sizeof(name));
+			close(fd);
+			if (nameLength <= 0) continue;
+			if (name[nameLength - 1] == '\n') --nameLength;
+			if (pattern.matches(name, nameLength)) found(pid, name, nameLength);
+		}
+	}
+}
 
-		// Update `cmdSegments` after removing redirection parts
-		cmdSegments.clear();
-		std::istringstream iss(m_cmd_line);
-		std::string segment;
-		while (iss >> segment) {
-			cmdSegments.push_back(segment);
+// Options and pattern of pgrep and pkill, which also takes a -<signal>.
+// Prints the error and returns false on invalid arguments
+static bool _parseProcessQuery(const ArgVector& args, int argc, const char* command, ShellSession& session,
+	ProcessPattern& pattern, bool* listNames, int* signum) {
+	bool fullCommand = false, exact = false, ignoreCase = false;
+	int i = 1;
+	for (; i < argc && args[i][0] == '-' && args[i][1]; ++i) {
+		std::string option = args[i] + 1;
+		if (signum && _parseSignal(option) != -1) {
+			*signum = _parseSignal(option);
+			continue;
+		}
+		for (char flag : option) {
+			if (flag == 'f') fullCommand = true;
+			else if (flag == 'x') exact = true;
+			else if (flag == 'i') ignoreCase = true;
+			else if (flag == 'l' && listNames) *listNames = true;
+			else {
+				session.err() << "smash error: " << command << ": invalid arguments" << std::endl;
+				return false;
+			}
 		}
 	}
-	else {
-		std::cerr << "smash error: invalid redirection syntax" << std::endl;
-		m_file_redirect.clear();
+	if (argc - i != 1) {
+		session.err() << "smash error: " << command << ": invalid arguments" << std::endl;
+		return false;
+	}
+	if (!pattern.compile(args[i], fullCommand, exact, ignoreCase)) {
+		session.err() << "smash error: " << command << ": invalid pattern" << std::endl;
+		return false;
 	}
+	return true;
 }
-RedirectionCommand::~RedirectionCommand() {}
-void RedirectionCommand::execute() {
-	if (m_file_redirect.empty()) {
-		std::cerr << "smash error: no file specified for redirection" << std::endl;
+
+
+// PgrepCommand Class
+PgrepCommand::PgrepCommand(const char* cmd_line, ShellSession& session) : BuiltInCommand(cmd_line, session) {}
+PgrepCommand::~PgrepCommand() {}
+void PgrepCommand::execute() {
+	// pgrep [-flxi] pattern; exit statuses follow the real pgrep
+	ArgVector args;
+	int argc = _parseCommandLine(m_cmd_line, args, m_session);
+	ProcessPattern pattern;
+	bool listNames = false;
+	if (!_parseProcessQuery(args, argc, "pgrep", m_session, pattern, &listNames, nullptr)) {
+		m_status = 2;
 		return;
 	}
 
-	int flags = O_WRONLY | O_CREAT | (m_isAppend ? O_APPEND : O_TRUNC);
-	int fd = open(m_file_redirect.c_str(), flags, 0644);
-	if (fd == -1) {
-		perror("smash error: open failed");
+	std::ostream& out = m_session.out();
+	size_t matched = 0;
+	bool ok = m_session.getProcessScanner().scan(pattern, [&](int pid, const char* text, size_t length) {
+		out << pid;
+		if (listNames) out << ' ' << std::string(text, length);
+		out << '\n';
+		++matched;
+	});
+	out.flush();
+	if (!ok) {
+		m_session.reportError("smash error: pgrep: reading /proc failed");
+		m_status = 3;
 		return;
 	}
+	m_status = matched ? 0 : 1;
+}
 
-	int stdoutBackup = dup(STDOUT_FILENO);
-	if (stdoutBackup == -1) {
-		perror("smash error: dup failed");
-		close(fd);
+
+// PkillCommand Class
+PkillCommand::PkillCommand(const char* cmd_line, ShellSession& session) : BuiltInCommand(cmd_line, session) {}
+PkillCommand::~PkillCommand() {}
+void PkillCommand::execute() {
+	// pkill [-<signal>] [-fxi] pattern
+	ArgVector args;
+	int argc = _parseCommandLine(m_cmd_line, args, m_session);
+	ProcessPattern pattern;
+	int signum = SIGTERM;
+	if (!_parseProcessQuery(args, argc, "pkill", m_session, pattern, nullptr, &signum)) {
+		m_status = 2;
 		return;
 	}
 
-	if (dup2(fd, STDOUT_FILENO) == -1) {
-		perror("smash error: dup2 failed");
-		close(fd);
-		close(stdoutBackup);
+	// Each match is signalled as the scan reaches it, through a pidfd where
+	// the kernel has them
+	size_t signalled = 0;
+	bool ok = m_session.getProcessScanner().scan(pattern, [&](int pid, const char*, size_t) {
+		int pidFd = _pidfdOpen(pid);
+		int result = pidFd != -1 ? _pidfdSendSignal(pidFd, signum) : errno == ENOSYS ? kill(pid, signum) : -1;
+		if (pidFd != -1) close(pidFd);
+		if (result == 0) {
+			++signalled;
+		}
+		else if (errno != ESRCH) {
+			m_session.err() << "smash error: pkill: pid " << pid << ": " << strerror(errno) << std::endl;
+		}
+	});
+	if (!ok) {
+		m_session.reportError("smash error: pkill: reading /proc failed");
+		m_status = 3;
 		return;
 	}
-	close(fd);
+	m_status = signalled ? 0 : 1;
+}
 
-	Command* cmd = SmallShell::getInstance().generateCommand(m_cmd_line.c_str());
-	if (cmd) {
-		cmd->execute();
-		delete cmd;
-	}
-	else {
-		std::cerr << "smash error: failed to create command" << std::endl;
-	}
 
-	// Restore stdout
-	if (dup2(stdoutBackup, STDOUT_FILENO) == -1) {
-		perror("smash error: dup2 restore failed");
+// CommandCache Class
+static const uint32_t CACHE_WATCH_EVENTS = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO
+	| IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF;
+
+CommandCache::CommandCache() : recordingValid(false), inotifyFd(-1), enabled(false) {}
+CommandCache::~CommandCache() {
+	if (inotifyFd != -1) close(inotifyFd);
+}
+bool CommandCache::isEnabled() const {
+	return enabled;
+}
+void CommandCache::setEnabled(bool enable) {
+	enabled = enable;
+	if (!enabled) {
+		invalidate();
 	}
-	close(stdoutBackup);
 }
+size_t CommandCache::size() const {
+	return entries.size();
+}
+void CommandCache::drainEvents() {
+	// Entries that watch nothing need no syscall at all
+	if (keysByWatch.empty() && recording.empty()) return;
 
-
-// ListDirCommand Class
-ListDirCommand::ListDirCommand(const char* cmd_line) : BuiltInCommand(cmd_line) {}
-ListDirCommand::~ListDirCommand() {}
-void ListDirCommand::listDirectoryRecursively(const std::string& path, const std::string& indent) const {
-	DIR* dir = opendir(path.c_str());
-	if (!dir) {
-		perror("smash error: opendir failed");
+	alignas(struct inotify_event) char buffer[4096];
+	ssize_t len;
+	while ((len = read(inotifyFd, buffer, sizeof(buffer))) > 0) {
+		for (char* ptr = buffer; ptr < buffer + len;) {
+			struct inotify_event* event = reinterpret_cast<struct inotify_event*>(ptr);
+			ptr += sizeof(struct inotify_event) + event->len;
+			if (event->mask & IN_Q_OVERFLOW) {
+				// Events were lost, so any entry may be stale
+				invalidate();
+				recordingValid = false;
+				continue;
+			}
+			if (std::find(recording.begin(), recording.end(), event->wd) != recording.end()) {
+				recordingValid = false;
+			}
+			auto it = keysByWatch.find(event->wd);
+			if (it != keysByWatch.end()) {
+				std::vector<std::string> stale = it->second;
+				for (const auto& key : stale) {
+					forget(key);
+				}
+			}
+		}
+	}
+}
+const std::string* CommandCache::lookup(const std::string& key) {
+	drainEvents();
+	auto it = entries.find(key);
+	return it == entries.end() ? nullptr : &it->second.output;
+}
+void CommandCache::beginRecording() {
+	recording.clear();
+	recordingValid = true;
+}
+void CommandCache::watch(const std::string& dir) {
+	if (!recordingValid) {
 		return;
 	}
-
-	std::vector<std::string> directories;
-	std::vector<std::string> files;
-
-	struct dirent* entry;
-	while ((entry = readdir(dir)) != nullptr) {
-		std::string name = entry->d_name;
-
-		// Skip current and parent directory symbols
-		if (name == "." || name == "..") {
+	if (inotifyFd == -1) {
+		inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (inotifyFd == -1) {
+			perror("smash error: inotify_init1 failed");
+			recordingValid = false;
+			return;
+		}
+	}
+	// A directory reached twice yields the same watch
+	int wd = inotify_add_watch(inotifyFd, dir.c_str(), CACHE_WATCH_EVENTS);
+	if (wd == -1) {
+		recordingValid = false; // Cannot observe changes, so the output must not be reused
+		return;
+	}
+	if (std::find(recording.begin(), recording.end(), wd) == recording.end()) {
+		recording.push_back(wd);
+	}
+}
+// Drops an entry together with each of its watches that no other entry or
+// the recording still uses
+void CommandCache::forget(const std::string& key) {
+	auto entry = entries.find(key);
+	if (entry == entries.end()) {
+		return;
+	}
+	for (int wd : entry->second.watches) {
+		auto it = keysByWatch.find(wd);
+		if (it == keysByWatch.end()) {
 			continue;
 		}
-
-		std::string fullPath = path + "/" + name;
-
-		if (isDirectory(fullPath)) {
-			directories.push_back(name);
+		it->second.erase(std::remove(it->second.begin(), it->second.end(), key), it->second.end());
+		if (it->second.empty()) {
+			keysByWatch.erase(it);
+			if (std::find(recording.begin(), recording.end(), wd) == recording.end()) {
+				inotify_rm_watch(inotifyFd, wd);
+			}
 		}
-		else {
-			files.push_back(name);
+	}
+	entries.erase(entry);
+}
+// Removes the watches of the recording that no entry uses
+void CommandCache::dropRecording() {
+	for (int wd : recording) {
+		if (keysByWatch.find(wd) == keysByWatch.end()) {
+			inotify_rm_watch(inotifyFd, wd);
 		}
 	}
-	closedir(dir);
-
-	// Sort directories and files alphabetically
-	std::sort(directories.begin(), directories.end());
-	std::sort(files.begin(), files.end());
-
-	// Print directories
-	for (const auto& dirName : directories) {
-		std::cout << indent << dirName << "/" << std::endl;
-		listDirectoryRecursively(path + "/" + dirName, indent + "\t");
+	recording.clear();
+	recordingValid = false;
+}
+void CommandCache::store(const std::string& key, const std::string& output) {
+	drainEvents(); // Changes made while the command ran
+	if (!recordingValid) {
+		dropRecording();
+		return;
 	}
 
-	// Print files
-	for (const auto& fileName : files) {
-		std::cout << indent << fileName << std::endl;
+	forget(key); // A replaced entry first gives up its watches
+	Entry entry;
+	entry.output = output;
+	entry.watches = recording;
+	for (int wd : entry.watches) {
+		keysByWatch[wd].push_back(key);
 	}
+	entries[key] = entry;
+	recording.clear();
+	recordingValid = false;
 }
-void ListDirCommand::execute() {
-	if (cmdSegments.size() > 2) {
-		std::cerr << "smash error: listdir: too many arguments" << std::endl;
-		return;
+void CommandCache::abandonRecording() {
+	dropRecording();
+}
+void CommandCache::invalidate() {
+	for (const auto& watch : keysByWatch) {
+		if (std::find(recording.begin(), recording.end(), watch.first) == recording.end()) {
+			inotify_rm_watch(inotifyFd, watch.first);
+		}
 	}
+	keysByWatch.clear();
+	entries.clear();
+}
 
-	// Use SmallShell::getPwd to get the current working directory if no argument is provided
-	std::string directoryPath = (cmdSegments.size() == 1)
-		? SmallShell::getInstance().getPwd()
-		: cmdSegments[1];
-
-	// Remove trailing background sign '&'
-	_trimAmp(directoryPath);
 
-	if (!isDirectory(directoryPath)) {
-		perror("smash error: listdir");
-		return;
+// CommandParser Class
+CommandParser::CommandParser() : blocks(), used(NODES_PER_BLOCK), error() {}
+CommandNode* CommandParser::newNode(CommandNode::Kind kind, CommandNode* left, CommandNode* right) {
+	if (used == NODES_PER_BLOCK) {
+		blocks.push_back(std::unique_ptr<CommandNode[]>(new CommandNode[NODES_PER_BLOCK]));
+		used = 0;
 	}
-
-	listDirectoryRecursively(directoryPath);
+	CommandNode* node = &blocks.back()[used++];
+	node->kind = kind;
+	node->left = left;
+	node->right = right;
+	node->text = nullptr;
+	node->length = 0;
+	return node;
 }
+CommandNode* CommandParser::parse(const std::string& line) {
+	// ';' binds weaker than '&&' and '||', which are left-associative
+	CommandNode* list = nullptr;
+	CommandNode* andOr = nullptr;
+	CommandNode::Kind pendingOp = CommandNode::SEQUENCE;
+	const char* data = line.c_str();
+	size_t start = 0;
+	char quote = '\0';
+	error.clear();
 
+	for (size_t i = 0; i <= line.size(); ++i) {
+		char c = i < line.size() ? data[i] : '\0';
+		if (quote) {
+			if (c == quote) quote = '\0';
+			if (c != '\0') continue;
+		}
+		if (c == '\'' || c == '"') {
+			quote = c;
+			continue;
+		}
 
-// WhoamiCommand Class
-WhoamiCommand::WhoamiCommand(const char* cmd_line) : BuiltInCommand(cmd_line) {}
-void WhoamiCommand::execute() {
-	char* username = getenv("USER"); // Retrieve the USER environment variable
-	char* homeDir = getenv("HOME");  // Retrieve the HOME environment variable
+		CommandNode::Kind op;
+		size_t opLength = 1;
+		bool keepsAmp = false; // "a & b": a keeps its '&' and runs in the background
+		if (c == ';') op = CommandNode::SEQUENCE;
+		else if (c == '&' && data[i + 1] == '&') op = CommandNode::AND, opLength = 2;
+		else if (c == '|' && data[i + 1] == '|') op = CommandNode::OR, opLength = 2;
+		else if (c == '&' && line.find_first_not_of(" \t", i + 1) != std::string::npos) {
+			op = CommandNode::SEQUENCE;
+			keepsAmp = true;
+		}
+		else if (c == '\0') op = CommandNode::SEQUENCE;
+		else continue;
 
-	if (username && homeDir) {
-		std::cout << username << " " << homeDir << std::endl;
-	}
-	else {
-		std::cerr << "smash error: whoami: failed to retrieve user information" << std::endl;
+		// The command between the previous operator and this one
+		size_t first = line.find_first_not_of(" \t", start);
+		size_t last = keepsAmp ? i + 1 : i;
+		while (last > start && isspace((unsigned char)data[last - 1])) last--;
+		if (first == std::string::npos || first >= last || (keepsAmp && first == i)) {
+			// Only a trailing ';' (or nothing at all) may follow an empty command
+			bool isEnd = c == '\0' && pendingOp == CommandNode::SEQUENCE;
+			if (!isEnd) {
+				error = c == '\0' ? "newline" : line.substr(i, opLength);
+				return nullptr;
+			}
+		}
+		else {
+			CommandNode* simple = newNode(CommandNode::SIMPLE, nullptr, nullptr);
+			simple->text = data + first;
+			simple->length = last - first;
+			andOr = andOr ? newNode(pendingOp, andOr, simple) : simple;
+		}
+
+		if (op == CommandNode::SEQUENCE && andOr) {
+			list = list ? newNode(CommandNode::SEQUENCE, list, andOr) : andOr;
+			andOr = nullptr;
+		}
+		pendingOp = op;
+		start = i + opLength;
+		i += opLength - 1;
 	}
+	return list;
+}
+const std::string& CommandParser::getError() const {
+	return error;
 }
 
 
-// SmallShell Class
-SmallShell::SmallShell()
-	: prompt("smash"), lastWorkingDir(""), foregroundPid(-1), foregroundCommand("") {
-	setupSignals();
+// ShellSession Class
+ShellSession::ShellSession(int outFd, int errFd)
+	: prompt("smash"), lastWorkingDir(""), cwdVersion(0), prevWorkingDir(""), cwdFd(-1), ownedOutBuf(new FdStreamBuf(outFd)),
+	ownedErrBuf(new FdStreamBuf(errFd)), terminalFd(outFd), errFd(errFd), outStream(ownedOutBuf.get()),
+	errStream(ownedErrBuf.get()), jobs(*this), foregroundPid(-1), foregroundCommand(""), lastStatus(0),
+	lastKind("none"), quitRequested(false), nextStep(0), asyncForeground(false), suspended(false),
+	interrupted(false) {
+	init();
 }
-SmallShell::~SmallShell() {}
-SmallShell& SmallShell::getInstance() {
-	static SmallShell instance;
-	return instance;
+ShellSession::ShellSession(std::streambuf* outBuf, std::streambuf* errBuf, int childOutFd, int childErrFd)
+	: prompt("smash"), lastWorkingDir(""), cwdVersion(0), prevWorkingDir(""), cwdFd(-1), terminalFd(childOutFd),
+	errFd(childErrFd), outStream(outBuf), errStream(errBuf), jobs(*this), foregroundPid(-1),
+	foregroundCommand(""), lastStatus(0), lastKind("none"), quitRequested(false), nextStep(0),
+	asyncForeground(false), suspended(false), interrupted(false) {
+	init();
 }
-Command* SmallShell::generateCommand(const char* cmd_line) {
+void ShellSession::init() {
+	output.stream = &outStream;
+	output.fd = terminalFd;
+	errStream.setf(std::ios::unitbuf); // Errors appear at once, like std::cerr
+	lastWorkingDir = getPwd(); // Tracked from here on by cd
+	cwdFd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (cwdFd == -1) {
+		reportError("smash error: open failed");
+	}
+
+	// Cached outputs may depend on any variable, command locations on PATH
+	env.setChangeListener([this](const std::string& name) {
+		cache.invalidate();
+		if (name == "PATH") {
+			pathCache.clear();
+		}
+		if (name == "HOME") {
+			++cwdVersion; // The prompt shows the directory relative to it
+		}
+	});
+}
+ShellSession::~ShellSession() {
+	// Builtin jobs stop early, so the worker pool is joined quickly
+	for (auto job : jobs.getJobs()) {
+		if (job->task) job->task->cancelled = true;
+	}
+	SignalRouter::releaseSession(this);
+	outStream.flush();
+	errStream.flush();
+	if (cwdFd != -1) close(cwdFd);
+}
+Command* ShellSession::generateCommand(const char* cmd_line) {
 	std::string cmd_s = _trim(std::string(cmd_line));
 	std::istringstream iss(cmd_s);
 	std::string firstWord;
@@ -826,92 +4447,352 @@ Command* SmallShell::generateCommand(const char* cmd_line) {
 	std::istringstream expandedIss(cmd_s);
 	expandedIss >> firstWord;
 
-	if (cmd_s.find('>') != std::string::npos) return new RedirectionCommand(cmd_s.c_str());
-	if (firstWord == "chprompt") return new ChangePromptCommand(cmd_s.c_str(), prompt);
-	if (firstWord == "pwd") return new GetCurrDirCommand(cmd_s.c_str());
-	if (firstWord == "showpid") return new ShowPidCommand(cmd_s.c_str());
-	if (firstWord == "cd") return new ChangeDirCommand(cmd_s.c_str());
-	if (firstWord == "jobs") return new JobsCommand(cmd_s.c_str(), &jobs);
-	if (firstWord == "kill") return new KillCommand(cmd_s.c_str(), &jobs);
-	if (firstWord == "quit") return new QuitCommand(cmd_s.c_str(), &jobs);
-	if (firstWord == "fg") return new ForegroundCommand(cmd_s.c_str(), &jobs);
-	if (firstWord == "alias") return new AliasCommand(cmd_s.c_str(), aliasMap);
-	if (firstWord == "unalias") return new UnaliasCommand(cmd_s.c_str(), aliasMap);
-	if (firstWord == "whoami") return new WhoamiCommand(cmd_s.c_str());
-
-	return new ExternalCommand(cmd_s.c_str());
-}
-void SmallShell::executeCommand(const char* cmd_line) {
-	Command* cmd = generateCommand(cmd_line);
+	if (cmd_s.find('>') != std::string::npos) return new RedirectionCommand(cmd_s.c_str(), *this);
+	if (firstWord == "chprompt") return new ChangePromptCommand(cmd_s.c_str(), *this);
+	if (firstWord == "pwd") return new GetCurrDirCommand(cmd_s.c_str(), *this);
+	if (firstWord == "showpid") return new ShowPidCommand(cmd_s.c_str(), *this);
+	if (firstWord == "cd") return new ChangeDirCommand(cmd_s.c_str(), *this);
+	if (firstWord == "jobs") return new JobsCommand(cmd_s.c_str(), *this, &jobs);
+	if (firstWord == "kill") return new KillCommand(cmd_s.c_str(), *this, &jobs);
+	if (firstWord == "quit") return new QuitCommand(cmd_s.c_str(), *this, &jobs);
+	if (firstWord == "fg") return new ForegroundCommand(cmd_s.c_str(), *this, &jobs);
+	if (firstWord == "alias") return new AliasCommand(cmd_s.c_str(), *this, aliasMap);
+	if (firstWord == "unalias") return new UnaliasCommand(cmd_s.c_str(), *this, aliasMap);
+	if (firstWord == "whoami") return new WhoamiCommand(cmd_s.c_str(), *this);
+	if (firstWord == "limit") return new LimitCommand(cmd_s.c_str(), *this);
+	if (firstWord == "taskset") return new TasksetCommand(cmd_s.c_str(), *this);
+	if (firstWord == "placement") return new PlacementCommand(cmd_s.c_str(), *this, placer);
+	if (firstWord == "timeout") return new TimeoutCommand(cmd_s.c_str(), *this);
+	if (firstWord == "listdir") return new ListDirCommand(cmd_s.c_str(), *this);
+	if (firstWord == "cache") return new CacheCommand(cmd_s.c_str(), *this);
+	if (firstWord == "joblog") return new JobLogCommand(cmd_s.c_str(), *this);
+	if (firstWord == "netinfo") return new NetInfoCommand(cmd_s.c_str(), *this);
+	if (firstWord == "pgrep") return new PgrepCommand(cmd_s.c_str(), *this);
+	if (firstWord == "pkill") return new PkillCommand(cmd_s.c_str(), *this);
+	if (firstWord == "grep") return new GrepCommand(cmd_s.c_str(), *this);
+	if (firstWord == "wc") return new WordCountCommand(cmd_s.c_str(), *this);
+	if (firstWord == "export") return new ExportCommand(cmd_s.c_str(), *this);
+	if (firstWord == "unset") return new UnsetCommand(cmd_s.c_str(), *this);
+
+	return new ExternalCommand(cmd_s.c_str(), *this);
+}
+void ShellSession::executeCommand(const char* cmd_line) {
+	currentLine = cmd_line; // Steps refer into it until the line is done
+	lastKind = "none";
+	globListings.clear(); // Listings are only reused within one line
+	CommandParser parser;
+	CommandNode* root = parser.parse(currentLine);
+	steps.clear();
+	nextStep = 0;
+	if (!root) {
+		if (!parser.getError().empty()) {
+			err() << "smash error: syntax error near `" << parser.getError() << "'" << std::endl;
+			lastStatus = 2;
+		}
+		return;
+	}
+	flatten(root, CommandNode::SEQUENCE);
+	resume();
+}
+void ShellSession::flatten(const CommandNode* node, CommandNode::Kind op) {
+	// Lists are left-associative, so the tree reads back as a flat sequence in
+	// which each command is guarded by the operator before it alone
+	if (node->kind == CommandNode::SIMPLE) {
+		Step step = { op, (size_t)(node->text - currentLine.data()), node->length };
+		steps.push_back(step);
+		return;
+	}
+	flatten(node->left, op);
+	flatten(node->right, node->kind);
+}
+void ShellSession::resume() {
+	while (nextStep < steps.size() && !quitRequested && !suspended) {
+		const Step& step = steps[nextStep++];
+		if (step.op == CommandNode::AND && lastStatus != 0) continue;
+		if (step.op == CommandNode::OR && lastStatus == 0) continue;
+		executeSimple(_expandVariables(currentLine.substr(step.offset, step.length), env, lastStatus));
+	}
+}
+void ShellSession::executeSimple(const std::string& cmd_line) {
+	// Exits recorded by the SIGCHLD handler are collected before every command,
+	// so builtins never see a job that has already finished
+	jobs.removeFinishedJobs();
+	Command* cmd = generateCommand(cmd_line.c_str());
 	if (cmd) {
-		cmd->execute();
+		std::string trimmed = _trim(cmd_line);
+		lastKind = dynamic_cast<ExternalCommand*>(cmd) ? "external" : "builtin";
+		if (!trimmed.empty() && trimmed.back() == '&') {
+			lastKind += "&";
+		}
+	}
+	if (cmd && cmd->isBackground() && cmd->canRunInBackground()) {
+		runInBackground(cmd);
+		lastStatus = 0;
+		return;
+	}
+	if (cmd) {
+		if (cache.isEnabled() && cmd->isReadOnly()) {
+			executeCached(cmd);
+		}
+		else {
+			cmd->execute();
+		}
+		if (!suspended) {
+			lastStatus = cmd->getStatus(); // Otherwise set by resumeForeground
+		}
 		delete cmd;
 	}
 }
-std::string SmallShell::getLastDir() const {
-	return lastWorkingDir;
+void ShellSession::runInBackground(Command* cmd, int outFd) {
+	std::shared_ptr<Command> command(cmd);
+	std::shared_ptr<BuiltinTask> task(new BuiltinTask());
+	jobs.addBuiltinJob(cmd->getCommandLine(), task);
+
+	builtins.submit([command, task, outFd]() {
+		std::ostringstream captured;
+		std::unique_ptr<FdStreamBuf> fileBuf(outFd != -1 ? new FdStreamBuf(outFd) : nullptr);
+		std::ostream file(fileBuf.get());
+		std::ostream* target = fileBuf ? &file : &captured;
+
+		if (!task->cancelled) {
+			command->bindTask(target, target, &task->cancelled);
+			command->execute();
+		}
+		target->flush();
+		fileBuf.reset();
+		if (outFd != -1) {
+			close(outFd);
+		}
+
+		std::lock_guard<std::mutex> guard(task->lock);
+		task->output = captured.str();
+		task->waitStatus = task->cancelled ? SIGKILL : (command->getStatus() & 0xff) << 8;
+		task->finished = true;
+		task->done.notify_all();
+	});
+}
+int ShellSession::getLastStatus() const {
+	return lastStatus;
+}
+std::string ShellSession::getLastKind() const {
+	return lastKind;
+}
+void ShellSession::executeCached(Command* cmd) {
+	std::string key = cmd->getCommandLine();
+	const std::string* cached = cache.lookup(key);
+	if (cached) {
+		out() << *cached << std::flush;
+		return;
+	}
+
+	// Capture what the command prints so that it can be replayed later
+	std::ostringstream captured;
+	OutputTarget original = output;
+	OutputTarget capture = { &captured, output.fd };
+	setOutput(capture);
+	cache.beginRecording();
+	cmd->setWatcher(&cache);
+	cmd->execute();
+	cmd->setWatcher(nullptr);
+	setOutput(original);
+
+	out() << captured.str() << std::flush;
+	if (cmd->getStatus() == 0) {
+		cache.store(key, captured.str());
+	}
+	else {
+		cache.abandonRecording();
+	}
+}
+std::string ShellSession::getLastDir() const {
+	return prevWorkingDir;
 }
-void SmallShell::setLastDir(const std::string& dir) {
-	lastWorkingDir = dir;
+void ShellSession::setLastDir(const std::string& dir) {
+	prevWorkingDir = dir;
 }
-std::string SmallShell::getPwd() const {
-	char cwd[COMMAND_MAX_LENGTH];
-	if (getcwd(cwd, sizeof(cwd)) == nullptr) {
+std::string ShellSession::getPwd() const {
+	if (!lastWorkingDir.empty()) {
+		return lastWorkingDir; // Tracked by cd, no syscall needed
+	}
+
+	// Fallback when the directory could not be determined so far;
+	// getcwd allocates a buffer as long as the path requires
+	char* cwd = getcwd(nullptr, 0);
+	if (!cwd) {
 		perror("smash error: getcwd failed");
 		return ""; // Return an empty string if getting the working directory fails
 	}
-	return std::string(cwd); // Convert to a `std::string` and return
+	std::string result(cwd);
+	free(cwd);
+	return result;
+}
+std::string ShellSession::getPrompt() const {
+	PromptTemplate::Sources sources = { &lastWorkingDir, cwdVersion, &env, jobs.size(), lastStatus };
+	return prompt.render(sources) + "> ";
 }
-std::string SmallShell::getPrompt() const {
-	return prompt + "> ";
+std::string ShellSession::getPromptName() const {
+	return prompt.getSource();
 }
-void SmallShell::setPrompt(const std::string& newPrompt) {
-	prompt = newPrompt;
+void ShellSession::setPrompt(const std::string& newPrompt) {
+	prompt = PromptTemplate(newPrompt);
 }
-JobsList& SmallShell::getJobsList() {
+JobsList& ShellSession::getJobsList() {
 	return jobs;
 }
-void SmallShell::updateWorkingDir(const std::string& newDir) {
-	if (!lastWorkingDir.empty()) {
-		prevWorkingDir = lastWorkingDir; // Save current as previous
+CpuPlacer& ShellSession::getCpuPlacer() {
+	return placer;
+}
+DeadlineQueue& ShellSession::getDeadlines() {
+	return deadlines;
+}
+JobLog& ShellSession::getJobLog() {
+	return jobLog;
+}
+void ShellSession::noteInterrupt() {
+	interrupted.store(true); // Lock-free, so safe in a signal handler
+}
+bool ShellSession::takeInterrupt() {
+	return interrupted.exchange(false);
+}
+CommandCache& ShellSession::getCommandCache() {
+	return cache;
+}
+Environment& ShellSession::getEnvironment() {
+	return env;
+}
+CommandPathCache& ShellSession::getPathCache() {
+	return pathCache;
+}
+NetworkInfo& ShellSession::getNetworkInfo() {
+	return network;
+}
+ProcessScanner& ShellSession::getProcessScanner() {
+	return processes;
+}
+DirListingCache& ShellSession::getGlobListings() {
+	return globListings;
+}
+int ShellSession::getCwdFd() const {
+	return cwdFd;
+}
+void ShellSession::setCwd(const std::string& newDir, int dirFd) {
+	std::string currentDir = getPwd();
+	if (!currentDir.empty()) {
+		prevWorkingDir = currentDir; // Save current as previous
 	}
 	lastWorkingDir = newDir; // Update to the new directory
+	++cwdVersion;
+	if (cwdFd != -1) close(cwdFd);
+	cwdFd = dirFd;
+	env.set("OLDPWD", prevWorkingDir);
+	env.set("PWD", lastWorkingDir);
+}
+std::ostream& ShellSession::out() {
+	return *output.stream;
+}
+std::ostream& ShellSession::err() {
+	return errStream;
+}
+int ShellSession::getOutFd() const {
+	return output.fd;
 }
-void SmallShell::setForegroundJob(int pid, const std::string& command) {
+int ShellSession::getErrFd() const {
+	return errFd;
+}
+int ShellSession::getTerminalFd() const {
+	return terminalFd;
+}
+ShellSession::OutputTarget ShellSession::getOutput() const {
+	return output;
+}
+void ShellSession::setOutput(const OutputTarget& target) {
+	output.stream->flush();
+	output = target;
+}
+void ShellSession::reportError(const char* message) {
+	int savedErrno = errno;
+	out().flush();
+	errStream << message << ": " << strerror(savedErrno) << std::endl;
+	errno = savedErrno;
+}
+void ShellSession::requestQuit() {
+	quitRequested = true;
+}
+bool ShellSession::hasQuit() const {
+	return quitRequested;
+}
+void ShellSession::setForegroundJob(int pid, const std::string& command) {
 	foregroundPid = pid;
 	foregroundCommand = command;
 }
-void SmallShell::clearForegroundJob() {
+void ShellSession::clearForegroundJob() {
 	foregroundPid = -1;
 	foregroundCommand.clear();
 }
-int SmallShell::getForegroundPid() const {
+void ShellSession::setAsyncForeground(bool async) {
+	asyncForeground = async;
+}
+bool ShellSession::isAsyncForeground() const {
+	return asyncForeground;
+}
+bool ShellSession::isSuspended() const {
+	return suspended;
+}
+void ShellSession::beginForeground(int pid, const std::string& command, const std::string& program,
+	const std::string& cgroupPath) {
+	setForegroundJob(pid, command);
+	foregroundChild.program = program;
+	foregroundChild.cgroupPath = cgroupPath;
+	suspended = asyncForeground;
+}
+int ShellSession::endForeground(int waitStatus) {
+	int status = _exitStatus(waitStatus);
+	if (status == 127 && !foregroundChild.program.empty()) {
+		pathCache.forget(foregroundChild.program); // Possibly a stale location
+	}
+	deadlines.cancel(foregroundPid);
+	if (!foregroundChild.cgroupPath.empty()) {
+		rmdir(foregroundChild.cgroupPath.c_str());
+	}
+	foregroundChild = ForegroundChild();
+	clearForegroundJob();
+	return status;
+}
+void ShellSession::resumeForeground(int waitStatus) {
+	lastStatus = endForeground(waitStatus);
+	suspended = false;
+	resume();
+}
+int ShellSession::getForegroundPid() const {
 	return foregroundPid;
 }
-std::string SmallShell::getForegroundCommand() const {
+std::string ShellSession::getForegroundCommand() const {
 	return foregroundCommand;
 }
-void SmallShell::setAlias(const std::string& aliasName, const std::string& aliasCommand) {
+void ShellSession::setAlias(const std::string& aliasName, const std::string& aliasCommand) {
 	if (aliasCommand == aliasName) {
-		std::cerr << "smash error: alias: alias loop detected" << std::endl;
+		err() << "smash error: alias: alias loop detected" << std::endl;
 		return;
 	}
 	aliasMap[aliasName] = aliasCommand;
 }
-void SmallShell::removeAlias(const std::string& aliasName) {
+void ShellSession::removeAlias(const std::string& aliasName) {
 	if (aliasMap.erase(aliasName) == 0) {
-		std::cerr << "smash error: unalias: alias \"" << aliasName << "\" does not exist" << std::endl;
+		err() << "smash error: unalias: alias \"" << aliasName << "\" does not exist" << std::endl;
 	}
 }
-std::string SmallShell::getAlias(const std::string& aliasName) const {
+std::string ShellSession::getAlias(const std::string& aliasName) const {
 	auto it = aliasMap.find(aliasName);
 	if (it != aliasMap.end()) {
 		return it->second;
 	}
 	return ""; // Alias not found
 }
-void SmallShell::printAliases() const {
+const std::map<std::string, std::string>& ShellSession::getAliases() const {
+	return aliasMap;
+}
+void ShellSession::printAliases() {
 	for (const auto& alias : aliasMap) {
-		std::cout << alias.first << " -> " << alias.second << std::endl;
+		out() << alias.first << " -> " << alias.second << std::endl;
 	}
 }
@@ -7,41 +7,280 @@
 #include <list>
 #include <map>
 #include <set>
+#include <queue>
+#include <unordered_map>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <deque>
+#include <cstdint>
+#include <memory>
+#include <functional>
+#include <bitset>
+#include <atomic>
+#include <ostream>
+#include <streambuf>
+#include <fcntl.h>
+#include <dirent.h>
+#include <regex.h>
+#include <sched.h>
+#include <sys/types.h>
+#include <time.h>
 
 
-// Constants
-constexpr int COMMAND_MAX_LENGTH = 200;
-constexpr int COMMAND_MAX_ARGS = 20;
+class DirListingCache;
 
+// Arguments of a parsed command line. The tokens are copied once into a
+// single character block; the pointer array lives inline for short lines and
+// grows into one heap block for long ones. argv() is ready to pass to exec.
+class ArgVector {
+public:
+    static const int INLINE_CAPACITY = 16;
+
+private:
+    std::vector<char> m_text;  // NUL-terminated tokens, reserved up front so pointers stay valid
+    char* m_inline[INLINE_CAPACITY + 1];
+    char** m_args;
+    int m_size;
+    int m_capacity;
+
+    void push(char* arg);
+    void pushText(const char* text, size_t length);
+
+public:
+    ArgVector();
+    ~ArgVector();
+    ArgVector(const ArgVector&) = delete;
+    ArgVector& operator=(const ArgVector&) = delete;
+
+    int parse(const std::string& cmd_line, DirListingCache* globListings = nullptr, int globBaseFd = AT_FDCWD);
+    void pop_back();
+    void clear();
+    int size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+    char* operator[](int i) const { return m_args[i]; }
+    char** argv() { return m_args; }
+};
+
+
+// Append-only block of NUL-terminated strings addressed by offset, so
+// growing it never invalidates a reference
+class StringPool {
+private:
+    std::vector<char> data;
+
+public:
+    size_t add(const char* text, size_t length);
+    const char* get(size_t offset) const { return data.data() + offset; }
+    size_t bytes() const { return data.size(); }
+    size_t capacity() const { return data.capacity(); }
+    void clear() { data.clear(); }
+    void release() { std::vector<char>().swap(data); }
+};
+
+// Names read back in byte order, held within a memory budget shared by all
+// the lists of one command. Names live in a StringPool and are sorted by
+// offset; once the budget is used up, sorted runs are spilled to an unlinked
+// temporary file, also shared, and merged with what is left in memory while
+// reading.
+class SortedNames {
+public:
+    struct Budget {
+        size_t limit;
+        size_t used;
+        int spillFd;      // Opened on the first spill; -2 once it cannot be written
+        off_t spillSize;
+
+        Budget() : limit(0), used(0), spillFd(-1), spillSize(0) {}
+        ~Budget();
+        Budget(const Budget&) = delete;
+        Budget& operator=(const Budget&) = delete;
+    };
+
+private:
+    struct Run {
+        off_t start;    // The run's place in the file, released once it is read
+        off_t next;     // Where the unread rest of the run starts in the file
+        off_t end;
+        std::vector<char> buffer;
+        size_t pos;     // Head name in buffer
+        size_t filled;
+    };
+    Budget& budget;
+    std::string tempDir;  // Where runs spill
+    StringPool pool;
+    std::vector<size_t> offsets;
+    size_t charged;     // What pool, offsets and run buffers count against the budget
+    std::vector<Run> runs;
+    size_t memoryPos;   // Next in-memory name
+    std::vector<int> heap;  // Sources with names left, ordered by head name; memory is -1
+    int lastSource;     // Where the name last returned came from
+    bool failed;
+
+    void recharge();
+    bool spill();
+    bool append(std::vector<char>& chunk);
+    size_t bufferSize(size_t runCount) const;
+    bool mergeRuns(size_t count);
+    const char* head(int source) const;
+    bool advance(int source);
+    bool fill(Run& run);
+    void discard(const Run& run);
+
+public:
+    SortedNames(Budget& budget, const std::string& tempDir);
+    ~SortedNames();
+    SortedNames(const SortedNames&) = delete;
+    SortedNames& operator=(const SortedNames&) = delete;
+    void add(const char* name, size_t length);
+    // Sorts what is in memory; reading starts after this
+    void finish();
+    // The next name in order, nullptr once done. Valid until the next call.
+    const char* next();
+    // A temporary file could not be written or read back
+    bool hasFailed() const;
+};
+
+// One path component of a glob, compiled to a list of tokens and matched by
+// tracking the set of reachable positions, so no input backtracks
+class GlobPattern {
+private:
+    enum Kind { LITERAL, ANY, STAR, CLASS };
+    struct Token {
+        Kind kind;
+        unsigned char ch;
+        std::bitset<256> set;
+    };
+    std::vector<Token> tokens;
+    std::vector<char> current;  // Scratch state sets reused across names
+    std::vector<char> next;
+
+    void closeOverStars(std::vector<char>& states) const;
+
+public:
+    explicit GlobPattern(const std::string& pattern);
+    bool matches(const char* name);
+};
+
+// Directory contents read while expanding the globs of one input line,
+// keyed by device and inode and revalidated against the mtime
+class DirListingCache {
+public:
+    struct Listing {
+        struct Entry {
+            size_t name;  // Offset into names
+            bool isDir;
+            bool isLink;
+        };
+        struct timespec mtime;
+        StringPool names;
+        std::vector<Entry> entries;
+    };
+
+private:
+    std::map<std::pair<dev_t, ino_t>, std::shared_ptr<Listing>> listings;
+
+public:
+    std::shared_ptr<const Listing> list(int baseFd, const std::string& path);
+    void clear();
+};
+
+class ShellSession;
 
 // Utility
 std::string _trim(const std::string& str);
-int _parseCommandLine(const std::string& cmd_line, char** args);
+int _parseCommandLine(const std::string& cmd_line, ArgVector& args, ShellSession& session);
 bool isDirectory(const std::string& path);
+std::string _resolvePath(const std::string& base, const std::string& target);
+int _openDirectory(const std::string& path);
+int _pidfdOpen(int pid);
+int _pidfdSendSignal(int pidFd, int sig);
+int _parseSignal(const std::string& text);
 void _trimAmp(std::string& cmd_line);
+bool _hasGlobChars(const std::string& word);
+bool _expandGlob(const std::string& word, int baseFd, DirListingCache& listings, StringPool& out,
+    std::vector<size_t>& matches);
 
 
-// Signal handling function prototypes
-void ctrlCHandler(int sig_num);
-void sigchldHandler(int sig_num);
-void setupSignals();
+// Stream buffer writing to a file descriptor, so that every session can print
+// to its own terminal, socket or redirection target
+class FdStreamBuf : public std::streambuf {
+private:
+    int fd;
+    char buffer[4096];
+
+    bool flushBuffer();
+
+protected:
+    int_type overflow(int_type ch) override;
+    int sync() override;
+
+public:
+    explicit FdStreamBuf(int fd);
+    ~FdStreamBuf();
+    FdStreamBuf(const FdStreamBuf&) = delete;
+    FdStreamBuf& operator=(const FdStreamBuf&) = delete;
+    int getFd() const;
+};
 
 
 class JobsList;
+class Environment;
+class CommandCache;
+class JobBoardWriter;
+
+std::string _expandVariables(const std::string& text, const Environment& env, int lastStatus);
+
+// Per-job resource limits requested with the `limit` builtin
+struct ResourceLimits {
+    long cpuSeconds;     // RLIMIT_CPU, -1 if unset
+    long long memBytes;  // RLIMIT_AS and cgroup memory.max, -1 if unset
+    long openFiles;      // RLIMIT_NOFILE, -1 if unset
+    int cpuPercent;      // cgroup cpu.max bandwidth in percent of one CPU, 0 if unset
+
+    ResourceLimits() : cpuSeconds(-1), memBytes(-1), openFiles(-1), cpuPercent(0) {}
+    bool empty() const;
+    bool needsCgroup() const;
+    std::string toString() const;
+};
 
 class Command {
 protected:
-    std::vector<std::string> cmdSegments;
+    ShellSession& m_session;
+    ArgVector cmdSegments;
     int m_PID;
     bool m_is_background;
     std::string m_cmd_line;
     std::string alias;
     std::string m_file_redirect;
+    int m_status;  // Exit status of the last execute(), 0 on success
+    std::ostream* m_out;  // Bound by background jobs; the session's streams otherwise
+    std::ostream* m_err;
+    const std::atomic<bool>* m_cancelled;
+    CommandCache* m_watcher;  // Set while the session records the output for its cache
+
+    std::ostream& out();
+    std::ostream& err();
+    void reportError(const char* message);
+    bool isCancelled() const;
 
 public:
-    Command(const char* cmd_line);
+    Command(const char* cmd_line, ShellSession& session);
     virtual ~Command();
     virtual void execute() = 0;
+    // Read-only builtins produce output that depends only on shell state and
+    // the directories they report, so their output may be memoized
+    virtual bool isReadOnly() const;
+    // Builtins that may run on the session's worker pool when followed by
+    // '&'. They take what they need from the session in their constructor and
+    // afterwards only print through out()/err() and poll isCancelled().
+    virtual bool canRunInBackground() const;
+    bool isBackground() const;
+    void bindTask(std::ostream* out, std::ostream* err, const std::atomic<bool>* cancelled);
+    // Directories the command reads must be handed to the watcher before
+    // they are read, so that changes made meanwhile are noticed
+    void setWatcher(CommandCache* watcher);
+    int getStatus() const;
     int getm_PID() const;
     void setm_PID(int pid);
     std::string getAlias() const;
@@ -53,46 +292,192 @@ public:
 
 class BuiltInCommand : public Command {
 public:
-    BuiltInCommand(const char* cmd_line);
+    BuiltInCommand(const char* cmd_line, ShellSession& session);
     virtual ~BuiltInCommand();
 };
 
+// State shared between a builtin running on the worker pool and its job
+struct BuiltinTask {
+    std::atomic<bool> cancelled;
+    std::mutex lock;
+    std::condition_variable done;
+    bool finished;       // The fields below are final once this is set
+    int waitStatus;      // As waitpid would report it, so jobs are collected alike
+    std::string output;  // What the builtin printed, unless it was redirected
+
+    BuiltinTask() : cancelled(false), finished(false), waitStatus(0) {}
+};
+
+// Worker threads running background builtins, started on first use. Work
+// still queued when the pool is destroyed is run before the workers exit.
+class BuiltinPool {
+private:
+    std::mutex lock;
+    std::condition_variable wake;
+    std::deque<std::function<void()>> queue;
+    std::vector<std::thread> workers;
+    bool stopping;
+
+    void run();
+
+public:
+    BuiltinPool();
+    ~BuiltinPool();
+    void submit(const std::function<void()>& work);
+};
+
+// Shell-wide CPU placement policy for background jobs
+class CpuPlacer {
+public:
+    enum Policy { NONE, CORES, NODES };
+
+private:
+    Policy policy;
+    std::vector<cpu_set_t> domains;  // Placement targets, visited round-robin
+    size_t nextDomain;
+
+public:
+    CpuPlacer();
+    bool setPolicy(const std::string& name);
+    std::string getPolicyName() const;
+    bool nextPlacement(cpu_set_t& cpus);
+};
+
+// Deadlines of `timeout` commands, kept in one min-heap and serviced by a
+// single timerfd. Expired jobs get SIGTERM, then SIGKILL after a grace period.
+class DeadlineQueue {
+private:
+    struct Deadline {
+        uint64_t when;        // CLOCK_MONOTONIC, nanoseconds
+        int pid;
+        unsigned generation;  // Stale entries are skipped instead of removed
+        bool isKill;          // SIGKILL escalation rather than the first SIGTERM
+        bool operator>(const Deadline& other) const { return when > other.when; }
+    };
+    struct Tracked {
+        unsigned generation;
+        uint64_t graceNs;
+        bool expired;
+        std::string command;
+        int outFd;  // Where the timeout notice is printed
+        int pidFd;  // Signals go through it; -1 without pidfd support
+    };
+
+    std::priority_queue<Deadline, std::vector<Deadline>, std::greater<Deadline>> heap;
+    std::unordered_map<int, Tracked> tracked;
+    mutable std::mutex lock;
+    unsigned nextGeneration;
+    int timerFd;
+    int wakeFd;
+    std::thread worker;
+
+    void start();
+    void run();
+    void fireExpired();
+    void rearm();
+
+public:
+    DeadlineQueue();
+    ~DeadlineQueue();
+    void add(int pid, const std::string& command, double seconds, double graceSeconds, int outFd);
+    void cancel(int pid);
+    bool hasExpired(int pid) const;
+};
+
+// Output of background jobs, captured through a pipe per job while enabled.
+// A worker thread splices each pipe into a fixed-size ring kept in a memfd,
+// so jobs never write over the prompt and draining never runs on the
+// session's thread. Rings outlive their job until the memory cap needs room.
+class JobLog {
+private:
+    struct Ring {
+        int memFd;
+        int pipeFd;        // -1 once the job closed its output
+        uint64_t written;  // Total bytes captured; the ring holds the last capacity of them
+        uint64_t order;    // Oldest finished rings are evicted first
+    };
+
+    std::unordered_map<int, Ring> rings;  // By job id
+    mutable std::mutex lock;
+    std::condition_variable changed;
+    size_t totalBytes;
+    uint64_t nextOrder;
+    bool enabled;
+    int epollFd;
+    int wakeFd;
+    std::thread worker;
+
+    void start();
+    void run();
+    void drain(int jobId);
+    void closePipe(Ring& ring);
+    bool makeRoom();
+
+public:
+    static const size_t RING_SIZE = 64 * 1024;
+    static const size_t MEMORY_LIMIT = 4 * 1024 * 1024;  // For all rings of a session
+
+    JobLog();
+    ~JobLog();
+    bool isEnabled() const;
+    void setEnabled(bool enable);
+    size_t size() const;
+    size_t memoryUsed() const;
+    // Starts a ring for the job about to be launched; returns the write end
+    // of its pipe for the child, or -1 to leave the job's output alone
+    int attach(int jobId);
+    void detach(int jobId);
+    // Appends what was captured from pos on and advances pos; false if the
+    // job has no log
+    bool read(int jobId, uint64_t& pos, std::string& data) const;
+    // Waits until output past pos arrives; false once no more can come
+    bool waitForOutput(int jobId, uint64_t pos, int timeoutMs);
+};
+
 class ExternalCommand : public Command {
+private:
+    ResourceLimits m_limits;
+    cpu_set_t m_cpus;
+    bool m_hasAffinity;
+    double m_timeout;       // Seconds, 0 if unbounded
+    double m_timeoutGrace;  // Seconds between SIGTERM and SIGKILL
+
 public:
-    ExternalCommand(const char* cmd_line);
+    ExternalCommand(const char* cmd_line, ShellSession& session);
     virtual ~ExternalCommand();
     void execute() override;
+    void setLimits(const ResourceLimits& limits);
+    void setAffinity(const cpu_set_t& cpus);
+    void setTimeout(double seconds, double graceSeconds);
 };
 
 class ChangePromptCommand : public BuiltInCommand {
-private:
-    std::string& prompt;
-
 public:
-    ChangePromptCommand(const char* cmd_line, std::string& prompt);
+    ChangePromptCommand(const char* cmd_line, ShellSession& session);
     ~ChangePromptCommand();
     void execute() override;
 };
 
 class ChangeDirCommand : public BuiltInCommand {
 public:
-    ChangeDirCommand(const char* cmd_line);
+    ChangeDirCommand(const char* cmd_line, ShellSession& session);
     ~ChangeDirCommand();
     void execute() override;
 };
 
 class ShowPidCommand : public BuiltInCommand {
 public:
-    ShowPidCommand(const char* cmd_line);
+    ShowPidCommand(const char* cmd_line, ShellSession& session);
     ~ShowPidCommand();
     void execute() override;
 };
 
 class GetCurrDirCommand : public BuiltInCommand {
 public:
-    GetCurrDirCommand(const char* cmd_line);
+    GetCurrDirCommand(const char* cmd_line, ShellSession& session);
     ~GetCurrDirCommand();
     void execute() override;
+    bool isReadOnly() const override;
 };
 
 class JobsList {
@@ -103,27 +488,49 @@ public:
         int pid;
         bool m_is_stopped;
         std::string command;
+        std::string limits;      // Human readable limits, empty if unlimited
+        std::string cgroupPath;  // Per-job cgroup to remove once the job is gone
+        std::string cpus;        // CPU list the job is pinned to, empty if unpinned
+        int routeSlot;           // SignalRouter slot reaping the job, -1 if polled
+        int pidFd;               // Refers to this process even after its pid is reused, -1 if unsupported
+        std::shared_ptr<BuiltinTask> task;  // Set for builtins on the worker pool; pid is then the shell's
+        uint64_t startedNs;      // CLOCK_REALTIME, for the status board
+        bool timedOut;           // Killed by its timeout; set once the job was reaped
 
         JobEntry(int m_job_id, int pid, const std::string& command, bool m_is_stopped)
-            : m_job_id(m_job_id), pid(pid), m_is_stopped(m_is_stopped), command(command) {}
-        ~JobEntry() {}
+            : m_job_id(m_job_id), pid(pid), m_is_stopped(m_is_stopped), command(command), routeSlot(-1), pidFd(-1),
+              startedNs(0), timedOut(false) {}
+        ~JobEntry();
+        int signal(int sig) const;
+        int signalGroup(int sig) const;
+        bool collect(int& status);
     };
 
 private:
+    ShellSession& session;
     std::list<JobEntry*> jobs;
+    std::list<JobEntry*> timedOutJobs;  // Reaped after their timeout, kept until `jobs` lists them
     int lastm_job_id;
+    JobBoardWriter* board;  // Mirrors the list for external monitors, may be null
 
 public:
-    JobsList();
+    explicit JobsList(ShellSession& session);
     ~JobsList();
     int size() const;
     const std::list<JobEntry*>& getJobs() const;
-    void addJob(const std::string& command, int pid, bool m_is_stopped = false);
-    void printJobs() const;
+    JobEntry* addJob(const std::string& command, int pid, bool m_is_stopped = false);
+    JobEntry* addBuiltinJob(const std::string& command, const std::shared_ptr<BuiltinTask>& task);
+    void printJobs();
     void removeFinishedJobs();
     JobEntry* getJobById(int m_job_id);
+    int nextJobId() const;
     void removeJobById(int m_job_id);
     void killAllJobs();
+    void terminateAllJobs(double grace);
+    // The list is republished to the board whenever it changes; publish() is
+    // for changes made from outside, such as signals sent to a job
+    void setStatusBoard(JobBoardWriter* statusBoard);
+    void publish() const;
 };
 
 class JobsCommand : public BuiltInCommand {
@@ -131,7 +538,7 @@ private:
     JobsList* m_jobsList;
 
 public:
-    JobsCommand(const char* cmd_line, JobsList* jobsList);
+    JobsCommand(const char* cmd_line, ShellSession& session, JobsList* jobsList);
     virtual ~JobsCommand();
     void execute() override;
 };
@@ -140,7 +547,7 @@ class KillCommand : public BuiltInCommand {
     JobsList* jobsList;
 
 public:
-    KillCommand(const char* cmd_line, JobsList* jobs);
+    KillCommand(const char* cmd_line, ShellSession& session, JobsList* jobs);
     ~KillCommand();
     void execute() override;
 };
@@ -149,7 +556,7 @@ class QuitCommand : public BuiltInCommand {
     JobsList* jobsList;
 
 public:
-    QuitCommand(const char* cmd_line, JobsList* jobs);
+    QuitCommand(const char* cmd_line, ShellSession& session, JobsList* jobs);
     ~QuitCommand();
     void execute() override;
 };
@@ -158,7 +565,7 @@ class ForegroundCommand : public BuiltInCommand {
     JobsList* jobsList;
 
 public:
-    ForegroundCommand(const char* cmd_line, JobsList* jobs);
+    ForegroundCommand(const char* cmd_line, ShellSession& session, JobsList* jobs);
     ~ForegroundCommand();
     void execute() override;
 };
@@ -168,7 +575,7 @@ private:
     std::map<std::string, std::string>& aliasMap;
 
 public:
-    AliasCommand(const char* cmd_line, std::map<std::string, std::string>& aliasMap);
+    AliasCommand(const char* cmd_line, ShellSession& session, std::map<std::string, std::string>& aliasMap);
     ~AliasCommand();
     void execute() override;
 };
@@ -178,7 +585,7 @@ private:
     std::map<std::string, std::string>& aliasMap;
 
 public:
-    UnaliasCommand(const char* cmd_line, std::map<std::string, std::string>& aliasMap);
+    UnaliasCommand(const char* cmd_line, ShellSession& session, std::map<std::string, std::string>& aliasMap);
     ~UnaliasCommand();
     void execute() override;
 };
@@ -188,59 +595,499 @@ private:
     bool m_isAppend;
 
 public:
-    RedirectionCommand(const char* cmd_line);
+    RedirectionCommand(const char* cmd_line, ShellSession& session);
     ~RedirectionCommand();
     void execute() override;
 };
 
 class ListDirCommand : public BuiltInCommand {
 public:
-    ListDirCommand(const char* cmd_line);
+    ListDirCommand(const char* cmd_line, ShellSession& session);
     virtual ~ListDirCommand();
     void execute() override;
+    bool isReadOnly() const override;
+    bool canRunInBackground() const override;
 
 private:
-    void listDirectoryRecursively(const std::string& path, const std::string& indent = "") const;
+    // A directory being listed. Its fd is closed while its subdirectories are
+    // listed, unless the level is an anchor that deeper levels reopen from.
+    struct Level {
+        std::string name;
+        int fd;
+    };
+
+    std::string m_directoryPath;  // Resolved on construction, as the job may run later
+    SortedNames::Budget m_budget;  // SMASH_LISTDIR_BUDGET, for the names of all open directories
+    std::string m_tempDir;         // $TMPDIR, for directories over the budget
+    std::vector<Level> m_levels;   // From the listed directory down to the current one
+    int levelFd();
+    DIR* openStream();
+    size_t readEntries(DIR* dir, SortedNames* directories, SortedNames* files);
+    void listDirectoryRecursively(const std::string& path, const std::string& indent = "");
+};
+
+class LimitCommand : public BuiltInCommand {
+public:
+    LimitCommand(const char* cmd_line, ShellSession& session);
+    virtual ~LimitCommand();
+    void execute() override;
+};
+
+class TasksetCommand : public BuiltInCommand {
+public:
+    TasksetCommand(const char* cmd_line, ShellSession& session);
+    virtual ~TasksetCommand();
+    void execute() override;
+};
+
+class PlacementCommand : public BuiltInCommand {
+private:
+    CpuPlacer& placer;
+
+public:
+    PlacementCommand(const char* cmd_line, ShellSession& session, CpuPlacer& placer);
+    virtual ~PlacementCommand();
+    void execute() override;
+};
+
+class TimeoutCommand : public BuiltInCommand {
+public:
+    TimeoutCommand(const char* cmd_line, ShellSession& session);
+    virtual ~TimeoutCommand();
+    void execute() override;
 };
 
 class WhoamiCommand : public BuiltInCommand {
 public:
-    explicit WhoamiCommand(const char* cmd_line);
+    explicit WhoamiCommand(const char* cmd_line, ShellSession& session);
     virtual ~WhoamiCommand() = default;
     void execute() override;
+    bool isReadOnly() const override;
+};
+
+class ExportCommand : public BuiltInCommand {
+public:
+    ExportCommand(const char* cmd_line, ShellSession& session);
+    virtual ~ExportCommand();
+    void execute() override;
+};
+
+class UnsetCommand : public BuiltInCommand {
+public:
+    UnsetCommand(const char* cmd_line, ShellSession& session);
+    virtual ~UnsetCommand();
+    void execute() override;
+};
+
+// In-process grep and wc for the common options; anything else, and runs
+// in the background, are handed to the external programs
+class GrepCommand : public BuiltInCommand {
+public:
+    GrepCommand(const char* cmd_line, ShellSession& session);
+    virtual ~GrepCommand();
+    void execute() override;
+};
+
+class WordCountCommand : public BuiltInCommand {
+public:
+    WordCountCommand(const char* cmd_line, ShellSession& session);
+    virtual ~WordCountCommand();
+    void execute() override;
+};
+
+class JobLogCommand : public BuiltInCommand {
+public:
+    JobLogCommand(const char* cmd_line, ShellSession& session);
+    virtual ~JobLogCommand();
+    void execute() override;
+};
+
+class NetInfoCommand : public BuiltInCommand {
+public:
+    NetInfoCommand(const char* cmd_line, ShellSession& session);
+    virtual ~NetInfoCommand();
+    void execute() override;
+};
+
+class PgrepCommand : public BuiltInCommand {
+public:
+    PgrepCommand(const char* cmd_line, ShellSession& session);
+    virtual ~PgrepCommand();
+    void execute() override;
+};
+
+class PkillCommand : public BuiltInCommand {
+public:
+    PkillCommand(const char* cmd_line, ShellSession& session);
+    virtual ~PkillCommand();
+    void execute() override;
+};
+
+class CacheCommand : public BuiltInCommand {
+public:
+    CacheCommand(const char* cmd_line, ShellSession& session);
+    virtual ~CacheCommand();
+    void execute() override;
 };
 
-class SmallShell {
+// Opt-in memoization of read-only builtin output, keyed by command line.
+// Entries are dropped on cd and when inotify reports a change in any
+// directory the command walked. While an output is recorded, the command
+// watches each directory before reading it; the output is not kept if any of
+// them changed before store().
+class CommandCache {
 private:
-    std::string prompt;
+    struct Entry {
+        std::string output;
+        std::vector<int> watches;
+    };
+
+    std::unordered_map<std::string, Entry> entries;
+    std::unordered_map<int, std::vector<std::string>> keysByWatch;
+    std::vector<int> recording;  // Watches added for the output being recorded
+    bool recordingValid;
+    int inotifyFd;
+    bool enabled;
+
+    void drainEvents();
+    void forget(const std::string& key);
+    void dropRecording();
+
+public:
+    CommandCache();
+    ~CommandCache();
+    bool isEnabled() const;
+    void setEnabled(bool enable);
+    size_t size() const;
+    const std::string* lookup(const std::string& key);
+    void beginRecording();
+    void watch(const std::string& dir);
+    // Ends the recording, keeping the output unless a watched directory changed
+    void store(const std::string& key, const std::string& output);
+    void abandonRecording();
+    void invalidate();
+};
+
+// Shell variables exported to children. The NULL-terminated envp array is
+// updated in place on every change, so launches pass it to execve as is.
+class Environment {
+private:
+    std::unordered_map<std::string, size_t> index;  // Name -> slot in envp
+    std::vector<char*> envp;                        // Owned "NAME=value" strings
+    std::function<void(const std::string&)> onChange;
+
+public:
+    Environment();
+    ~Environment();
+    Environment(const Environment&) = delete;
+    Environment& operator=(const Environment&) = delete;
+
+    const char* get(const std::string& name) const;
+    void set(const std::string& name, const std::string& value);
+    bool unset(const std::string& name);
+    char* const* getEnvp() const;
+    void setChangeListener(const std::function<void(const std::string&)>& listener);
+};
+
+// Resolved locations of external commands along PATH; resolve() returns an
+// empty string when no entry holds the command
+class CommandPathCache {
+private:
+    std::unordered_map<std::string, std::string> paths;
+
+public:
+    std::string resolve(const std::string& name, const char* pathValue, int baseFd);
+    void forget(const std::string& name);
+    void seed(const std::string& name, const std::string& path);
+    void clear();
+};
+
+// Interfaces, addresses and default routes, read through one NETLINK_ROUTE
+// socket the session keeps open, and the name servers of /etc/resolv.conf,
+// parsed again only when the file changes
+class NetworkInfo {
+public:
+    struct Interface {
+        int index;
+        std::string name;
+        unsigned flags;     // IFF_*
+        unsigned mtu;
+        std::string state;  // Operational state
+        std::string mac;    // Empty unless Ethernet
+        std::vector<std::string> addresses;  // "family address/prefix"
+    };
+    struct Route {
+        int family;
+        int interfaceIndex;
+        std::string gateway;  // Empty for routes straight onto a link
+    };
+
+private:
+    int sock;
+    uint32_t sequence;
+    std::vector<char> buffer;
+    struct timespec resolvMtime;
+    ino_t resolvInode;
+    off_t resolvSize;
+    std::vector<std::string> nameservers;
+
+    bool dump(int type, const std::function<void(const struct nlmsghdr*)>& handle);
+
+public:
+    NetworkInfo();
+    ~NetworkInfo();
+    NetworkInfo(const NetworkInfo&) = delete;
+    NetworkInfo& operator=(const NetworkInfo&) = delete;
+    // false with errno set if netlink failed
+    bool query(std::vector<Interface>& interfaces, std::vector<Route>& routes);
+    const std::vector<std::string>& getNameservers();
+};
+
+// Process selector of pgrep and pkill: an extended regex over the process
+// name, or over its command line with -f. Patterns without regex syntax are
+// matched as plain strings.
+class ProcessPattern {
+private:
+    std::string text;
+    bool fullCommand;
+    bool exact;
+    bool fixed;
+    bool compiled;
+    regex_t regex;
+
+public:
+    ProcessPattern();
+    ~ProcessPattern();
+    ProcessPattern(const ProcessPattern&) = delete;
+    ProcessPattern& operator=(const ProcessPattern&) = delete;
+    // false if the pattern is not a valid regex
+    bool compile(const std::string& pattern, bool fullCommand, bool exact, bool ignoreCase);
+    bool usesCommandLine() const;
+    bool matches(const char* subject, size_t length) const;
+};
+
+// Walks /proc with getdents64, reading each process's comm, or its cmdline
+// only when the pattern needs it. The directory stays open and the buffers
+// are kept between scans.
+// Open item: each process still costs an openat and a read, about 126ms for
+// 20k processes, well short of the few milliseconds wanted for 50k.
+class ProcessScanner {
+private:
+    int procFd;
+    std::vector<char> entries;
+    std::vector<char> commandLine;
+
+    bool readCommandLine(int pid, size_t& length);
+
+public:
+    ProcessScanner();
+    ~ProcessScanner();
+    ProcessScanner(const ProcessScanner&) = delete;
+    ProcessScanner& operator=(const ProcessScanner&) = delete;
+    // Calls found with each matching process and the text that matched, in
+    // /proc order; false with errno set if /proc could not be read
+    bool scan(const ProcessPattern& pattern, const std::function<void(int, const char*, size_t)>& found);
+};
+
+// Syntax tree of one input line. SIMPLE nodes point into the line itself,
+// so sub-commands are neither copied nor re-split while the tree is built.
+struct CommandNode {
+    enum Kind { SIMPLE, SEQUENCE, AND, OR };
+
+    Kind kind;
+    CommandNode* left;
+    CommandNode* right;
+    const char* text;  // SIMPLE only: the command, including any redirection
+    size_t length;
+};
+
+// Parses `;`, `&&` and `||` lists into CommandNodes carved out of an arena
+// that lives as long as the parser
+class CommandParser {
+private:
+    static const size_t NODES_PER_BLOCK = 32;
+
+    std::vector<std::unique_ptr<CommandNode[]>> blocks;
+    size_t used;
+    std::string error;
+
+    CommandNode* newNode(CommandNode::Kind kind, CommandNode* left, CommandNode* right);
+
+public:
+    CommandParser();
+    CommandNode* parse(const std::string& line);
+    const std::string& getError() const;
+};
+
+// A prompt template, compiled once per chprompt into segments: literal text
+// and the escapes \w (working directory, ~ for $HOME), \j (jobs), \? (last
+// exit status), \h (host name up to the first dot) and \t (HH:MM:SS); \\ is
+// a backslash. Every segment keeps its text along with the state it was made
+// from and is only remade when that changed, so a steady prompt renders
+// without system calls.
+class PromptTemplate {
+public:
+    // What the segments are made from, all kept by the session itself
+    struct Sources {
+        const std::string* cwd;
+        uint64_t cwdVersion;  // Bumped by cd and by changes of HOME
+        const Environment* env;
+        int jobs;
+        int status;
+    };
+
+private:
+    enum Kind { LITERAL, CWD, JOBS, STATUS, HOST, TIME };
+    struct Segment {
+        Kind kind;
+        std::string text;
+        int64_t key;  // Source value the text was made from
+    };
+    std::string source;
+    std::vector<Segment> segments;
+    std::string rendered;
+    bool dynamic;
+
+    int64_t keyOf(const Segment& segment, const Sources& sources) const;
+    void refresh(Segment& segment, const Sources& sources) const;
+
+public:
+    explicit PromptTemplate(const std::string& text);
+    const std::string& getSource() const;
+    const std::string& render(const Sources& sources);
+};
+
+// One interactive shell: its prompt, jobs, aliases, variables, working
+// directory and output. Sessions share nothing, so several of them may run on
+// separate threads of one process; commands reach their session through the
+// reference they are constructed with.
+class ShellSession {
+public:
+    struct OutputTarget {
+        std::ostream* stream;
+        int fd;  // What launched children get as stdout
+    };
+
+private:
+    // One simple command of the line being run, with the operator before it.
+    // Evaluation walks these in order, so it can stop and resume at any step.
+    struct Step {
+        CommandNode::Kind op;
+        size_t offset;  // Into currentLine
+        size_t length;
+    };
+    // A foreground child the session waits for
+    struct ForegroundChild {
+        std::string program;     // Forgotten by the path cache on exit 127
+        std::string cgroupPath;  // Removed once the child is gone
+    };
+
+    mutable PromptTemplate prompt;  // Caches what it rendered last
     std::string lastWorkingDir;
+    uint64_t cwdVersion;
     std::string prevWorkingDir;
+    int cwdFd;  // Relative paths resolve here; the process cwd is never changed
+    std::unique_ptr<FdStreamBuf> ownedOutBuf;  // Null when the host supplies the buffers
+    std::unique_ptr<FdStreamBuf> ownedErrBuf;
+    int terminalFd;  // Children's stdout unless redirected
+    int errFd;
+    std::ostream outStream;
+    std::ostream errStream;
+    OutputTarget output;
     JobsList jobs;
-    int foregroundPid;
+    std::atomic<int> foregroundPid;  // Read by the SIGINT handler
     std::string foregroundCommand;
     std::map<std::string, std::string> aliasMap;
-    SmallShell();
+    CpuPlacer placer;
+    DeadlineQueue deadlines;
+    JobLog jobLog;
+    CommandCache cache;
+    Environment env;
+    CommandPathCache pathCache;
+    NetworkInfo network;
+    ProcessScanner processes;
+    DirListingCache globListings;  // Valid for the line being executed
+    int lastStatus;  // $? of the last command
+    std::string lastKind;  // Of the last simple command: builtin or external, "&" appended in the background
+    bool quitRequested;
+    std::string currentLine;
+    std::vector<Step> steps;
+    size_t nextStep;
+    bool asyncForeground;  // Foreground children are waited for by the host
+    bool suspended;        // Waiting for foregroundPid before the next step
+    std::atomic<bool> interrupted;  // Set by the SIGINT handler for builtins that wait
+    ForegroundChild foregroundChild;
+    BuiltinPool builtins;  // Last, so workers are joined before anything they use goes
+    void init();
+    void executeCached(Command* cmd);
+    void flatten(const CommandNode* node, CommandNode::Kind op);
+    void resume();
+    void executeSimple(const std::string& cmd_line);
 
 public:
-    ~SmallShell();
-    static SmallShell& getInstance();
+    explicit ShellSession(int outFd = 1, int errFd = 2);
+    // For hosts that collect builtin output themselves: builtins print to the
+    // given buffers, children write to the given descriptors
+    ShellSession(std::streambuf* outBuf, std::streambuf* errBuf, int childOutFd, int childErrFd);
+    ~ShellSession();
+    ShellSession(const ShellSession&) = delete;
+    ShellSession& operator=(const ShellSession&) = delete;
     Command* generateCommand(const char* cmd_line);
     void executeCommand(const char* cmd_line);
+    // Takes over a builtin and runs it as a job on the worker pool. Its
+    // output goes to outFd, which the job closes, or is kept until the job
+    // is collected if outFd is -1.
+    void runInBackground(Command* cmd, int outFd = -1);
+    int getLastStatus() const;
+    std::string getLastKind() const;
     std::string getLastDir() const;
     void setLastDir(const std::string& dir);
     std::string getPwd() const;
+    int getCwdFd() const;
+    void setCwd(const std::string& newDir, int dirFd);
+    std::ostream& out();
+    std::ostream& err();
+    int getOutFd() const;
+    int getErrFd() const;
+    int getTerminalFd() const;
+    OutputTarget getOutput() const;
+    void setOutput(const OutputTarget& target);
+    void reportError(const char* message);
+    void requestQuit();
+    bool hasQuit() const;
     std::string getPrompt() const;
+    std::string getPromptName() const;  // As set by chprompt
     void setPrompt(const std::string& newPrompt);
-    void updateWorkingDir(const std::string& newDir);
     void setForegroundJob(int pid, const std::string& command);
     void clearForegroundJob();
+    // Foreground children: a synchronous session waits right away; with
+    // async foreground the line is suspended until the host reports the exit
+    void setAsyncForeground(bool async);
+    bool isAsyncForeground() const;
+    bool isSuspended() const;
+    void beginForeground(int pid, const std::string& command, const std::string& program,
+        const std::string& cgroupPath);
+    int endForeground(int waitStatus);
+    void resumeForeground(int waitStatus);
     int getForegroundPid() const;
     std::string getForegroundCommand() const;
     JobsList& getJobsList();
+    CpuPlacer& getCpuPlacer();
+    DeadlineQueue& getDeadlines();
+    JobLog& getJobLog();
+    void noteInterrupt();
+    bool takeInterrupt();
+    CommandCache& getCommandCache();
+    Environment& getEnvironment();
+    CommandPathCache& getPathCache();
+    NetworkInfo& getNetworkInfo();
+    ProcessScanner& getProcessScanner();
+    DirListingCache& getGlobListings();
     void setAlias(const std::string& aliasName, const std::string& aliasCommand);
     void removeAlias(const std::string& aliasName);
     std::string getAlias(const std::string& aliasName) const;
-    void printAliases() const;
+    const std::map<std::string, std::string>& getAliases() const;
+    void printAliases();
 };
 
 #endif // SMASH_COMMANDS_H_
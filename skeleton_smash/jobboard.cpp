@@ -0,0 +1,227 @@
+#include "jobboard.h"
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+static const size_t BOARD_SIZE = sizeof(JobBoardHeader) + JOB_BOARD_SLOTS * sizeof(JobBoardSlot);
+static const int SNAPSHOT_ATTEMPTS = 1000;
+
+static uint64_t _realtimeNs() {
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+std::string _jobBoardName(pid_t shellPid) {
+	return "/smash-jobs." + std::to_string(shellPid);
+}
+
+void _jobBoardSample(JobBoardSlot& slot) {
+	std::ifstream file("/proc/" + std::to_string(slot.pid) + "/stat");
+	std::string text;
+	if (!std::getline(file, text)) {
+		slot.state = JOB_EXITED;
+		return;
+	}
+
+	// The command name may hold spaces and parentheses; the fields after it
+	// start with the state, utime is the 12th of them, stime the 13th and rss
+	// the 22nd
+	size_t close = text.rfind(')');
+	std::istringstream fields(close == std::string::npos ? "" : text.substr(close + 1));
+	std::string field;
+	static const long TICKS = sysconf(_SC_CLK_TCK);
+	static const long PAGE_KB = sysconf(_SC_PAGESIZE) / 1024;
+	for (int i = 0; fields >> field; ++i) {
+		if (i == 0) {
+			slot.state = field == "T" || field == "t" ? JOB_STOPPED : field == "Z" ? JOB_EXITED : JOB_RUNNING;
+		}
+		else if (i == 11) slot.userUs = strtoull(field.c_str(), nullptr, 10) * 1000000 / TICKS;
+		else if (i == 12) slot.systemUs = strtoull(field.c_str(), nullptr, 10) * 1000000 / TICKS;
+		else if (i == 21) {
+			slot.rssKb = strtoull(field.c_str(), nullptr, 10) * PAGE_KB;
+			break;
+		}
+	}
+}
+
+
+// JobBoardWriter Class
+JobBoardWriter::JobBoardWriter() : name(_jobBoardName(getpid())), header(nullptr), slots(nullptr) {
+	// A board left behind by an earlier shell with the same pid is taken over
+	int fd = shm_open(name.c_str(), O_CREAT | O_RDWR | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd == -1) {
+		return;
+	}
+	void* mapping = MAP_FAILED;
+	if (ftruncate(fd, BOARD_SIZE) == 0) {
+		mapping = mmap(nullptr, BOARD_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	}
+	close(fd);
+	if (mapping == MAP_FAILED) {
+		shm_unlink(name.c_str());
+		return;
+	}
+
+	// Fresh pages are zeroed, so the sequence starts even
+	header = (JobBoardHeader*)mapping;
+	slots = (JobBoardSlot*)(header + 1);
+	header->magic = JOB_BOARD_MAGIC;
+	header->version = JOB_BOARD_VERSION;
+	header->headerSize = sizeof(JobBoardHeader);
+	header->slotSize = sizeof(JobBoardSlot);
+	header->capacity = JOB_BOARD_SLOTS;
+	header->shellPid = getpid();
+	header->updatedNs = _realtimeNs();
+}
+JobBoardWriter::~JobBoardWriter() {
+	if (header) {
+		munmap(header, BOARD_SIZE);
+		shm_unlink(name.c_str());
+	}
+}
+bool JobBoardWriter::isOpen() const {
+	return header != nullptr;
+}
+void JobBoardWriter::publish(const std::vector<JobBoardSlot>& jobs, size_t jobCount) {
+	if (!header) {
+		return;
+	}
+	uint32_t sequence = header->sequence.load(std::memory_order_relaxed);
+	header->sequence.store(sequence + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release); // The odd count lands before any slot changes
+
+	size_t used = std::min(jobs.size(), (size_t)JOB_BOARD_SLOTS);
+	memcpy(slots, jobs.data(), used * sizeof(JobBoardSlot));
+	header->jobCount = jobCount;
+	header->slotsUsed = used;
+	header->updatedNs = _realtimeNs();
+	++header->updates;
+
+	header->sequence.store(sequence + 2, std::memory_order_release);
+}
+
+
+// JobBoardReader Class
+JobBoardReader::JobBoardReader(pid_t shellPid) : header(nullptr), slots(nullptr) {
+	int fd = shm_open(_jobBoardName(shellPid).c_str(), O_RDONLY | O_CLOEXEC, 0);
+	if (fd == -1) {
+		return;
+	}
+	void* mapping = mmap(nullptr, BOARD_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED) {
+		return;
+	}
+	const JobBoardHeader* candidate = (const JobBoardHeader*)mapping;
+	if (candidate->magic != JOB_BOARD_MAGIC || candidate->version != JOB_BOARD_VERSION
+		|| candidate->headerSize != sizeof(JobBoardHeader) || candidate->slotSize != sizeof(JobBoardSlot)
+		|| candidate->capacity != JOB_BOARD_SLOTS) {
+		munmap(mapping, BOARD_SIZE);
+		return;
+	}
+	header = candidate;
+	slots = (const JobBoardSlot*)(header + 1);
+}
+JobBoardReader::~JobBoardReader() {
+	if (header) {
+		munmap((void*)header, BOARD_SIZE);
+	}
+}
+bool JobBoardReader::isOpen() const {
+	return header != nullptr;
+}
+bool JobBoardReader::snapshot(JobBoardSnapshot& result) const {
+	if (!header) {
+		return false;
+	}
+	for (int attempt = 0; attempt < SNAPSHOT_ATTEMPTS; ++attempt) {
+		uint32_t before = header->sequence.load(std::memory_order_acquire);
+		if (before & 1) {
+			sched_yield(); // The shell is writing
+			continue;
+		}
+		result.shellPid = header->shellPid;
+		result.jobCount = header->jobCount;
+		result.updatedNs = header->updatedNs;
+		result.updates = header->updates;
+		size_t used = std::min(header->slotsUsed, JOB_BOARD_SLOTS);
+		result.jobs.assign(slots, slots + used);
+
+		// Whatever was copied is only kept if no update started meanwhile
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (header->sequence.load(std::memory_order_relaxed) == before) {
+			return true;
+		}
+	}
+	return false;
+}
+
+
+// `smash --status`
+static const char* _stateName(uint32_t state) {
+	switch (state) {
+	case JOB_RUNNING: return "running";
+	case JOB_STOPPED: return "stopped";
+	case JOB_EXITED: return "exited";
+	case JOB_BUILTIN: return "builtin";
+	default: return "?";
+	}
+}
+
+static void _printSnapshot(const JobBoardSnapshot& board) {
+	uint64_t now = _realtimeNs();
+	std::cout << "smash " << board.shellPid << ": " << board.jobCount << " jobs, " << board.updates
+		<< " updates, last " << std::fixed << std::setprecision(1)
+		<< (now > board.updatedNs ? (now - board.updatedNs) / 1e9 : 0.0) << "s ago" << std::endl;
+	if (board.jobs.empty()) {
+		return;
+	}
+	std::cout << std::left << std::setw(6) << "job" << std::right << std::setw(8) << "pid" << "  "
+		<< std::left << std::setw(9) << "state" << std::right << std::setw(9) << "user(s)"
+		<< std::setw(9) << "sys(s)" << std::setw(10) << "rss(KB)" << std::setw(9) << "age(s)"
+		<< "  command" << std::endl;
+	for (const auto& job : board.jobs) {
+		std::cout << std::left << std::setw(6) << ("[" + std::to_string(job.jobId) + "]") << std::right
+			<< std::setw(8) << job.pid << "  " << std::left << std::setw(9) << _stateName(job.state) << std::right
+			<< std::setprecision(2) << std::setw(9) << job.userUs / 1e6 << std::setw(9) << job.systemUs / 1e6
+			<< std::setw(10) << job.rssKb << std::setprecision(1) << std::setw(9)
+			<< (now > job.startedNs ? (now - job.startedNs) / 1e9 : 0.0) << "  " << job.command << std::endl;
+	}
+	if (board.jobCount > board.jobs.size()) {
+		std::cout << "(" << board.jobCount - board.jobs.size() << " more jobs not on the board)" << std::endl;
+	}
+}
+
+int printJobBoard(pid_t shellPid, int everyMs) {
+	JobBoardReader reader(shellPid);
+	if (!reader.isOpen()) {
+		std::cerr << "smash error: --status: no job board for pid " << shellPid << std::endl;
+		return 1;
+	}
+	JobBoardSnapshot board;
+	while (true) {
+		if (!reader.snapshot(board)) {
+			std::cerr << "smash error: --status: the board kept changing" << std::endl;
+			return 1;
+		}
+		_printSnapshot(board);
+
+		// The board is unlinked with its shell, but this mapping would survive
+		if (everyMs <= 0 || (kill(shellPid, 0) == -1 && errno == ESRCH)) {
+			return 0;
+		}
+		usleep(everyMs * 1000);
+		std::cout << std::endl;
+	}
+}
@@ -0,0 +1,100 @@
+#ifndef SMASH_JOBBOARD_H_
+#define SMASH_JOBBOARD_H_
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <cstdint>
+#include <sys/types.h>
+
+// The jobs of an interactive smash, published in a shared memory segment
+// (/dev/shm/smash-jobs.<pid>) for monitors that must not disturb the shell.
+// The layout is fixed and versioned; a sequence counter, odd while the shell
+// rewrites the board, lets readers take consistent snapshots without locks.
+
+static const uint32_t JOB_BOARD_MAGIC = 0x424a4d53; // "SMJB"
+static const uint32_t JOB_BOARD_VERSION = 1;
+static const uint32_t JOB_BOARD_SLOTS = 256;
+static const size_t JOB_BOARD_COMMAND = 128; // Including the NUL; longer commands are cut
+
+enum JobBoardState : uint32_t { JOB_RUNNING, JOB_STOPPED, JOB_EXITED, JOB_BUILTIN };
+
+struct JobBoardSlot {
+    int32_t jobId;
+    int32_t pid;
+    uint32_t state;         // JobBoardState
+    uint32_t reserved;
+    uint64_t startedNs;     // CLOCK_REALTIME
+    uint64_t userUs;        // CPU time of the job's main process so far
+    uint64_t systemUs;
+    uint64_t rssKb;
+    char command[JOB_BOARD_COMMAND];
+};
+
+struct JobBoardHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t headerSize;    // sizeof(JobBoardHeader), for readers to check the layout
+    uint32_t slotSize;      // sizeof(JobBoardSlot)
+    uint32_t capacity;      // Slots following the header
+    int32_t shellPid;
+    std::atomic<uint32_t> sequence;  // Odd while an update is in progress
+    uint32_t jobCount;      // Jobs in the shell, may exceed capacity
+    uint32_t slotsUsed;
+    uint32_t reserved;
+    uint64_t updatedNs;     // CLOCK_REALTIME of the last update
+    uint64_t updates;
+};
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2, "the board's sequence must be lock-free to be shared between processes");
+
+// What a snapshot of the board holds
+struct JobBoardSnapshot {
+    pid_t shellPid;
+    uint32_t jobCount;
+    uint64_t updatedNs;
+    uint64_t updates;
+    std::vector<JobBoardSlot> jobs;
+};
+
+// Owned by the shell: creates the segment, rewrites it on every change, and
+// removes it when destroyed
+class JobBoardWriter {
+private:
+    std::string name;
+    JobBoardHeader* header;
+    JobBoardSlot* slots;
+
+public:
+    JobBoardWriter();
+    ~JobBoardWriter();
+    JobBoardWriter(const JobBoardWriter&) = delete;
+    JobBoardWriter& operator=(const JobBoardWriter&) = delete;
+    bool isOpen() const;
+    // jobCount may exceed the slots given when the board is full
+    void publish(const std::vector<JobBoardSlot>& jobs, size_t jobCount);
+};
+
+// Maps the board of another smash read-only
+class JobBoardReader {
+private:
+    const JobBoardHeader* header;
+    const JobBoardSlot* slots;
+
+public:
+    explicit JobBoardReader(pid_t shellPid);
+    ~JobBoardReader();
+    JobBoardReader(const JobBoardReader&) = delete;
+    JobBoardReader& operator=(const JobBoardReader&) = delete;
+    bool isOpen() const;
+    // Retries while the shell is mid-update, false if it never settled
+    bool snapshot(JobBoardSnapshot& result) const;
+};
+
+std::string _jobBoardName(pid_t shellPid);
+// Fills a slot's state and resource usage from /proc/<pid>/stat
+void _jobBoardSample(JobBoardSlot& slot);
+// `smash --status <pid> [--every ms]`
+int printJobBoard(pid_t shellPid, int everyMs);
+
+#endif // SMASH_JOBBOARD_H_
@@ -0,0 +1,186 @@
+// Load generator for `smash --listen`: opens many concurrent sessions on one
+// server, has every client run a command repeatedly, and reports throughput
+// and per-command latency.
+//
+// usage: loadgen <socket> [-c clients] [-n commands] [-m command]
+// Without -c, rounds of 1, 64 and 1024 clients are run.
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+
+typedef std::chrono::steady_clock Clock;
+
+static const std::string PROMPT = "lg> ";
+
+struct LoadClient {
+	enum Stage { GREETING, RENAMING, RUNNING, DONE };
+	int sock;
+	Stage stage;
+	int remaining;
+	std::string received;
+	Clock::time_point sentAt;
+};
+
+static bool _endsWith(const std::string& text, const std::string& suffix) {
+	return text.size() >= suffix.size() && text.compare(text.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+static bool _sendLine(int sock, const std::string& line) {
+	std::string data = line + "\n";
+	size_t sent = 0;
+	while (sent < data.size()) {
+		ssize_t len = send(sock, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+		if (len == -1 && errno == EINTR) continue;
+		if (len <= 0) return false;
+		sent += len;
+	}
+	return true;
+}
+
+static int _connect(const std::string& path) {
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+	int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock == -1) return -1;
+	// The listen backlog may be shorter than the round, so retry briefly
+	for (int attempt = 0; attempt < 1000; ++attempt) {
+		if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+			return sock;
+		}
+		if (errno != EAGAIN) break;
+		usleep(1000);
+	}
+	close(sock);
+	return -1;
+}
+
+static bool _runRound(const std::string& path, int clientCount, int commands, const std::string& command) {
+	int epollFd = epoll_create1(EPOLL_CLOEXEC);
+	std::vector<LoadClient> clients(clientCount);
+	for (int i = 0; i < clientCount; ++i) {
+		clients[i].sock = _connect(path);
+		if (clients[i].sock == -1) {
+			perror("loadgen: connect failed");
+			return false;
+		}
+		clients[i].stage = LoadClient::GREETING;
+		clients[i].remaining = commands;
+		struct epoll_event event;
+		event.events = EPOLLIN;
+		event.data.u32 = i;
+		epoll_ctl(epollFd, EPOLL_CTL_ADD, clients[i].sock, &event);
+	}
+
+	std::vector<double> latencies;
+	latencies.reserve((size_t)clientCount * commands);
+	Clock::time_point start = Clock::now();
+	int active = clientCount;
+	struct epoll_event events[256];
+	while (active > 0) {
+		int count = epoll_wait(epollFd, events, 256, 10000);
+		if (count == 0) {
+			std::cerr << "loadgen: server stopped responding" << std::endl;
+			return false;
+		}
+		for (int e = 0; e < count; ++e) {
+			LoadClient& client = clients[events[e].data.u32];
+			char buffer[4096];
+			ssize_t len = recv(client.sock, buffer, sizeof(buffer), MSG_DONTWAIT);
+			if (len <= 0) {
+				if (len == -1 && (errno == EAGAIN || errno == EINTR)) continue;
+				std::cerr << "loadgen: server closed a session" << std::endl;
+				return false;
+			}
+			client.received.append(buffer, len);
+
+			if (client.stage == LoadClient::GREETING && _endsWith(client.received, "smash> ")) {
+				client.received.clear();
+				client.stage = LoadClient::RENAMING;
+				_sendLine(client.sock, "chprompt " + PROMPT.substr(0, PROMPT.size() - 2));
+				continue;
+			}
+			if (!_endsWith(client.received, PROMPT)) continue;
+
+			client.received.clear();
+			if (client.stage == LoadClient::RUNNING) {
+				latencies.push_back(std::chrono::duration<double, std::micro>(Clock::now() - client.sentAt).count());
+				--client.remaining;
+			}
+			client.stage = LoadClient::RUNNING;
+			if (client.remaining == 0) {
+				client.stage = LoadClient::DONE;
+				--active;
+				continue;
+			}
+			client.sentAt = Clock::now();
+			_sendLine(client.sock, command);
+		}
+	}
+	double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+	for (auto& client : clients) {
+		close(client.sock);
+	}
+	close(epollFd);
+
+	std::sort(latencies.begin(), latencies.end());
+	size_t total = latencies.size();
+	std::cout << std::fixed << std::setprecision(1)
+		<< std::setw(8) << clientCount
+		<< std::setw(10) << total
+		<< std::setw(10) << seconds
+		<< std::setw(12) << total / seconds
+		<< std::setw(10) << latencies[total / 2]
+		<< std::setw(10) << latencies[std::min(total - 1, total * 99 / 100)]
+		<< std::setw(10) << latencies[total - 1] << std::endl;
+	return true;
+}
+
+int main(int argc, char* argv[]) {
+	if (argc < 2) {
+		std::cerr << "usage: loadgen <socket> [-c clients] [-n commands] [-m command]" << std::endl;
+		return 1;
+	}
+	std::string path = argv[1];
+	std::vector<int> rounds = { 1, 64, 1024 };
+	int commands = 200;
+	std::string command = "pwd";
+	for (int i = 2; i + 1 < argc; i += 2) {
+		std::string flag = argv[i];
+		if (flag == "-c") rounds = { atoi(argv[i + 1]) };
+		else if (flag == "-n") commands = atoi(argv[i + 1]);
+		else if (flag == "-m") command = argv[i + 1];
+	}
+	if (commands <= 0) {
+		std::cerr << "loadgen: invalid command count" << std::endl;
+		return 1;
+	}
+
+	struct rlimit files;
+	if (getrlimit(RLIMIT_NOFILE, &files) == 0) {
+		files.rlim_cur = files.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &files);
+	}
+
+	std::cout << " clients  commands   seconds    cmds/sec   p50(us)   p99(us)   max(us)" << std::endl;
+	for (int clientCount : rounds) {
+		if (clientCount <= 0 || !_runRound(path, clientCount, commands, command)) {
+			return 1;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,390 @@
+#include "rcfile.h"
+#include "Commands.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <map>
+#include <set>
+#include <vector>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+static const char SNAPSHOT_MAGIC[8] = { 'S', 'M', 'A', 'S', 'H', 'R', 'C', '\0' };
+static const uint32_t SNAPSHOT_VERSION = 2;
+
+// Fixed header of <rc>.snap, followed by payloadSize bytes of records
+struct SnapshotHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t headerSize;
+	int64_t rcMtimeSec;    // The rc file the snapshot was compiled from
+	int64_t rcMtimeNsec;
+	uint64_t rcSize;
+	uint64_t rcInode;
+	uint64_t rcDevice;
+	uint64_t rcHash;       // FNV-1a of its content
+	uint64_t payloadSize;
+};
+
+// Every record is a tag and two length-prefixed strings
+enum SnapshotTag : uint8_t {
+	DEPENDS_SET,    // A variable the file referenced, and its value
+	DEPENDS_UNSET,  // A variable the file referenced while it was unset
+	PROMPT,
+	ALIAS,
+	ENV_SET,
+	ENV_UNSET,
+	PATH_SEED,      // A command and where it was found along PATH
+};
+
+// A record as it lies in the mapped snapshot
+struct SnapshotRecord {
+	SnapshotTag tag;
+	const char* first;
+	uint32_t firstLength;
+	const char* second;
+	uint32_t secondLength;
+};
+
+static uint64_t _hashBytes(const char* data, size_t length) {
+	uint64_t hash = 14695981039346656037ull;
+	for (size_t i = 0; i < length; ++i) {
+		hash = (hash ^ (unsigned char)data[i]) * 1099511628211ull;
+	}
+	return hash;
+}
+
+static bool _sameFile(const SnapshotHeader& header, const struct stat& rc) {
+	return header.rcMtimeSec == rc.st_mtim.tv_sec && header.rcMtimeNsec == rc.st_mtim.tv_nsec
+		&& header.rcSize == (uint64_t)rc.st_size && header.rcInode == rc.st_ino && header.rcDevice == rc.st_dev;
+}
+
+static void _stampFile(SnapshotHeader& header, const struct stat& rc) {
+	header.rcMtimeSec = rc.st_mtim.tv_sec;
+	header.rcMtimeNsec = rc.st_mtim.tv_nsec;
+	header.rcSize = rc.st_size;
+	header.rcInode = rc.st_ino;
+	header.rcDevice = rc.st_dev;
+}
+
+
+// Compiling
+static const std::set<std::string> SNAPSHOT_COMMANDS = { "alias", "unalias", "chprompt", "export", "unset" };
+
+static void _collectSimple(const CommandNode* node, std::vector<std::string>& commands) {
+	if (node->kind == CommandNode::SIMPLE) {
+		commands.push_back(std::string(node->text, node->length));
+		return;
+	}
+	_collectSimple(node->left, commands);
+	_collectSimple(node->right, commands);
+}
+
+// Whether the effect of a line is fully captured by the shell state a
+// snapshot holds. Adds the variables the line expands to dependencies, and
+// those it assigns or unsets to assigned.
+static bool _isCapturable(const std::string& line, std::set<std::string>& dependencies,
+	std::set<std::string>& assigned) {
+	std::string trimmed = _trim(line);
+	if (trimmed.empty() || trimmed[0] == '#') {
+		return true;
+	}
+	CommandParser parser;
+	CommandNode* root = parser.parse(trimmed);
+	if (!root) {
+		return false;
+	}
+	std::vector<std::string> commands;
+	_collectSimple(root, commands);
+	for (const auto& command : commands) {
+		std::istringstream words(command);
+		std::string first;
+		words >> first;
+		if (!SNAPSHOT_COMMANDS.count(first)) {
+			return false;
+		}
+		// `export NAME` alone keeps whatever value the variable has
+		for (std::string word; (first == "export" || first == "unset") && words >> word;) {
+			size_t equal = word.find('=');
+			if (first == "unset" || equal != std::string::npos) {
+				assigned.insert(word.substr(0, equal));
+			}
+		}
+
+		// Redirections and background jobs leave traces outside the shell
+		char quote = '\0';
+		for (char c : command) {
+			if (quote) {
+				if (c == quote) quote = '\0';
+			}
+			else if (c == '\'' || c == '"') {
+				quote = c;
+			}
+			else if (c == '>' || c == '<' || c == '|' || c == '&') {
+				return false;
+			}
+		}
+	}
+
+	// Same rules as _expandVariables: anything outside single quotes
+	bool inQuote = false;
+	for (size_t i = 0; i < trimmed.size(); ++i) {
+		if (trimmed[i] == '\'') inQuote = !inQuote;
+		if (inQuote || trimmed[i] != '$') continue;
+		size_t start = i + 1 + (i + 1 < trimmed.size() && trimmed[i + 1] == '{');
+		size_t end = start;
+		while (end < trimmed.size() && (isalnum((unsigned char)trimmed[end]) || trimmed[end] == '_')) {
+			end++;
+		}
+		if (end > start) {
+			dependencies.insert(trimmed.substr(start, end - start));
+		}
+	}
+	return true;
+}
+
+static std::map<std::string, std::string> _environmentOf(const Environment& env) {
+	std::map<std::string, std::string> values;
+	for (char* const* entry = env.getEnvp(); *entry; ++entry) {
+		const char* equal = strchr(*entry, '=');
+		values[std::string(*entry, equal - *entry)] = equal + 1;
+	}
+	return values;
+}
+
+static void _appendRecord(std::string& payload, SnapshotTag tag, const std::string& first, const std::string& second) {
+	payload += (char)tag;
+	for (const std::string* text : { &first, &second }) {
+		uint32_t length = text->size();
+		payload.append((const char*)&length, sizeof(length));
+		payload += *text;
+	}
+}
+
+// The state the file produced on a fresh session, as differences from it.
+// Written under a temporary name and renamed, so readers never see half.
+static void _writeSnapshot(const std::string& snapPath, const struct stat& rc, uint64_t rcHash,
+	const std::set<std::string>& dependencies, const std::set<std::string>& assigned,
+	const std::map<std::string, std::string>& initialEnv, ShellSession& session) {
+	std::string payload;
+	for (const auto& name : dependencies) {
+		auto found = initialEnv.find(name);
+		if (found != initialEnv.end()) _appendRecord(payload, DEPENDS_SET, name, found->second);
+		else _appendRecord(payload, DEPENDS_UNSET, name, "");
+	}
+	_appendRecord(payload, PROMPT, session.getPromptName(), "");
+	for (const auto& alias : session.getAliases()) {
+		_appendRecord(payload, ALIAS, alias.first, alias.second);
+	}
+	// Every variable the file assigns or unsets is recorded with its final
+	// state, even where that matched the environment at compile time: a later
+	// start-up may inherit other values
+	const Environment& env = session.getEnvironment();
+	for (const auto& name : assigned) {
+		const char* value = env.get(name);
+		if (value) _appendRecord(payload, ENV_SET, name, value);
+		else _appendRecord(payload, ENV_UNSET, name, "");
+	}
+
+	// Seeds are only taken along an absolute PATH; they hold for as long as
+	// PATH, which the snapshot may set itself, is the same
+	const char* path = session.getEnvironment().get("PATH");
+	std::string pathValue = path ? path : "";
+	bool absolute = !pathValue.empty();
+	std::istringstream dirs(pathValue);
+	for (std::string dir; std::getline(dirs, dir, ':');) {
+		absolute = absolute && !dir.empty() && dir[0] == '/';
+	}
+	if (absolute) {
+		_appendRecord(payload, PATH_SEED, "", pathValue);
+		std::set<std::string> programs;
+		for (const auto& alias : session.getAliases()) {
+			std::istringstream words(alias.second);
+			std::string program;
+			words >> program;
+			if (!programs.insert(program).second) continue;
+			std::string resolved = program.empty() ? "" : session.getPathCache().resolve(program, path, AT_FDCWD);
+			if (!resolved.empty() && resolved[0] == '/' && program.find('/') == std::string::npos) {
+				_appendRecord(payload, PATH_SEED, program, resolved);
+			}
+		}
+	}
+
+	SnapshotHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+	header.version = SNAPSHOT_VERSION;
+	header.headerSize = sizeof(header);
+	_stampFile(header, rc);
+	header.rcHash = rcHash;
+	header.payloadSize = payload.size();
+
+	std::string tempPath = snapPath + ".tmp." + std::to_string(getpid());
+	int fd = open(tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd == -1) {
+		return; // No snapshot; the file is simply run every time
+	}
+	bool written = write(fd, &header, sizeof(header)) == (ssize_t)sizeof(header)
+		&& write(fd, payload.data(), payload.size()) == (ssize_t)payload.size();
+	close(fd);
+	if (!written || rename(tempPath.c_str(), snapPath.c_str()) == -1) {
+		unlink(tempPath.c_str());
+	}
+}
+
+
+// Loading
+// Reads the record at data straight from the mapping; false at the end or
+// on a truncated record
+static bool _nextRecord(const char*& data, const char* end, SnapshotRecord& record) {
+	if (data == end) {
+		return false;
+	}
+	record.tag = (SnapshotTag)*data++;
+	for (int i = 0; i < 2; ++i) {
+		uint32_t length;
+		if ((size_t)(end - data) < sizeof(length)) return false;
+		memcpy(&length, data, sizeof(length));
+		data += sizeof(length);
+		if ((size_t)(end - data) < length) return false;
+		(i == 0 ? record.first : record.second) = data;
+		(i == 0 ? record.firstLength : record.secondLength) = length;
+		data += length;
+	}
+	return true;
+}
+
+// Applies the snapshot if it belongs to the rc file and the variables it was
+// compiled against are unchanged. The rc file itself is only read, to compare
+// hashes, when its mtime, size or inode changed.
+static bool _applySnapshot(const std::string& snapPath, const std::string& rcPath, const struct stat& rc,
+	ShellSession& session) {
+	int fd = open(snapPath.c_str(), O_RDWR | O_CLOEXEC);
+	if (fd == -1) {
+		return false;
+	}
+	struct stat st;
+	void* mapping = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(SnapshotHeader)) {
+		mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+	if (mapping == MAP_FAILED) {
+		close(fd);
+		return false;
+	}
+	SnapshotHeader header;
+	memcpy(&header, mapping, sizeof(header));
+	const char* payload = (const char*)mapping + sizeof(header);
+	const char* end = (const char*)mapping + st.st_size;
+	bool valid = memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) == 0
+		&& header.version == SNAPSHOT_VERSION && header.headerSize == sizeof(header)
+		&& header.payloadSize == (uint64_t)(end - payload);
+
+	// A touched or copied file with the same content keeps its snapshot
+	if (valid && !_sameFile(header, rc)) {
+		std::ifstream file(rcPath, std::ios::binary);
+		std::string text((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+		valid = _hashBytes(text.data(), text.size()) == header.rcHash;
+		if (valid) {
+			_stampFile(header, rc);
+			if (pwrite(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header)) {} // Checked again next time
+		}
+	}
+	close(fd);
+
+	// Every record must be whole and every dependency unchanged before
+	// anything is applied
+	Environment& env = session.getEnvironment();
+	SnapshotRecord record;
+	const char* data = payload;
+	while (valid && _nextRecord(data, end, record)) {
+		if (record.tag != DEPENDS_SET && record.tag != DEPENDS_UNSET) continue;
+		const char* value = env.get(std::string(record.first, record.firstLength));
+		valid = record.tag == DEPENDS_SET
+			? value && strlen(value) == record.secondLength && memcmp(value, record.second, record.secondLength) == 0
+			: !value;
+	}
+	if (!valid || data != end) {
+		munmap(mapping, st.st_size);
+		return false;
+	}
+
+	// Variables before the seeds: setting PATH clears the path cache
+	for (data = payload; _nextRecord(data, end, record);) {
+		std::string first(record.first, record.firstLength);
+		switch (record.tag) {
+		case PROMPT: session.setPrompt(first); break;
+		case ALIAS: session.setAlias(first, std::string(record.second, record.secondLength)); break;
+		case ENV_SET: env.set(first, std::string(record.second, record.secondLength)); break;
+		case ENV_UNSET: env.unset(first); break;
+		default: break;
+		}
+	}
+	bool seeding = false;
+	for (data = payload; _nextRecord(data, end, record);) {
+		if (record.tag != PATH_SEED) continue;
+		std::string second(record.second, record.secondLength);
+		if (record.firstLength == 0) {
+			const char* path = env.get("PATH");
+			seeding = path && second == path;
+		}
+		else if (seeding) {
+			session.getPathCache().seed(std::string(record.first, record.firstLength), second);
+		}
+	}
+	munmap(mapping, st.st_size);
+	return true;
+}
+
+void loadRcFile(ShellSession& session) {
+	std::string rcPath;
+	const char* configured = getenv("SMASHRC");
+	const char* home = getenv("HOME");
+	if (configured && *configured) {
+		rcPath = configured;
+	}
+	else if (home && *home && isatty(STDIN_FILENO)) {
+		rcPath = std::string(home) + "/.smashrc";
+	}
+	struct stat rc;
+	if (rcPath.empty() || stat(rcPath.c_str(), &rc) == -1) {
+		return;
+	}
+
+	std::string snapPath = rcPath + ".snap";
+	const char* disabled = getenv("SMASH_NOSNAPSHOT");
+	bool snapshots = !disabled || strcmp(disabled, "1") != 0;
+	if (snapshots && _applySnapshot(snapPath, rcPath, rc, session)) {
+		return;
+	}
+
+	std::ifstream file(rcPath, std::ios::binary);
+	if (!file) {
+		std::cerr << "smash error: cannot read " << rcPath << std::endl;
+		return;
+	}
+	std::string text((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	std::map<std::string, std::string> initialEnv = _environmentOf(session.getEnvironment());
+
+	bool capturable = true;
+	std::set<std::string> dependencies, assigned;
+	std::istringstream lines(text);
+	for (std::string line; std::getline(lines, line) && !session.hasQuit();) {
+		capturable = _isCapturable(line, dependencies, assigned) && capturable;
+		std::string trimmed = _trim(line);
+		if (!trimmed.empty() && trimmed[0] != '#') {
+			session.executeCommand(line.c_str());
+		}
+	}
+	if (snapshots && capturable && !session.hasQuit()) {
+		_writeSnapshot(snapPath, rc, _hashBytes(text.data(), text.size()), dependencies, assigned, initialEnv,
+			session);
+	}
+	else if (snapshots) {
+		unlink(snapPath.c_str()); // Stale, and never valid again
+	}
+}
@@ -0,0 +1,20 @@
+#ifndef SMASH_RCFILE_H_
+#define SMASH_RCFILE_H_
+
+#include <string>
+
+class ShellSession;
+
+// Start-up file: $SMASHRC, or ~/.smashrc when the shell reads a terminal.
+//
+// An rc file made only of alias, unalias, chprompt, export and unset lines is
+// compiled into <rc>.snap: the resulting aliases, prompt and variables, plus
+// the resolved paths of the commands the aliases run. Later start-ups map the
+// snapshot and apply it instead of running the file, which keeps the time to
+// the first prompt nearly independent of the file's length. A snapshot is
+// used while the rc file keeps its mtime, size and inode (or, failing that,
+// its content hash) and the variables it referenced keep their values.
+// SMASH_NOSNAPSHOT=1 always runs the file.
+void loadRcFile(ShellSession& session);
+
+#endif // SMASH_RCFILE_H_
@@ -0,0 +1,157 @@
+#include "replay.h"
+#include "Commands.h"
+#include "signals.h"
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+static const char* RECORD_HEADER = "# smash record v1";
+
+static uint64_t _nowNs() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+
+// SessionRecorder Class
+SessionRecorder::SessionRecorder(const std::string& path) : file(fopen(path.c_str(), "we")), startNs(_nowNs()) {
+	if (!file) {
+		perror("smash error: --record: fopen failed");
+		return;
+	}
+	fprintf(file, "%s\n", RECORD_HEADER);
+}
+SessionRecorder::~SessionRecorder() {
+	if (file) fclose(file);
+}
+bool SessionRecorder::isOpen() const {
+	return file != nullptr;
+}
+void SessionRecorder::execute(ShellSession& session, const std::string& cmd_line) {
+	uint64_t begin = _nowNs();
+	session.executeCommand(cmd_line.c_str());
+	uint64_t end = _nowNs();
+
+	// Flushed per line, so a recording survives the shell being killed
+	fprintf(file, "%llu\t%d\t%llu\t%s\t%s\n", (unsigned long long)(begin - startNs), session.getLastStatus(),
+		(unsigned long long)(end - begin), session.getLastKind().c_str(), cmd_line.c_str());
+	fflush(file);
+}
+
+
+// Replay
+struct ReplayRecord {
+	uint64_t offsetNs;
+	int status;
+	std::string line;
+};
+
+static bool _loadRecording(const std::string& path, std::vector<ReplayRecord>& records) {
+	std::ifstream in(path);
+	if (!in) {
+		std::cerr << "smash error: --replay: cannot open " << path << std::endl;
+		return false;
+	}
+	std::string text;
+	if (!std::getline(in, text) || text != RECORD_HEADER) {
+		std::cerr << "smash error: --replay: " << path << " is not a smash recording" << std::endl;
+		return false;
+	}
+
+	// offset, status, latency, kind, line; the line itself may contain tabs
+	while (std::getline(in, text)) {
+		size_t fields[4];
+		size_t pos = 0;
+		bool valid = true;
+		for (int i = 0; i < 4 && valid; ++i) {
+			pos = text.find('\t', pos);
+			valid = pos != std::string::npos;
+			fields[i] = pos++;
+		}
+		if (!valid) {
+			std::cerr << "smash error: --replay: skipping a malformed record" << std::endl;
+			continue;
+		}
+		ReplayRecord record;
+		record.offsetNs = strtoull(text.c_str(), nullptr, 10);
+		record.status = atoi(text.c_str() + fields[0] + 1);
+		record.line = text.substr(fields[3] + 1);
+		records.push_back(record);
+	}
+	return true;
+}
+
+static double _percentileUs(const std::vector<uint64_t>& sorted, double fraction) {
+	size_t index = std::min(sorted.size() - 1, (size_t)(fraction * sorted.size()));
+	return sorted[index] / 1000.0;
+}
+
+int replaySession(const std::string& path, double speed) {
+	std::vector<ReplayRecord> records;
+	if (!_loadRecording(path, records)) {
+		return 1;
+	}
+
+	// Replayed output would only measure the terminal
+	int devNull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+	if (devNull == -1) {
+		perror("smash error: open failed");
+		return 1;
+	}
+
+	std::map<std::string, std::vector<uint64_t>> latencies; // By command kind
+	size_t mismatches = 0;
+	size_t replayed = 0;
+	uint64_t begin = _nowNs();
+	{
+		ShellSession session(devNull, devNull);
+		SignalRouter::setInteractive(&session);
+		for (const auto& record : records) {
+			if (session.hasQuit()) break;
+
+			// Keep the recorded pacing, compressed by the speed factor
+			if (speed > 0) {
+				uint64_t due = begin + (uint64_t)(record.offsetNs / speed);
+				struct timespec when;
+				when.tv_sec = due / 1000000000ull;
+				when.tv_nsec = due % 1000000000ull;
+				while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &when, nullptr) == EINTR) {}
+			}
+
+			uint64_t start = _nowNs();
+			session.executeCommand(record.line.c_str());
+			latencies[session.getLastKind()].push_back(_nowNs() - start);
+			mismatches += session.getLastStatus() != record.status;
+			++replayed;
+		}
+		SignalRouter::setInteractive(nullptr);
+	}
+	double seconds = (_nowNs() - begin) / 1e9;
+	close(devNull);
+
+	std::cout << "smash replay: " << replayed << " lines in " << std::fixed << std::setprecision(3) << seconds
+		<< "s (" << std::setprecision(1) << replayed / seconds << " lines/s), " << mismatches
+		<< " exit status mismatches" << std::endl;
+	std::cout << std::left << std::setw(10) << "kind" << std::right << std::setw(8) << "count"
+		<< std::setw(12) << "p50(us)" << std::setw(12) << "p90(us)" << std::setw(12) << "p99(us)"
+		<< std::setw(12) << "max(us)" << std::endl;
+	for (auto& entry : latencies) {
+		std::vector<uint64_t>& samples = entry.second;
+		std::sort(samples.begin(), samples.end());
+		std::cout << std::left << std::setw(10) << entry.first << std::right << std::setw(8) << samples.size()
+			<< std::setw(12) << _percentileUs(samples, 0.50) << std::setw(12) << _percentileUs(samples, 0.90)
+			<< std::setw(12) << _percentileUs(samples, 0.99) << std::setw(12) << samples.back() / 1000.0
+			<< std::endl;
+	}
+	return mismatches == 0 ? 0 : 2;
+}
@@ -0,0 +1,34 @@
+#ifndef SMASH_REPLAY_H_
+#define SMASH_REPLAY_H_
+
+#include <string>
+#include <cstdint>
+#include <cstdio>
+
+class ShellSession;
+
+// `smash --record <file>`: runs the interactive loop as usual and appends one
+// record per input line: when it was entered (monotonic nanoseconds since
+// the session started), its exit status, how long it took, the kind of its
+// last command and the line itself, separated by tabs.
+class SessionRecorder {
+private:
+    FILE* file;
+    uint64_t startNs;
+
+public:
+    explicit SessionRecorder(const std::string& path);
+    ~SessionRecorder();
+    SessionRecorder(const SessionRecorder&) = delete;
+    SessionRecorder& operator=(const SessionRecorder&) = delete;
+    bool isOpen() const;
+    void execute(ShellSession& session, const std::string& cmd_line);
+};
+
+// `smash --replay <file> [--speed N|--max]`: feeds a recording to a fresh
+// session with the original pacing, N times faster, or back to back, and
+// reports throughput and latency percentiles per command kind. Output of the
+// replayed commands is discarded.
+int replaySession(const std::string& path, double speed);
+
+#endif // SMASH_REPLAY_H_
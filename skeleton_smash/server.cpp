@@ -0,0 +1,357 @@
+#include "server.h"
+#include "Commands.h"
+#include <iostream>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+static const size_t OUTBOX_LIMIT = 1 << 20; // Pending bytes before children are throttled
+static const int MAX_EVENTS = 256;
+
+static uint64_t _eventData(int kind, int clientId) {
+	return ((uint64_t)kind << 32) | (uint32_t)clientId;
+}
+
+
+// OutboxStreamBuf Class
+OutboxStreamBuf::OutboxStreamBuf(std::string& outbox) : outbox(outbox) {}
+OutboxStreamBuf::int_type OutboxStreamBuf::overflow(int_type ch) {
+	if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+		outbox.push_back(traits_type::to_char_type(ch));
+	}
+	return traits_type::not_eof(ch);
+}
+std::streamsize OutboxStreamBuf::xsputn(const char* data, std::streamsize count) {
+	outbox.append(data, count);
+	return count;
+}
+
+
+// CommandServer::Client Class
+CommandServer::Client::Client(int id, int sock, int pipeRead, int pipeWrite)
+	: id(id), sock(sock), pipeRead(pipeRead), pipeWrite(pipeWrite), pidFd(-1), childPid(-1), pipePaused(false),
+	wantsWrite(false), closing(false), disconnected(false), outboxSent(0), outBuf(outbox),
+	session(new ShellSession(&outBuf, &outBuf, pipeWrite, pipeWrite)) {
+	session->setAsyncForeground(true);
+}
+CommandServer::Client::~Client() {
+	// A departing client takes its processes along, like a hangup would
+	if (childPid > 0) {
+		kill(-childPid, SIGKILL);
+		waitpid(childPid, nullptr, 0);
+	}
+	for (auto job : session->getJobsList().getJobs()) {
+		job->signalGroup(SIGKILL);
+		if (!job->task) {
+			waitpid(job->pid, nullptr, 0);
+		}
+	}
+	session.reset();
+	if (pidFd != -1) close(pidFd);
+	close(pipeRead);
+	close(pipeWrite);
+	close(sock);
+}
+
+
+// CommandServer Class
+CommandServer::CommandServer(const std::string& socketPath)
+	: socketPath(socketPath), listenFd(-1), epollFd(-1), nextClientId(0) {}
+CommandServer::~CommandServer() {
+	clients.clear();
+	if (listenFd != -1) {
+		close(listenFd);
+		unlink(socketPath.c_str());
+	}
+	if (epollFd != -1) close(epollFd);
+}
+bool CommandServer::watch(int fd, EventKind kind, int clientId, uint32_t events, int op) {
+	struct epoll_event event;
+	event.events = events;
+	event.data.u64 = _eventData(kind, clientId);
+	if (epoll_ctl(epollFd, op, fd, &event) == -1) {
+		perror("smash error: epoll_ctl failed");
+		return false;
+	}
+	return true;
+}
+bool CommandServer::setup() {
+	// Every client costs a socket, a pipe and a directory fd
+	struct rlimit files;
+	if (getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max) {
+		files.rlim_cur = files.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &files);
+	}
+
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (socketPath.empty() || socketPath.size() >= sizeof(addr.sun_path)) {
+		std::cerr << "smash error: --listen: invalid socket path" << std::endl;
+		return false;
+	}
+	strncpy(addr.sun_path, socketPath.c_str(), sizeof(addr.sun_path) - 1);
+
+	// A socket left behind by an earlier server is replaced, but one that
+	// still accepts connections belongs to a running server
+	struct stat st;
+	if (lstat(socketPath.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+		int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (probe == -1) {
+			perror("smash error: socket failed");
+			return false;
+		}
+		int connected = connect(probe, (struct sockaddr*)&addr, sizeof(addr));
+		int connectErrno = errno;
+		close(probe);
+		if (connected == 0 || (connectErrno != ECONNREFUSED && connectErrno != ENOENT)) {
+			std::cerr << "smash error: --listen: " << socketPath << " is in use" << std::endl;
+			return false;
+		}
+		unlink(socketPath.c_str());
+	}
+
+	listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listenFd == -1) {
+		perror("smash error: socket failed");
+		return false;
+	}
+	if (bind(listenFd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+		perror("smash error: bind failed");
+		close(listenFd);
+		listenFd = -1;
+		return false;
+	}
+	if (listen(listenFd, SOMAXCONN) == -1) {
+		perror("smash error: listen failed");
+		return false;
+	}
+
+	epollFd = epoll_create1(EPOLL_CLOEXEC);
+	if (epollFd == -1) {
+		perror("smash error: epoll_create1 failed");
+		return false;
+	}
+	return watch(listenFd, LISTENER, 0, EPOLLIN, EPOLL_CTL_ADD);
+}
+int CommandServer::run() {
+	if (!setup()) {
+		return 1;
+	}
+
+	struct epoll_event events[MAX_EVENTS];
+	while (true) {
+		int count = epoll_wait(epollFd, events, MAX_EVENTS, -1);
+		if (count == -1) {
+			if (errno == EINTR) continue;
+			perror("smash error: epoll_wait failed");
+			return 1;
+		}
+
+		for (int i = 0; i < count; ++i) {
+			int kind = events[i].data.u64 >> 32;
+			int clientId = (int)(uint32_t)events[i].data.u64;
+			if (kind == LISTENER) {
+				acceptClients();
+				continue;
+			}
+
+			auto it = clients.find(clientId);
+			if (it == clients.end()) {
+				continue; // Closed earlier in this batch
+			}
+			Client& client = *it->second;
+			if (kind == CLIENT_SOCKET) {
+				onSocketEvent(client, events[i].events);
+			}
+			else if (kind == CLIENT_PIPE) {
+				drainPipe(client);
+			}
+			else {
+				onChildExit(client);
+			}
+
+			if (!client.disconnected) {
+				flushOutbox(client);
+			}
+			if (client.disconnected || (client.closing && client.outboxSent == client.outbox.size())) {
+				closeClient(clientId);
+			}
+		}
+	}
+}
+void CommandServer::acceptClients() {
+	while (true) {
+		int sock = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (sock == -1) {
+			if (errno == EINTR) continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				perror("smash error: accept failed");
+			}
+			return;
+		}
+
+		// Children write into a blocking pipe; only the server's end is non-blocking
+		int fds[2];
+		if (pipe2(fds, O_CLOEXEC) == -1) {
+			perror("smash error: pipe failed");
+			close(sock);
+			continue;
+		}
+		fcntl(fds[0], F_SETFL, O_NONBLOCK);
+
+		int id = nextClientId++;
+		Client* client = new Client(id, sock, fds[0], fds[1]);
+		clients[id] = std::unique_ptr<Client>(client);
+		if (!watch(sock, CLIENT_SOCKET, id, EPOLLIN | EPOLLRDHUP, EPOLL_CTL_ADD) ||
+			!watch(fds[0], CLIENT_PIPE, id, EPOLLIN, EPOLL_CTL_ADD)) {
+			closeClient(id);
+			continue;
+		}
+		client->outbox += client->session->getPrompt();
+		flushOutbox(*client);
+	}
+}
+void CommandServer::onSocketEvent(Client& client, uint32_t events) {
+	if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+		char buffer[4096];
+		while (true) {
+			ssize_t len = recv(client.sock, buffer, sizeof(buffer), 0);
+			if (len > 0) {
+				client.inbox.append(buffer, len);
+				continue;
+			}
+			if (len == -1 && errno == EINTR) continue;
+			if (len == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+				client.disconnected = true;
+				return;
+			}
+			break;
+		}
+		runLines(client);
+	}
+}
+void CommandServer::runLines(Client& client) {
+	while (!client.session->isSuspended() && !client.closing) {
+		size_t newline = client.inbox.find('\n');
+		if (newline == std::string::npos) break;
+
+		std::string line = client.inbox.substr(0, newline);
+		client.inbox.erase(0, newline + 1);
+		if (!line.empty() && line.back() == '\r') line.pop_back();
+
+		client.session->executeCommand(line.c_str());
+		if (!lineStopped(client)) break;
+	}
+}
+// Called whenever the session stops evaluating. Returns true if it finished
+// the line and can take the next one.
+bool CommandServer::lineStopped(Client& client) {
+	if (client.session->isSuspended()) {
+		return watchChild(client);
+	}
+	if (client.session->hasQuit()) {
+		client.closing = true;
+		return false;
+	}
+	client.outbox += client.session->getPrompt();
+	return true;
+}
+bool CommandServer::watchChild(Client& client) {
+	client.childPid = client.session->getForegroundPid();
+	client.pidFd = _pidfdOpen(client.childPid);
+	if (client.pidFd != -1 && watch(client.pidFd, CLIENT_CHILD, client.id, EPOLLIN, EPOLL_CTL_ADD)) {
+		return false;
+	}
+
+	// Without pidfds this client is served synchronously
+	if (client.pidFd != -1) {
+		close(client.pidFd);
+		client.pidFd = -1;
+	}
+	int status = 0;
+	while (waitpid(client.childPid, &status, 0) == -1 && errno == EINTR) {}
+	client.childPid = -1;
+	drainPipe(client);
+	client.session->resumeForeground(status);
+	return lineStopped(client);
+}
+void CommandServer::onChildExit(Client& client) {
+	int status = 0;
+	pid_t result = waitpid(client.childPid, &status, WNOHANG);
+	if (result == 0) {
+		return; // Not gone yet
+	}
+
+	epoll_ctl(epollFd, EPOLL_CTL_DEL, client.pidFd, nullptr);
+	close(client.pidFd);
+	client.pidFd = -1;
+	client.childPid = -1;
+
+	// Whatever the child printed comes before the next prompt
+	drainPipe(client);
+	client.session->resumeForeground(status);
+	if (lineStopped(client)) {
+		runLines(client);
+	}
+}
+void CommandServer::drainPipe(Client& client) {
+	char buffer[65536];
+	while (!client.pipePaused) {
+		ssize_t len = read(client.pipeRead, buffer, sizeof(buffer));
+		if (len > 0) {
+			client.outbox.append(buffer, len);
+			if (client.outbox.size() - client.outboxSent > OUTBOX_LIMIT) {
+				// Children block on the full pipe until the client catches up
+				client.pipePaused = watch(client.pipeRead, CLIENT_PIPE, client.id, 0, EPOLL_CTL_MOD);
+			}
+			continue;
+		}
+		if (len == -1 && errno == EINTR) continue;
+		break;
+	}
+}
+void CommandServer::flushOutbox(Client& client) {
+	while (client.outboxSent < client.outbox.size()) {
+		ssize_t sent = send(client.sock, client.outbox.data() + client.outboxSent,
+			client.outbox.size() - client.outboxSent, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (sent > 0) {
+			client.outboxSent += sent;
+			continue;
+		}
+		if (sent == -1 && errno == EINTR) continue;
+		if (sent == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+			client.disconnected = true;
+			return;
+		}
+		break;
+	}
+	if (client.outboxSent == client.outbox.size()) {
+		client.outbox.clear();
+		client.outboxSent = 0;
+	}
+
+	bool pending = !client.outbox.empty();
+	if (pending != client.wantsWrite) {
+		uint32_t events = EPOLLIN | EPOLLRDHUP | (pending ? (uint32_t)EPOLLOUT : 0u);
+		if (watch(client.sock, CLIENT_SOCKET, client.id, events, EPOLL_CTL_MOD)) {
+			client.wantsWrite = pending;
+		}
+	}
+	if (client.pipePaused && client.outbox.size() - client.outboxSent <= OUTBOX_LIMIT / 2) {
+		if (watch(client.pipeRead, CLIENT_PIPE, client.id, EPOLLIN, EPOLL_CTL_MOD)) {
+			client.pipePaused = false;
+		}
+	}
+}
+void CommandServer::closeClient(int clientId) {
+	clients.erase(clientId); // Closing the fds removes them from the epoll set
+}
@@ -0,0 +1,84 @@
+#ifndef SMASH_SERVER_H_
+#define SMASH_SERVER_H_
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <streambuf>
+#include <unordered_map>
+#include <cstdint>
+
+class ShellSession;
+
+// Stream buffer appending to a client's pending output, so builtins never
+// block on a slow reader
+class OutboxStreamBuf : public std::streambuf {
+private:
+    std::string& outbox;
+
+protected:
+    int_type overflow(int_type ch) override;
+    std::streamsize xsputn(const char* data, std::streamsize count) override;
+
+public:
+    explicit OutboxStreamBuf(std::string& outbox);
+};
+
+// `smash --listen <socket>`: serves an independent shell session to every
+// client of a Unix domain socket. A single thread multiplexes all clients
+// with epoll: input lines, the output of builtins and children, and the exit
+// of foreground children (through pidfds) are all events, so a client
+// waiting for a long command never holds up the others.
+class CommandServer {
+private:
+    // epoll events carry the kind and the client id rather than a pointer, so
+    // events queued for a client that was just closed are simply dropped
+    enum EventKind { LISTENER, CLIENT_SOCKET, CLIENT_PIPE, CLIENT_CHILD };
+    struct Client {
+        int id;
+        int sock;
+        int pipeRead;   // Children of the session write here...
+        int pipeWrite;  // ...through this end
+        int pidFd;      // The foreground child being waited for, -1 if none
+        int childPid;
+        bool pipePaused;    // Not drained while the outbox is over its limit
+        bool wantsWrite;    // EPOLLOUT is registered for the socket
+        bool closing;       // quit was run; close once the outbox is sent
+        bool disconnected;  // The peer went away; close at once
+        std::string inbox;
+        std::string outbox;
+        size_t outboxSent;
+        OutboxStreamBuf outBuf;
+        std::unique_ptr<ShellSession> session;
+
+        Client(int id, int sock, int pipeRead, int pipeWrite);
+        ~Client();
+    };
+
+    std::string socketPath;
+    int listenFd;
+    int epollFd;
+    int nextClientId;
+    std::unordered_map<int, std::unique_ptr<Client>> clients;
+
+    bool setup();
+    bool watch(int fd, EventKind kind, int clientId, uint32_t events, int op);
+    void acceptClients();
+    void onSocketEvent(Client& client, uint32_t events);
+    void onChildExit(Client& client);
+    void runLines(Client& client);
+    bool lineStopped(Client& client);
+    bool watchChild(Client& client);
+    void drainPipe(Client& client);
+    void flushOutbox(Client& client);
+    void closeClient(int clientId);
+
+public:
+    explicit CommandServer(const std::string& socketPath);
+    ~CommandServer();
+    CommandServer(const CommandServer&) = delete;
+    CommandServer& operator=(const CommandServer&) = delete;
+    int run();
+};
+
+#endif // SMASH_SERVER_H_
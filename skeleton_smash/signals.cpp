@@ -1 +1,179 @@
 #include "signals.h"
+#include "Commands.h"
+#include <signal.h>
+#include <sched.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+SignalRouter::ChildSlot SignalRouter::slots[SignalRouter::MAX_TRACKED_CHILDREN];
+std::atomic<ShellSession*> SignalRouter::interactive(nullptr);
+static std::atomic<int> slotsInUse(0); // Slots past this were never claimed
+
+// Handlers may only use async-signal-safe calls, so no streams or allocation
+static void _writeString(int fd, const char* text) {
+	size_t length = strlen(text);
+	while (length > 0) {
+		ssize_t written = write(fd, text, length);
+		if (written == -1 && errno == EINTR) continue;
+		if (written <= 0) return;
+		text += written;
+		length -= written;
+	}
+}
+
+static void _formatInt(int value, char* out) {
+	char digits[16];
+	int count = 0;
+	do {
+		digits[count++] = '0' + value % 10;
+		value /= 10;
+	} while (value > 0);
+	while (count > 0) {
+		*out++ = digits[--count];
+	}
+	*out = '\0';
+}
+
+
+// ctrlC Handler
+void ctrlCHandler(int sig_num) {
+	(void)sig_num;
+	int savedErrno = errno;
+	ShellSession* session = SignalRouter::interactive.load();
+	int fd = session ? session->getTerminalFd() : STDOUT_FILENO;
+	int fgPid = session ? session->getForegroundPid() : -1;
+
+	_writeString(fd, "smash: got ctrl-C\n");
+	if (session) {
+		session->noteInterrupt(); // Stops builtins that wait, such as joblog -f
+	}
+
+	// The session waiting for the process clears its foreground job itself
+	if (fgPid > 0) {
+		if (kill(fgPid, SIGKILL) == -1) {
+			_writeString(STDERR_FILENO, "smash error: kill failed\n");
+		}
+		else {
+			char pid[16];
+			_formatInt(fgPid, pid);
+			_writeString(fd, "smash: process ");
+			_writeString(fd, pid);
+			_writeString(fd, " was killed\n");
+		}
+	}
+	errno = savedErrno;
+}
+
+
+// Signal handler for SIGCHLD
+void sigchldHandler(int sig_num) {
+	(void)sig_num;
+	int savedErrno = errno;
+
+	// Only background children registered by a session are reaped here;
+	// foreground children belong to the waitpid of whoever launched them
+	int used = slotsInUse.load();
+	for (int i = 0; i < used; ++i) {
+		if (SignalRouter::slots[i].state.load() == SignalRouter::RUNNING) {
+			SignalRouter::tryReap(SignalRouter::slots[i]);
+		}
+	}
+	errno = savedErrno;
+}
+
+
+// SignalRouter Class
+void SignalRouter::install() {
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = SA_RESTART; // Restart system calls if interrupted
+	sa.sa_handler = ctrlCHandler;
+	if (sigaction(SIGINT, &sa, nullptr) == -1) {
+		perror("smash error: failed to set ctrl-C handler");
+		exit(1);
+	}
+	sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+	sa.sa_handler = sigchldHandler;
+	if (sigaction(SIGCHLD, &sa, nullptr) == -1) {
+		perror("smash error: failed to set SIGCHLD handler");
+		exit(1);
+	}
+}
+void SignalRouter::setInteractive(ShellSession* session) {
+	interactive.store(session);
+}
+bool SignalRouter::tryReap(ChildSlot& slot) {
+	// Whoever moves the slot to REAPING owns the waitpid, so the handler and
+	// a polling session never race for the same child
+	int expected = RUNNING;
+	if (!slot.state.compare_exchange_strong(expected, REAPING)) {
+		return false;
+	}
+
+	int status = 0;
+	pid_t result = waitpid(slot.pid.load(), &status, WNOHANG);
+	if (result == 0) {
+		slot.state.store(RUNNING);
+		return false;
+	}
+	slot.status = result > 0 ? status : 0; // ECHILD: reaped elsewhere
+	slot.state.store(EXITED);
+	return true;
+}
+int SignalRouter::trackChild(int pid, ShellSession* owner) {
+	for (int i = 0; i < MAX_TRACKED_CHILDREN; ++i) {
+		int expected = FREE;
+		if (!slots[i].state.compare_exchange_strong(expected, CLAIMED)) continue;
+
+		slots[i].pid.store(pid);
+		slots[i].status = 0;
+		slots[i].owner = owner;
+		int used = slotsInUse.load();
+		while (used <= i && !slotsInUse.compare_exchange_weak(used, i + 1)) {}
+		slots[i].state.store(RUNNING);
+
+		tryReap(slots[i]); // The child may have exited before it was registered
+		return i;
+	}
+	return -1;
+}
+bool SignalRouter::collect(int slot, int& status) {
+	ChildSlot& entry = slots[slot];
+	if (entry.state.load() == RUNNING) {
+		tryReap(entry);
+	}
+	int expected = EXITED;
+	if (!entry.state.compare_exchange_strong(expected, FREE)) {
+		return false;
+	}
+	status = entry.status;
+	return true;
+}
+bool SignalRouter::release(int slot, int& status) {
+	ChildSlot& entry = slots[slot];
+	while (true) {
+		int state = entry.state.load();
+		if (state == REAPING) {
+			sched_yield(); // A handler is inside waitpid for this child
+			continue;
+		}
+		if (!entry.state.compare_exchange_strong(state, FREE)) {
+			continue;
+		}
+		status = entry.status;
+		return state == EXITED;
+	}
+}
+void SignalRouter::releaseSession(ShellSession* owner) {
+	int used = slotsInUse.load();
+	for (int i = 0; i < used; ++i) {
+		int state = slots[i].state.load();
+		if (state != FREE && state != CLAIMED && slots[i].owner == owner) {
+			int status;
+			release(i, status);
+		}
+	}
+}
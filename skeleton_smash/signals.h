@@ -1,5 +1,50 @@
 #ifndef SMASH_SIGNALS_H_
 #define SMASH_SIGNALS_H_
 
-#endif // SMASH_SIGNALS_H_
+#include <atomic>
+
+class ShellSession;
+
+// Signal handling function prototypes
+void ctrlCHandler(int sig_num);
+void sigchldHandler(int sig_num);
+
+// Process-wide side of signal handling. Signals are delivered to the process,
+// not to a session, so this routes them: SIGINT to the session owning the
+// terminal, child exits to the slot of the session that launched the child.
+// The handlers only touch atomics and a fixed table, never session state.
+class SignalRouter {
+public:
+    static const int MAX_TRACKED_CHILDREN = 4096;
+
+    static void install();
+    static void setInteractive(ShellSession* session);
+
+    // Registers a background child; returns its slot or -1 if the table is
+    // full, in which case the owner polls the child itself
+    static int trackChild(int pid, ShellSession* owner);
+    // Non-blocking: true once the child has exited, with its wait status
+    static bool collect(int slot, int& status);
+    // Stops tracking a child; true if it had already been reaped
+    static bool release(int slot, int& status);
+    static void releaseSession(ShellSession* owner);
 
+private:
+    enum SlotState { FREE, CLAIMED, RUNNING, REAPING, EXITED };
+    struct ChildSlot {
+        std::atomic<int> state;
+        std::atomic<int> pid;
+        int status;
+        ShellSession* owner;
+    };
+
+    static ChildSlot slots[MAX_TRACKED_CHILDREN];
+    static std::atomic<ShellSession*> interactive;
+
+    static bool tryReap(ChildSlot& slot);
+
+    friend void ctrlCHandler(int sig_num);
+    friend void sigchldHandler(int sig_num);
+};
+
+#endif // SMASH_SIGNALS_H_
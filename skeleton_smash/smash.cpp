@@ -1,26 +1,66 @@
 #include <iostream>
+#include <memory>
+#include <cstdlib>
 #include <unistd.h>
 #include <sys/wait.h>
 #include <signal.h>
 #include "Commands.h"
 #include "signals.h"
+#include "server.h"
+#include "replay.h"
+#include "jobboard.h"
+#include "rcfile.h"
 
 int main(int argc, char* argv[]) {
-    if (signal(SIGINT, ctrlCHandler) == SIG_ERR) {
-        perror("smash error: failed to set ctrl-C handler");
-        exit(1); // Exit if signal setup fails
+    SignalRouter::install();
+
+    // Serve sessions over a socket instead of the terminal
+    if (argc >= 3 && std::string(argv[1]) == "--listen") {
+        return CommandServer(argv[2]).run();
+    }
+
+    // Print the jobs another smash published, once or every few milliseconds
+    if (argc >= 3 && std::string(argv[1]) == "--status") {
+        int everyMs = argc >= 5 && std::string(argv[3]) == "--every" ? atoi(argv[4]) : 0;
+        return printJobBoard(atoi(argv[2]), everyMs);
+    }
+
+    // Re-run a recorded session and report its timings
+    if (argc >= 3 && std::string(argv[1]) == "--replay") {
+        double speed = 1;
+        if (argc >= 4 && std::string(argv[3]) == "--max") {
+            speed = 0;
+        } else if (argc >= 5 && std::string(argv[3]) == "--speed") {
+            speed = atof(argv[4]);
+            if (speed <= 0) {
+                std::cerr << "smash error: --replay: invalid speed" << std::endl;
+                return 1;
+            }
+        }
+        return replaySession(argv[2], speed);
     }
-    if (signal(SIGCHLD, sigchldHandler) == SIG_ERR) {
-        perror("smash error: failed to set SIGCHLD handler");
-        exit(1);
+
+    // Log every line with its timing for a later --replay
+    std::unique_ptr<SessionRecorder> recorder;
+    if (argc >= 3 && std::string(argv[1]) == "--record") {
+        recorder.reset(new SessionRecorder(argv[2]));
+        if (!recorder->isOpen()) {
+            return 1;
+        }
     }
 
-    SmallShell& smash = SmallShell::getInstance();
+    ShellSession smash(STDOUT_FILENO, STDERR_FILENO);
+    SignalRouter::setInteractive(&smash); // ctrl-C goes to this session
+    loadRcFile(smash);
+    JobBoardWriter board;
+    if (board.isOpen()) {
+        smash.getJobsList().setStatusBoard(&board);
+    }
 
-    while (true) {
+    while (!smash.hasQuit()) {
         // Get the current prompt
         std::string prompt = smash.getPrompt();
-        std::cout << prompt;
+        smash.out() << prompt << std::flush;
 
         // Read command line input
         std::string cmd_line;
@@ -29,8 +69,14 @@ int main(int argc, char* argv[]) {
         }
 
         // Execute the command
-        smash.executeCommand(cmd_line.c_str());
+        if (recorder) {
+            recorder->execute(smash, cmd_line);
+        } else {
+            smash.executeCommand(cmd_line.c_str());
+        }
     }
 
+    SignalRouter::setInteractive(nullptr);
+    smash.getJobsList().setStatusBoard(nullptr);
     return 0;
 }
@@ -0,0 +1,124 @@
+// Start-up benchmark for smash: measures the time from spawning the shell to
+// its first prompt, for rc files of growing length, once running the file
+// line by line and once from its compiled snapshot.
+//
+// usage: startbench [smash] [-n runs]
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+typedef std::chrono::steady_clock Clock;
+
+static const int ALIAS_COUNTS[] = { 0, 100, 1000, 10000 };
+
+// Writes an rc file of aliases, with a few variables and a prompt
+static void _writeRc(const std::string& path, int aliases) {
+	std::ofstream rc(path);
+	rc << "# generated by startbench" << std::endl;
+	rc << "export EDITOR=vi" << std::endl;
+	rc << "export PAGER=less" << std::endl;
+	for (int i = 0; i < aliases; ++i) {
+		rc << "alias a" << i << "='ls -l --color=never dir" << i << "'" << std::endl;
+	}
+	rc << "chprompt bench" << std::endl;
+}
+
+// Spawns smash and waits for its prompt; milliseconds, or -1 on failure
+static double _timeToPrompt(const std::string& smash, const std::string& rcPath, bool snapshot) {
+	int input[2], output[2];
+	if (pipe(input) == -1 || pipe(output) == -1) {
+		return -1;
+	}
+	Clock::time_point start = Clock::now();
+	pid_t pid = fork();
+	if (pid == 0) {
+		dup2(input[0], STDIN_FILENO);
+		dup2(output[1], STDOUT_FILENO);
+		close(input[0]); close(input[1]); close(output[0]); close(output[1]);
+		setenv("SMASHRC", rcPath.c_str(), 1);
+		if (!snapshot) setenv("SMASH_NOSNAPSHOT", "1", 1);
+		execl(smash.c_str(), smash.c_str(), (char*)nullptr);
+		_exit(127);
+	}
+	close(input[0]);
+	close(output[1]);
+
+	std::string received;
+	char buffer[4096];
+	double elapsed = -1;
+	ssize_t len;
+	while ((len = read(output[0], buffer, sizeof(buffer))) > 0) {
+		received.append(buffer, len);
+		if (received.find("> ") != std::string::npos) {
+			elapsed = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+			break;
+		}
+	}
+	close(input[1]); // End of input ends the shell
+	close(output[0]);
+	int status;
+	waitpid(pid, &status, 0);
+	return elapsed;
+}
+
+int main(int argc, char* argv[]) {
+	std::string smash = "./smash";
+	int runs = 20;
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (arg == "-n" && i + 1 < argc) runs = atoi(argv[++i]);
+		else smash = arg;
+	}
+	if (runs <= 0) {
+		std::cerr << "startbench: invalid run count" << std::endl;
+		return 1;
+	}
+
+	char dir[] = "/tmp/startbench-XXXXXX";
+	if (!mkdtemp(dir)) {
+		perror("startbench: mkdtemp failed");
+		return 1;
+	}
+	std::string rcPath = std::string(dir) + "/smashrc";
+
+	std::cout << " aliases  mode          p50(ms)   p90(ms)" << std::endl;
+	bool ok = true;
+	for (int aliases : ALIAS_COUNTS) {
+		_writeRc(rcPath, aliases);
+		unlink((rcPath + ".snap").c_str());
+		_timeToPrompt(smash, rcPath, true); // Compiles the snapshot
+
+		for (bool snapshot : { false, true }) {
+			std::vector<double> times;
+			for (int i = 0; i < runs; ++i) {
+				double ms = _timeToPrompt(smash, rcPath, snapshot);
+				if (ms < 0) {
+					std::cerr << "startbench: no prompt from " << smash << std::endl;
+					ok = false;
+					break;
+				}
+				times.push_back(ms);
+			}
+			if (!ok) break;
+			std::sort(times.begin(), times.end());
+			std::cout << std::fixed << std::setprecision(2) << std::setw(8) << aliases << "  "
+				<< std::left << std::setw(10) << (snapshot ? "snapshot" : "rc file") << std::right
+				<< std::setw(10) << times[times.size() / 2]
+				<< std::setw(10) << times[std::min(times.size() - 1, times.size() * 9 / 10)] << std::endl;
+		}
+		if (!ok) break;
+	}
+
+	unlink(rcPath.c_str());
+	unlink((rcPath + ".snap").c_str());
+	rmdir(dir);
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,175 @@
+#include "textscan.h"
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SMASH_HAVE_X86 1
+#endif
+
+enum ScanLevel { SCALAR, SSE2, AVX2 };
+
+static ScanLevel _detectLevel() {
+	ScanLevel best = SCALAR;
+#ifdef SMASH_HAVE_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2")) best = SSE2;
+	if (__builtin_cpu_supports("avx2")) best = AVX2;
+#endif
+
+	// SMASH_SIMD can only lower the level, never enable what the CPU lacks
+	const char* forced = getenv("SMASH_SIMD");
+	if (forced) {
+		if (strcmp(forced, "scalar") == 0) best = SCALAR;
+		else if (strcmp(forced, "sse2") == 0 && best > SSE2) best = SSE2;
+	}
+	return best;
+}
+
+static ScanLevel _level() {
+	static const ScanLevel level = _detectLevel();
+	return level;
+}
+
+
+// Scalar kernels
+static size_t _countByteScalar(const char* data, size_t length, char byte) {
+	size_t count = 0;
+	const char* end = data + length;
+	while ((data = (const char*)memchr(data, byte, end - data)) != nullptr) {
+		++count;
+		++data;
+	}
+	return count;
+}
+
+static const char* _findBytesScalar(const char* haystack, size_t length, const char* needle, size_t needleLength) {
+	return (const char*)memmem(haystack, length, needle, needleLength);
+}
+
+
+#ifdef SMASH_HAVE_X86
+// Matches are counted in 8-bit lanes by subtracting the all-ones compare
+// result, and folded into 64-bit sums with psadbw before a lane can overflow
+__attribute__((target("sse2")))
+static size_t _countByteSse2(const char* data, size_t length, char byte) {
+	const __m128i target = _mm_set1_epi8(byte);
+	const __m128i zero = _mm_setzero_si128();
+	__m128i totals = _mm_setzero_si128();
+	size_t i = 0;
+	while (i + 16 <= length) {
+		__m128i counts = _mm_setzero_si128();
+		for (int round = 0; round < 255 && i + 16 <= length; ++round, i += 16) {
+			__m128i chunk = _mm_loadu_si128((const __m128i*)(data + i));
+			counts = _mm_sub_epi8(counts, _mm_cmpeq_epi8(chunk, target));
+		}
+		totals = _mm_add_epi64(totals, _mm_sad_epu8(counts, zero));
+	}
+	uint64_t lanes[2];
+	_mm_storeu_si128((__m128i*)lanes, totals);
+	return lanes[0] + lanes[1] + _countByteScalar(data + i, length - i, byte);
+}
+
+__attribute__((target("avx2")))
+static size_t _countByteAvx2(const char* data, size_t length, char byte) {
+	const __m256i target = _mm256_set1_epi8(byte);
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i totals = _mm256_setzero_si256();
+	size_t i = 0;
+	while (i + 32 <= length) {
+		__m256i counts = _mm256_setzero_si256();
+		for (int round = 0; round < 255 && i + 32 <= length; ++round, i += 32) {
+			__m256i chunk = _mm256_loadu_si256((const __m256i*)(data + i));
+			counts = _mm256_sub_epi8(counts, _mm256_cmpeq_epi8(chunk, target));
+		}
+		totals = _mm256_add_epi64(totals, _mm256_sad_epu8(counts, zero));
+	}
+	uint64_t lanes[4];
+	_mm256_storeu_si256((__m256i*)lanes, totals);
+	return lanes[0] + lanes[1] + lanes[2] + lanes[3] + _countByteScalar(data + i, length - i, byte);
+}
+
+// Candidate positions are those where both the first and the last byte of
+// the needle match; only those are compared in full. Needles of two bytes
+// or more only, the caller handles the rest.
+__attribute__((target("sse2")))
+static const char* _findBytesSse2(const char* haystack, size_t length, const char* needle, size_t needleLength) {
+	const __m128i first = _mm_set1_epi8(needle[0]);
+	const __m128i last = _mm_set1_epi8(needle[needleLength - 1]);
+	size_t i = 0;
+	for (; i + needleLength - 1 + 16 <= length; i += 16) {
+		__m128i head = _mm_loadu_si128((const __m128i*)(haystack + i));
+		__m128i tail = _mm_loadu_si128((const __m128i*)(haystack + i + needleLength - 1));
+		unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(head, first), _mm_cmpeq_epi8(tail, last)));
+		while (mask != 0) {
+			unsigned bit = __builtin_ctz(mask);
+			if (memcmp(haystack + i + bit + 1, needle + 1, needleLength - 2) == 0) {
+				return haystack + i + bit;
+			}
+			mask &= mask - 1;
+		}
+	}
+	return _findBytesScalar(haystack + i, length - i, needle, needleLength);
+}
+
+__attribute__((target("avx2")))
+static const char* _findBytesAvx2(const char* haystack, size_t length, const char* needle, size_t needleLength) {
+	const __m256i first = _mm256_set1_epi8(needle[0]);
+	const __m256i last = _mm256_set1_epi8(needle[needleLength - 1]);
+	size_t i = 0;
+	for (; i + needleLength - 1 + 32 <= length; i += 32) {
+		__m256i head = _mm256_loadu_si256((const __m256i*)(haystack + i));
+		__m256i tail = _mm256_loadu_si256((const __m256i*)(haystack + i + needleLength - 1));
+		unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(head, first),
+			_mm256_cmpeq_epi8(tail, last)));
+		while (mask != 0) {
+			unsigned bit = __builtin_ctz(mask);
+			if (memcmp(haystack + i + bit + 1, needle + 1, needleLength - 2) == 0) {
+				return haystack + i + bit;
+			}
+			mask &= mask - 1;
+		}
+	}
+	return _findBytesScalar(haystack + i, length - i, needle, needleLength);
+}
+#endif
+
+
+// Dispatch
+size_t _countByte(const char* data, size_t length, char byte) {
+#ifdef SMASH_HAVE_X86
+	switch (_level()) {
+	case AVX2: return _countByteAvx2(data, length, byte);
+	case SSE2: return _countByteSse2(data, length, byte);
+	default: break;
+	}
+#endif
+	return _countByteScalar(data, length, byte);
+}
+const char* _findBytes(const char* haystack, size_t length, const char* needle, size_t needleLength) {
+	if (needleLength == 0) {
+		return haystack;
+	}
+	if (needleLength > length) {
+		return nullptr;
+	}
+	if (needleLength == 1) {
+		return (const char*)memchr(haystack, needle[0], length); // Already vectorized by libc
+	}
+#ifdef SMASH_HAVE_X86
+	switch (_level()) {
+	case AVX2: return _findBytesAvx2(haystack, length, needle, needleLength);
+	case SSE2: return _findBytesSse2(haystack, length, needle, needleLength);
+	default: break;
+	}
+#endif
+	return _findBytesScalar(haystack, length, needle, needleLength);
+}
+const char* _scanLevel() {
+	switch (_level()) {
+	case AVX2: return "avx2";
+	case SSE2: return "sse2";
+	default: return "scalar";
+	}
+}
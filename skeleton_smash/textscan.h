@@ -0,0 +1,19 @@
+#ifndef SMASH_TEXTSCAN_H_
+#define SMASH_TEXTSCAN_H_
+
+#include <cstddef>
+
+// Byte counting and substring search over large buffers, for the grep and
+// wc builtins. Each has AVX2, SSE2 and scalar kernels; the best one the CPU
+// supports is picked on first use. SMASH_SIMD=avx2|sse2|scalar caps the
+// choice, for comparing kernels.
+
+// Occurrences of byte in data[0, length)
+size_t _countByte(const char* data, size_t length, char byte);
+// First occurrence of needle in haystack, nullptr if none. An empty needle
+// matches at the start.
+const char* _findBytes(const char* haystack, size_t length, const char* needle, size_t needleLength);
+// Name of the kernels in use: "avx2", "sse2" or "scalar"
+const char* _scanLevel();
+
+#endif // SMASH_TEXTSCAN_H_